@@ -77,8 +77,19 @@ struct attribute *nfb_char_attrs[] = {
 	NULL,
 };
 
+static umode_t nfb_char_attr_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct nfb_device *nfb = dev_get_drvdata(kobj_to_dev(kobj));
+
+	/* Simulated card has no PCI device */
+	if (attr == &dev_attr_pcislot.attr && nfb->pci == NULL)
+		return 0;
+	return attr->mode;
+}
+
 struct attribute_group nfb_char_attr_group = {
 	.attrs = nfb_char_attrs,
+	.is_visible = nfb_char_attr_is_visible,
 };
 
 const struct attribute_group *nfb_char_attr_groups[] = {
@@ -458,7 +469,7 @@ int nfb_char_probe(struct nfb_device *nfb)
 {
 	int ret = -ENOMEM;
 
-	nfb->dev = device_create_with_groups(nfb_class, &nfb->pci->dev, MKDEV(nfb_major, nfb->minor),
+	nfb->dev = device_create_with_groups(nfb_class, nfb->dma_dev, MKDEV(nfb_major, nfb->minor),
 			nfb, nfb_char_attr_groups, "nfb%d", nfb->minor);
 	if (nfb->dev == NULL) {
 		goto err_device_create;
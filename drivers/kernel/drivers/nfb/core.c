@@ -27,6 +27,7 @@
 #include "ndp_netdev/core.h"
 #include "hwmon/nfb_hwmon.h"
 #include "xdp/driver.h"
+#include "sim/sim.h"
 
 MODULE_VERSION(PACKAGE_VERSION);
 MODULE_AUTHOR("CESNET; Martin Spinler <spinler@cesnet.cz>");
@@ -153,6 +154,7 @@ struct nfb_device *nfb_create(void)
 	INIT_LIST_HEAD(&nfb->list_mmap);
 	INIT_LIST_HEAD(&nfb->pci_devices);
 	INIT_LIST_HEAD(&nfb->buses);
+	ATOMIC_INIT_NOTIFIER_HEAD(&nfb->irq_notifier);
 
 	nfb->status = NFB_DEVICE_STATUS_INIT;
 
@@ -377,10 +379,19 @@ static int nfb_init(void)
 	if (ret < 0)
 		goto err_register_driver;
 
+#ifdef CONFIG_NFB_ENABLE_SIM
+	ret = nfb_sim_init();
+	if (ret)
+		goto err_sim_init;
+#endif
+
 	return 0;
 
 	/* Error handling */
-//	pci_unregister_driver(&nfb_driver);
+#ifdef CONFIG_NFB_ENABLE_SIM
+err_sim_init:
+	nfb_pci_exit();
+#endif
 err_register_driver:
 	nfb_char_exit();
 err_nfb_char_init:
@@ -392,6 +403,9 @@ err_nfb_char_init:
  */
 static void nfb_exit(void)
 {
+#ifdef CONFIG_NFB_ENABLE_SIM
+	nfb_sim_exit();
+#endif
 	nfb_pci_exit();
 	nfb_char_exit();
 
@@ -145,6 +145,32 @@ void ndp_channel_unsubscribe(struct ndp_subscription *sub)
 	mutex_unlock(&channel->mutex);
 }
 
+/* Find the farthest swptr and pass it to controller; call with channel lock held */
+static void ndp_channel_rx_update_swptr(struct ndp_channel *channel)
+{
+	struct ndp_subscription *list_sub, *lagger = NULL;
+	unsigned long swptr = 0, sub_swptr;
+	size_t sub_lock, max_lock = 0;
+
+	list_for_each_entry(list_sub, &channel->list_subscriptions, list_item) {
+		sub_swptr = READ_ONCE(list_sub->swptr);
+		sub_lock = (channel->hwptr - sub_swptr) & channel->ptrmask;
+		if (lagger == NULL || sub_lock > max_lock) {
+			max_lock = sub_lock;
+			swptr = sub_swptr;
+			lagger = list_sub;
+		}
+	}
+
+	WRITE_ONCE(channel->rx_lagger, lagger);
+
+	/* Update swptr only when changed */
+	if (lagger && swptr != channel->swptr) {
+		channel->swptr = swptr;
+		channel->ops->set_swptr(channel, swptr);
+	}
+}
+
 int ndp_channel_start(struct ndp_subscription *sub)
 {
 	int ret;
@@ -164,6 +190,9 @@ int ndp_channel_start(struct ndp_subscription *sub)
 	spin_lock(&channel->lock);
 	sub->swptr = sub->hwptr = channel->hwptr;
 	list_add_tail(&sub->list_item, &channel->list_subscriptions);
+	/* New subscription starts at hwptr, it can't be behind the current lagger */
+	if (channel->rx_lagger == NULL && channel->id.type == NDP_CHANNEL_TYPE_RX)
+		WRITE_ONCE(channel->rx_lagger, sub);
 	spin_unlock(&channel->lock);
 
 	mutex_unlock(&channel->mutex);
@@ -198,6 +227,9 @@ int ndp_channel_stop(struct ndp_subscription *sub, int force)
 
 	spin_lock(&channel->lock);
 	list_del_init(&sub->list_item);
+	/* Release data held by the leaving subscription */
+	if (channel->rx_lagger == sub)
+		ndp_channel_rx_update_swptr(channel);
 	spin_unlock(&channel->lock);
 
 err_again:
@@ -207,37 +239,29 @@ err_again:
 
 inline void ndp_channel_rxsync(struct ndp_subscription *sub, struct ndp_subscription_sync *sync)
 {
-	struct ndp_subscription *list_sub;
-	unsigned long swptr, sub_swptr;
-	size_t sub_lock, max_lock;
 	struct ndp_channel *channel = sub->channel;
 
-	sub->swptr = sync->swptr;
-
-	spin_lock(&channel->lock);
-	rmb();
-
-	max_lock = 0;
-	swptr = sub->swptr;
-
-	/* Find the farthest swptr */
-	list_for_each_entry(list_sub, &channel->list_subscriptions, list_item) {
-		sub_swptr = list_sub->swptr;
-		sub_lock = (channel->hwptr - sub_swptr) & channel->ptrmask;
-		if (sub_lock > max_lock) {
-			max_lock = sub_lock;
-			swptr = sub_swptr;
-		}
+	WRITE_ONCE(sub->swptr, sync->swptr);
+	/* Pairs with the lock of the lagger search: the search either sees the new
+	 * swptr, or sets this subscription as lagger and the next sync moves it */
+	smp_mb();
+
+	if (READ_ONCE(channel->rx_lagger) == sub) {
+		spin_lock(&channel->lock);
+	} else if (!spin_trylock(&channel->lock)) {
+		/* Other subscription is just updating the hwptr, use its result */
+		sub->hwptr = READ_ONCE(channel->hwptr);
+		sync->hwptr = sub->hwptr;
+		return;
 	}
+	rmb();
 
-	/* Update swptr only when changed */
-	if (swptr != channel->swptr) {
-		channel->swptr = swptr;
-		channel->ops->set_swptr(channel, swptr);
-	}
+	/* Only the lagging subscription can move the channel swptr */
+	if (channel->rx_lagger == sub)
+		ndp_channel_rx_update_swptr(channel);
 
 	/* Update hwptr */
-	channel->hwptr = channel->ops->get_hwptr(channel);
+	WRITE_ONCE(channel->hwptr, channel->ops->get_hwptr(channel));
 	sub->hwptr = channel->hwptr;
 
 	wmb();
@@ -80,6 +80,8 @@ long ndp_char_ioctl(void *priv, void *app_priv, struct file *file, unsigned int
 			return -EBADF;
 
 		ret = ndp_subscription_sync(sub, &sync);
+		if (ret == 0 && sub->channel->id.type == NDP_CHANNEL_TYPE_RX)
+			ndp_subscriber_sync_rearm(subscriber);
 
 		if (copy_to_user(argp, &sync, sizeof(sync)))
 			return -EFAULT;
@@ -131,6 +133,14 @@ long ndp_char_ioctl(void *priv, void *app_priv, struct file *file, unsigned int
 		ret = ndp_subscription_stop(sub, 0);
 		break;
 	}
+	case NDP_IOC_WAKE: {
+		struct ndp_subscriber_wake wake;
+		if (copy_from_user(&wake, argp, sizeof(wake)))
+			return -EFAULT;
+
+		ret = ndp_subscriber_set_wake(subscriber, &wake);
+		break;
+	}
 	default:
 		return -ENXIO;
 	}
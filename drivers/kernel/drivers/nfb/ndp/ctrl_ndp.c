@@ -12,6 +12,7 @@
 #include <linux/fs.h>
 #include <linux/irq.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/pci.h>
@@ -23,6 +24,7 @@
 #include "ndp.h"
 
 #include <netcope/dma_ctrl_ndp.h>
+#include <netcope/rxmac.h>
 
 #define NDP_CTRL_TX_DESC_SIZE	      (sizeof(struct nc_ndp_desc))
 #define NDP_CTRL_RX_DESC_SIZE	      (sizeof(struct nc_ndp_desc))
@@ -37,6 +39,9 @@
 
 #define NDP_CTRL_NEXT_SDP_AGE_MAX 16
 
+#define NDP_CTRL_STREAM_ALIGN        8u
+#define NDP_CTRL_STREAM_SEG_SIZE_MAX 32768u /* Largest power of 2 fitting into type2 desc len */
+
 #define virt_to_phys_shift(x) (virt_to_phys(x) >> PAGE_SHIFT)
 
 #define NDP_CTRL_DEFAULT_BUFFER_SIZE 4096
@@ -68,6 +73,20 @@ struct ndp_ctrl_state_mps {
 	uint32_t buffer_index;
 };
 
+/* ring pointers for walkthrough in stream mode
+ * Ring is split into segments, each segment is posted as one type2 descriptor.
+ * Controller packs packets into segment with NDP_CTRL_STREAM_ALIGN padding
+ * and never splits packet between two segments.
+ */
+struct ndp_ctrl_state_stream {
+	uint32_t seg_size;      /* bytes covered by one descriptor */
+	uint32_t seg_count;     /* segments in the whole ring */
+	uint32_t seg_fill;      /* next segment to be posted to controller */
+	uint32_t seg_free;      /* segments released by user, not yet posted */
+	uint32_t seg_rel;       /* segment containing the oldest unreleased data */
+	ndp_offset_t pos;       /* ring offset for the next received packet */
+};
+
 struct ndp_ctrl {
 	struct nc_ndp_ctrl c;
 	uint32_t php; /* Pushed header pointer (converted to descriptors) */
@@ -75,7 +94,15 @@ struct ndp_ctrl {
 	struct ndp_ctrl_state_mps mps;
 	struct ndp_ctrl_cfg cfg; /* applied at next attach_ring / ndp_channel_rinng_resize call */
 
+	/* RX packet-simple: prepared descriptors for one pass through the ring */
+	struct nc_ndp_desc *rx_tpl;
+	uint32_t rx_tpl_count;
+	uint32_t rx_tpl_pos;
+
 	uint32_t mode;
+	uint32_t req_mode; /* applied at next start */
+
+	struct ndp_ctrl_state_stream stream;
 
 	/* INFO: virtual memory: shadowed */
 	struct nc_ndp_desc *desc_buffer_v;
@@ -327,6 +354,45 @@ static ssize_t ndp_ctrl_set_ring_size(struct device *dev,
 	return size;
 }
 
+static const char * const ndp_ctrl_mode_names[] = {
+	[NDP_CTRL_MODE_PACKET_SIMPLE] = "packet",
+	[NDP_CTRL_MODE_STREAM] = "stream",
+};
+
+static ssize_t ndp_ctrl_get_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ndp_channel *channel = dev_get_drvdata(dev);
+	struct ndp_ctrl *ctrl = container_of(channel, struct ndp_ctrl, channel);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n", ndp_ctrl_mode_names[ctrl->req_mode]);
+}
+
+static ssize_t ndp_ctrl_set_mode(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t size)
+{
+	int mode;
+	struct ndp_channel *channel = dev_get_drvdata(dev);
+	struct ndp_ctrl *ctrl = container_of(channel, struct ndp_ctrl, channel);
+
+	for (mode = 0; mode < ARRAY_SIZE(ndp_ctrl_mode_names); mode++) {
+		if (sysfs_streq(buf, ndp_ctrl_mode_names[mode]))
+			break;
+	}
+	if (mode == ARRAY_SIZE(ndp_ctrl_mode_names))
+		return -EINVAL;
+
+	/* Mode is applied in start, don't change it under running channel */
+	mutex_lock(&channel->mutex);
+	if (channel->start_count) {
+		mutex_unlock(&channel->mutex);
+		return -EBUSY;
+	}
+	ctrl->req_mode = mode;
+	mutex_unlock(&channel->mutex);
+
+	return size;
+}
+
 /// @brief Function sets `hdr` and `off` with information from `channel`. Returns header count.
 /// @param channel
 /// @param hdr buffer of headers
@@ -340,31 +406,70 @@ int ndp_ctrl_v2_get_vmaps(struct ndp_channel *channel, void **hdr, void **off)
 	return ctrl->hdr_count;
 }
 
-static void ndp_ctrl_mps_fill_rx_descs(struct ndp_ctrl *ctrl, uint64_t count)
+/* Prepare descriptors (type0 where the upper address changes + type2) for all buffers in ring.
+ * The table starts with type0 in every case, so it can be repeated from the controller start.
+ */
+static int ndp_ctrl_medusa_rx_tpl_create(struct ndp_ctrl *ctrl)
 {
-	int i;
-	uint32_t sdp = ctrl->c.sdp;
-	struct nc_ndp_desc *desc = ctrl->desc_buffer_v + sdp;
-	uint64_t last_upper_addr = ctrl->c.last_upper_addr;
-
-	/* TODO: Table of prepared descriptor bursts with all meta (desc. count etc) */
-	for (i = 0; i < count; i++) {
-		dma_addr_t addr;
+	int pass;
+	uint32_t count = 0;
+	uint64_t last_upper_addr = 0;
+	struct nc_ndp_desc *tpl = NULL;
+	struct ndp_ctrl_state_mps s = ctrl->mps;
+
+	/* First pass counts descriptors, second one writes them */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass) {
+			tpl = kvmalloc_node(count * sizeof(*tpl), GFP_KERNEL, dev_to_node(ctrl->channel.ring.dev));
+			if (tpl == NULL)
+				return -ENOMEM;
+		}
 
-		addr = ctrl->channel.ring.blocks[ctrl->mps.block_index].phys;
-		addr += ctrl->mps.block_offset;
+		count = 0;
+		ndp_ctrl_medusa_mps_meta_first(&s);
+		do {
+			dma_addr_t addr;
 
-		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(addr) != last_upper_addr)) {
-			last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(addr);
-			ctrl->c.last_upper_addr = last_upper_addr;
-			desc[i] = nc_ndp_rx_desc0(addr);
-			continue;
-		}
-		desc[i] = nc_ndp_rx_desc2(addr, ctrl->mps.cfg.buffer_size, 0);
+			addr = ctrl->channel.ring.blocks[s.block_index].phys;
+			addr += s.block_offset;
 
-		ndp_ctrl_medusa_mps_inc(&ctrl->mps);
+			if (count == 0 || NDP_CTRL_DESC_UPPER_ADDR(addr) != last_upper_addr) {
+				last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(addr);
+				if (tpl)
+					tpl[count] = nc_ndp_rx_desc0(addr);
+				count++;
+			}
+			if (tpl)
+				tpl[count] = nc_ndp_rx_desc2(addr, s.cfg.buffer_size, 0);
+			count++;
+		} while (ndp_ctrl_medusa_mps_inc(&s) != -1);
 	}
+
+	ctrl->rx_tpl = tpl;
+	ctrl->rx_tpl_count = count;
+	ctrl->rx_tpl_pos = 0;
+	return 0;
+}
+
+static void ndp_ctrl_mps_fill_rx_descs(struct ndp_ctrl *ctrl, uint64_t count)
+{
+	uint64_t n;
+	uint32_t sdp = ctrl->c.sdp;
+	uint32_t pos = ctrl->rx_tpl_pos;
+	struct nc_ndp_desc *desc = ctrl->desc_buffer_v + sdp;
+
+	/* Descriptor buffer is shadowed, only the wrap of the table splits the copy */
 	ctrl->c.sdp = (sdp + count) & ctrl->c.mdp;
+	while (count) {
+		n = min_t(uint64_t, count, ctrl->rx_tpl_count - pos);
+		memcpy(desc, ctrl->rx_tpl + pos, n * sizeof(*desc));
+		desc += n;
+		count -= n;
+		pos += n;
+		if (pos == ctrl->rx_tpl_count)
+			pos = 0;
+	}
+	ctrl->rx_tpl_pos = pos;
 }
 
 static void ndp_ctrl_user_fill_rx_descs(struct ndp_ctrl *ctrl)
@@ -442,6 +547,66 @@ static void ndp_ctrl_user_fill_rx_descs(struct ndp_ctrl *ctrl)
 	}
 }
 
+/* Post all released segments, which fits into the free space of descriptor ring */
+static void ndp_ctrl_stream_fill_rx_descs(struct ndp_ctrl *ctrl)
+{
+	struct ndp_ctrl_state_stream *s = &ctrl->stream;
+	struct ndp_block *blocks = ctrl->channel.ring.blocks;
+	size_t block_size = blocks[0].size;
+	uint32_t mdp = ctrl->c.mdp;
+	uint32_t sdp = ctrl->c.sdp;
+	uint32_t free_desc;
+	uint64_t last_upper_addr = ctrl->c.last_upper_addr;
+	struct nc_ndp_desc *desc = ctrl->desc_buffer_v;
+
+	free_desc = (ctrl->c.hdp - sdp - 1) & mdp;
+
+	/* Reserve space for possible type0 desc */
+	while (s->seg_free && free_desc >= 2) {
+		dma_addr_t addr;
+		ndp_offset_t off = (ndp_offset_t) s->seg_fill * s->seg_size;
+
+		addr = blocks[off / block_size].phys + off % block_size;
+
+		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(addr) != last_upper_addr)) {
+			last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(addr);
+			ctrl->c.last_upper_addr = last_upper_addr;
+			desc[sdp] = nc_ndp_rx_desc0(addr);
+			sdp = (sdp + 1) & mdp;
+			free_desc--;
+		}
+
+		desc[sdp] = nc_ndp_rx_desc2(addr, s->seg_size, 0);
+		sdp = (sdp + 1) & mdp;
+		free_desc--;
+
+		if (++s->seg_fill == s->seg_count)
+			s->seg_fill = 0;
+		s->seg_free--;
+	}
+
+	wmb();
+	ctrl->c.sdp = sdp;
+}
+
+/* Release segments, which contains only packets older than ptr */
+static void ndp_ctrl_stream_release(struct ndp_ctrl *ctrl, uint32_t ptr)
+{
+	struct ndp_ctrl_state_stream *s = &ctrl->stream;
+	uint32_t last = (ptr - 1) & ctrl->c.mhp;
+	ndp_offset_t end;
+	uint32_t seg;
+
+	/* End of the last released packet; the segment with this offset is still in use */
+	end = ctrl->off_buffer_v[last] + ALIGN(ctrl->ts.medusa.hdr_buffer[last].frame_len, NDP_CTRL_STREAM_ALIGN);
+	seg = end / s->seg_size;
+	if (seg == s->seg_count)
+		seg = 0;
+
+	s->seg_free += (seg + s->seg_count - s->seg_rel) % s->seg_count;
+	s->seg_rel = seg;
+}
+
 static void ndp_ctrl_medusa_rx_set_swptr(struct ndp_channel *channel, uint64_t ptr)
 {
 	struct ndp_ctrl *ctrl = container_of(channel, struct ndp_ctrl, channel);
@@ -479,7 +644,16 @@ static void ndp_ctrl_medusa_rx_set_swptr(struct ndp_channel *channel, uint64_t p
 			nc_ndp_ctrl_sp_flush(&ctrl->c);
 		}
 	} else if (ctrl->mode == NDP_CTRL_MODE_STREAM) {
-		/* TODO */
+		if (ptr == shp)
+			return;
+
+		ndp_ctrl_stream_release(ctrl, ptr);
+		ctrl->c.shp = ptr;
+
+		/* Header space must be flushed even if no segment was released */
+		nc_ndp_ctrl_hdp_update(&ctrl->c);
+		ndp_ctrl_stream_fill_rx_descs(ctrl);
+		nc_ndp_ctrl_sp_flush(&ctrl->c);
 	} else if (ctrl->mode == NDP_CTRL_MODE_USER) {
 		ctrl->c.shp = ptr;
 		nc_ndp_ctrl_hdp_update(&ctrl->c);
@@ -540,10 +714,32 @@ static uint64_t ndp_ctrl_rx_get_hwptr(struct ndp_channel *channel)
 	} else if (ctrl->mode == NDP_CTRL_MODE_STREAM) {
 		struct nc_ndp_hdr *hdr = ctrl->ts.medusa.hdr_buffer + hhp;
 		ndp_offset_t *off = ctrl->off_buffer_v + hhp;
+		ndp_offset_t pos = ctrl->stream.pos;
+		uint32_t seg_size = ctrl->stream.seg_size;
+
+		/* Replay packet placement of the controller */
 		for (i = 0; i < count; i++) {
-			off[i+1] = off[i] + hdr[i].frame_len;
+			uint32_t len = hdr[i].frame_len;
+
+			/* Placement of the controller is unknown from here on, leave the frame unreceived */
+			if (unlikely(len > seg_size)) {
+				dev_err_ratelimited(ctrl->nfb->dev, "NDP queue %s: frame of %u B doesn't fit into stream segment of %u B\n",
+						dev_name(&channel->dev), len, seg_size);
+				hhp_new = (hhp + i) & ctrl->c.mhp;
+				ctrl->c.hhp = hhp_new;
+				break;
+			}
+
+			/* Packet doesn't fit into rest of segment: controller skips to the next one */
+			if ((pos & (seg_size - 1)) + len > seg_size)
+				pos = ALIGN(pos, seg_size);
+			if (pos >= channel->ring.size)
+				pos = 0;
+
+			off[i] = pos;
+			pos += ALIGN(len, NDP_CTRL_STREAM_ALIGN);
 		}
-		off[i] &= channel->ring.size - 1;
+		ctrl->stream.pos = pos;
 	} else if (ctrl->mode == NDP_CTRL_MODE_USER) {
 		/* Check if some descs from userspace can be written */
 		if (count && ctrl->php != ctrl->c.shp) {
@@ -758,6 +954,26 @@ static int ndp_ctrl_start(struct ndp_ctrl *ctrl, struct nc_ndp_ctrl_start_params
 	return ret;
 }
 
+/**
+ * ndp_ctrl_stream_frame_max - longest frame the MACs of the card can receive
+ *
+ * Taken from the mtu property of the rx MACs, the NDP header limit when no MAC states it.
+ */
+static uint32_t ndp_ctrl_stream_frame_max(struct ndp_ctrl *ctrl)
+{
+	const void *fdt = ctrl->nfb->fdt;
+	const fdt32_t *prop;
+	uint32_t frame_max = 0;
+	int node, len;
+
+	fdt_for_each_compatible_node(fdt, node, COMP_NETCOPE_RXMAC) {
+		prop = fdt_getprop(fdt, node, "mtu", &len);
+		if (prop && len == sizeof(*prop))
+			frame_max = max_t(uint32_t, frame_max, fdt32_to_cpu(*prop));
+	}
+	return frame_max ? frame_max : U16_MAX;
+}
+
 static int ndp_ctrl_medusa_start(struct ndp_channel *channel, uint64_t *hwptr)
 {
 	int ret;
@@ -774,14 +990,31 @@ static int ndp_ctrl_medusa_start(struct ndp_channel *channel, uint64_t *hwptr)
 	sp.nb_desc = ctrl->desc_count;
 	sp.nb_hdr = ctrl->hdr_count;
 
+	/* Stream mode is supported only for RX */
+	ctrl->mode = NDP_CTRL_MODE_PACKET_SIMPLE;
+	if (channel->id.type == NDP_CHANNEL_TYPE_RX)
+		ctrl->mode = ctrl->req_mode;
+
+	if (ctrl->mode == NDP_CTRL_MODE_STREAM) {
+		ctrl->stream.seg_size = min_t(size_t, channel->ring.blocks[0].size, NDP_CTRL_STREAM_SEG_SIZE_MAX);
+		ctrl->stream.seg_count = channel->ring.size / ctrl->stream.seg_size;
+		/* At least one segment must stay unposted to distinguish full and empty ring */
+		if (ctrl->stream.seg_count < 2)
+			return -EINVAL;
+		/* Controller never splits a frame, the longest one has to fit into a segment */
+		if (ctrl->stream.seg_size < ndp_ctrl_stream_frame_max(ctrl)) {
+			dev_warn(ctrl->nfb->dev, "NDP queue %s: stream segment of %u B is shorter than the longest frame %u B, use larger ring blocks\n",
+					dev_name(&channel->dev), ctrl->stream.seg_size, ndp_ctrl_stream_frame_max(ctrl));
+			return -EINVAL;
+		}
+	}
+
 	ret = ndp_ctrl_start(ctrl, &sp);
 	if (ret)
 		return ret;
 
 	ctrl->next_sdp = 0;
 
-	ctrl->mode = NDP_CTRL_MODE_PACKET_SIMPLE;
-
 	if (ctrl->mode == NDP_CTRL_MODE_PACKET_SIMPLE) {
 		/* Constant packet offsets in this mode */
 		off = ctrl->off_buffer_v;
@@ -790,6 +1023,11 @@ static int ndp_ctrl_medusa_start(struct ndp_channel *channel, uint64_t *hwptr)
 		do {
 			*(off++) = (ctrl->mps.block_index * ctrl->mps.cfg.block_size) + ctrl->mps.block_offset;
 		} while (ndp_ctrl_medusa_mps_inc(&ctrl->mps) != -1);
+	} else if (ctrl->mode == NDP_CTRL_MODE_STREAM) {
+		ctrl->stream.seg_fill = 0;
+		ctrl->stream.seg_free = ctrl->stream.seg_count - 1;
+		ctrl->stream.seg_rel = 0;
+		ctrl->stream.pos = 0;
 	} else if (ctrl->mode == NDP_CTRL_MODE_USER) {
 		if (channel->id.type == NDP_CHANNEL_TYPE_RX) {
 			ctrl->free_desc = ctrl->c.mhp;
@@ -799,9 +1037,14 @@ static int ndp_ctrl_medusa_start(struct ndp_channel *channel, uint64_t *hwptr)
 
 	if (channel->id.type == NDP_CHANNEL_TYPE_RX) {
 		if (ctrl->mode == NDP_CTRL_MODE_PACKET_SIMPLE) {
+			ctrl->rx_tpl_pos = 0;
 			ndp_ctrl_mps_fill_rx_descs(ctrl, ctrl->c.mdp + 1 - NDP_CTRL_RX_DESC_BURST);
 			nc_ndp_ctrl_sdp_flush(&ctrl->c);
 			ctrl->free_desc = 0;
+		} else if (ctrl->mode == NDP_CTRL_MODE_STREAM) {
+			ndp_ctrl_stream_fill_rx_descs(ctrl);
+			nc_ndp_ctrl_sdp_flush(&ctrl->c);
+			ctrl->free_desc = 0;
 		}
 
 		/* TODO: Check if SHP is to be 0 after start or must first set to an value */
@@ -973,6 +1216,9 @@ static int ndp_ctrl_medusa_attach_ring(struct ndp_channel *channel)
 
 	channel->ptrmask = ctrl->hdr_count - 1;
 
+	if (channel->id.type == NDP_CHANNEL_TYPE_RX && ndp_ctrl_medusa_rx_tpl_create(ctrl))
+		goto err_rx_tpl;
+
 	/* allocate update buffer */
 	ctrl->update_buffer = dma_alloc_coherent(dev, ALIGN(NDP_CTRL_UPDATE_SIZE, PAGE_SIZE),
 			&ctrl->update_buffer_phys, GFP_KERNEL);
@@ -1074,6 +1320,9 @@ err_alloc_desc:
 	ctrl->update_buffer = NULL;
 
 err_alloc_update:
+	kvfree(ctrl->rx_tpl);
+	ctrl->rx_tpl = NULL;
+err_rx_tpl:
 	return ret;
 }
 
@@ -1254,6 +1503,9 @@ static void ndp_ctrl_medusa_detach_ring(struct ndp_channel *channel)
 				ctrl->update_buffer, ctrl->update_buffer_phys);
 		ctrl->update_buffer = NULL;
 	}
+
+	kvfree(ctrl->rx_tpl);
+	ctrl->rx_tpl = NULL;
 }
 
 static void ndp_ctrl_calypte_detach_ring(struct ndp_channel *channel)
@@ -1411,6 +1663,7 @@ static DEVICE_ATTR(ring_size,   (S_IRUGO | S_IWGRP | S_IWUSR), ndp_ctrl_get_ring
 static DEVICE_ATTR(buffer_size, (S_IRUGO | S_IWGRP | S_IWUSR), ndp_ctrl_get_buffer_size, ndp_ctrl_set_buffer_size);
 static DEVICE_ATTR(buffer_count, (S_IRUGO | S_IWGRP | S_IWUSR), ndp_ctrl_get_buffer_count, ndp_ctrl_set_buffer_count);
 static DEVICE_ATTR(initial_offset, (S_IRUGO | S_IWGRP | S_IWUSR), ndp_ctrl_get_initial_offset, ndp_ctrl_set_initial_offset);
+static DEVICE_ATTR(mode,        (S_IRUGO | S_IWGRP | S_IWUSR), ndp_ctrl_get_mode, ndp_ctrl_set_mode);
 
 static struct device_attribute dev_attr_calypte_ring_size = __ATTR(ring_size, (S_IRUGO | S_IWGRP | S_IWUSR), ndp_channel_get_ring_size, ndp_channel_set_ring_size);
 
@@ -1419,6 +1672,7 @@ static struct attribute *ndp_ctrl_rx_attrs[] = {
 	&dev_attr_buffer_size.attr,
 	&dev_attr_buffer_count.attr,
 	&dev_attr_initial_offset.attr,
+	&dev_attr_mode.attr,
 	NULL,
 };
 
@@ -87,10 +87,12 @@ int nfb_ndp_attach(struct nfb_device *nfb, void **priv)
 	INIT_LIST_HEAD(&ndp->list_channels);
 	INIT_LIST_HEAD(&ndp->list_subscribers);
 	ndp->nfb = nfb;
+	ndp->ring_contig = ndp_ring_contig;
 	*priv = ndp;
 
 	device_initialize(&ndp->dev);
 	ndp->dev.parent = ndp->nfb->dev;
+	ndp->dev.groups = ndp_attr_groups;
 	dev_set_name(&ndp->dev, "ndp");
 	dev_set_drvdata(&ndp->dev, ndp);
 	ret = device_add(&ndp->dev);
@@ -107,6 +109,10 @@ int nfb_ndp_attach(struct nfb_device *nfb, void **priv)
 		ndp_create_channels_from_ctrl(ndp, &ndp_ctrls[i]);
 	}
 
+	/* Interrupt wakeups are optional, subscribers always check data on timer */
+	ndp->irq_nb.notifier_call = ndp_subscriber_irq_notify;
+	ndp->irq_available = !nfb_irq_register_notifier(nfb, &ndp->irq_nb);
+
 	dev_info(&nfb->pci->dev, "nfb_ndp: attached successfully\n");
 
 	return ret;
@@ -134,6 +140,9 @@ void nfb_ndp_detach(struct nfb_device *nfb, void *priv)
 	struct ndp_channel *channel, *tmp;
 	ndp = priv;
 
+	if (ndp->irq_available)
+		nfb_irq_unregister_notifier(nfb, &ndp->irq_nb);
+
 	mutex_lock(&ndp->lock);
 	if (!list_empty(&ndp->list_subscribers)) {
 		dev_err(nfb->dev, "NDP: Destroyed before list_subscribers empty\n");
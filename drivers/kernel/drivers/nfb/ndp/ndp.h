@@ -14,11 +14,13 @@
 #include <linux/device.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/notifier.h>
 #include <linux/pci.h>
 #include <linux/types.h>
 #include <linux/interrupt.h>
 #include <linux/poll.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(4,10,0)
 #include <linux/sched.h>
@@ -34,6 +36,8 @@
 #define NDP_SUB_STATUS_RUNNING		2
 
 #define NDP_WAKE_RX                     1
+#define NDP_WAKE_ARMED                  2 /* Subscriber waits for data: poll or eventfd */
+#define NDP_WAKE_TIMER                  3 /* Check was triggered by timer, not by interrupt */
 
 struct nfb_device;
 struct nfb_comp;
@@ -62,6 +66,7 @@ struct ndp_block {
  * @blk_count: overall count of blocks in this space
  * @blk_size: block size
  * @ring: pointers to ring blocks
+ * @contig: blocks are parts of one physically contiguous allocation
  */
 struct ndp_ring {
 	size_t size;
@@ -71,6 +76,7 @@ struct ndp_ring {
 	struct ndp_block *blocks;
 	struct device *dev;
 	void *vmap;
+	bool contig;
 };
 
 struct ndp_ctrl;
@@ -81,10 +87,12 @@ struct ndp_subscription {
 
 	struct list_head list_item;
 	struct list_head ndp_subscriber_list_item;
-	unsigned long hwptr;
-	unsigned long swptr;
 
 	struct ndp_subscriber *subscriber;
+
+	/* Written by each sync of the owner, read by the sync of the lagging subscription */
+	unsigned long swptr ____cacheline_aligned_in_smp;
+	unsigned long hwptr;
 };
 
 struct ndp_subscriber {
@@ -93,6 +101,11 @@ struct ndp_subscriber {
 	struct list_head list_head_subscriptions;
 	wait_queue_head_t poll_wait;
 	struct hrtimer poll_timer;
+	struct work_struct poll_work;
+	struct mutex wake_lock;
+	struct eventfd_ctx *eventfd;
+	uint32_t wake_thresh;
+	uint32_t wake_period;
 	unsigned long wake_reason;
 };
 
@@ -121,6 +134,7 @@ struct ndp_channel_id {
  * @timeout: current timeout (for adaptive timeout)
  * @poll_thresh: after how much data wake up applications
  * @start_count: how many times it was started
+ * @rx_lagger: RX subscription with the farthest swptr, which holds channel swptr
  * list_app: list_head with
  * list_subscriptions: list_head with active subscriptions
  * list_sd: list item in ndp structure
@@ -131,6 +145,7 @@ struct ndp_channel {
 	spinlock_t lock;
 	struct mutex mutex;
 	struct ndp_subscription *locked_sub;
+	struct ndp_subscription *rx_lagger;
 	uint64_t hwptr;
 	uint64_t swptr;
 	uint64_t ptrmask;
@@ -181,6 +196,11 @@ struct ndp {
 
 	struct device dev;
 
+	struct notifier_block irq_nb;
+	bool irq_available;
+
+	bool ring_contig;
+
 	int dev_node_warn : 1;
 };
 
@@ -217,6 +237,9 @@ void ndp_channel_ring_destroy(struct ndp_channel *channel);
 int ndp_channel_ring_resize(struct ndp_channel *channel);
 int ndp_channel_ring_req_block_update_by_size(struct ndp_channel *channel, unsigned long long req_size);
 
+extern const struct attribute_group *ndp_attr_groups[];
+extern bool ndp_ring_contig;
+
 ssize_t ndp_channel_get_discard(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t ndp_channel_set_discard(struct device *dev, struct device_attribute *attr, const char *buf, size_t size);
 
@@ -238,6 +261,9 @@ struct ndp_subscriber *ndp_subscriber_create(struct ndp *ndp);
 void ndp_subscriber_destroy(struct ndp_subscriber *subscriber);
 
 int ndp_subscriber_poll(struct ndp_subscriber *subscriber, struct file *filp, struct poll_table_struct *wait);
+int ndp_subscriber_set_wake(struct ndp_subscriber *subscriber, struct ndp_subscriber_wake *wake);
+void ndp_subscriber_sync_rearm(struct ndp_subscriber *subscriber);
+int ndp_subscriber_irq_notify(struct notifier_block *nb, unsigned long irq, void *data);
 
 int ndp_channel_start(struct ndp_subscription *sub);
 int ndp_channel_stop(struct ndp_subscription *sub, int force);
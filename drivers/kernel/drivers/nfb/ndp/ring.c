@@ -19,6 +19,7 @@
 
 unsigned long ndp_ring_size = NDP_RING_SIZE_DEFAULT;
 unsigned long ndp_ring_block_size = NDP_RING_BLOCK_SIZE_DEFAULT;
+bool ndp_ring_contig = false;
 
 int ndp_channel_ring_req_block_update_by_size(struct ndp_channel *channel, unsigned long long req_size)
 {
@@ -61,6 +62,85 @@ ssize_t ndp_channel_set_ring_size(struct device *dev,
 	return size;
 }
 
+static ssize_t ndp_get_ring_contig(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ndp *ndp = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", ndp->ring_contig ? 1 : 0);
+}
+
+static ssize_t ndp_set_ring_contig(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t size)
+{
+	int ret;
+	bool value;
+	struct ndp *ndp = dev_get_drvdata(dev);
+
+	ret = kstrtobool(buf, &value);
+	if (ret)
+		return ret;
+
+	/* Applied at next ring allocation, e.g. ring_size change of channel */
+	ndp->ring_contig = value;
+	return size;
+}
+
+static DEVICE_ATTR(ring_contig, (S_IRUGO | S_IWGRP | S_IWUSR), ndp_get_ring_contig, ndp_set_ring_contig);
+
+static struct attribute *ndp_attrs[] = {
+	&dev_attr_ring_contig.attr,
+	NULL,
+};
+
+static struct attribute_group ndp_attr_group = {
+	.attrs = ndp_attrs,
+};
+
+const struct attribute_group *ndp_attr_groups[] = {
+	&ndp_attr_group,
+	NULL,
+};
+
+/**
+ * ndp_block_alloc_contig - alloc DMAable space as one physically contiguous area
+ * @dev: device which will use this DMA area
+ * @count: count of members to allocate
+ * @size: size of the members
+ * @return: array of ndp_block structure pointing into the area
+ *
+ * Large areas can be satisfied only from CMA (cma= kernel parameter),
+ * returns NULL when it is not available and the caller should use ndp_block_alloc.
+ * The area saves the type0 descriptors of the controllers, the kernel vmap and
+ * the userspace mapping still use base pages.
+ */
+static struct ndp_block *ndp_block_alloc_contig(struct device *dev,
+		unsigned int count, size_t size)
+{
+	unsigned int i;
+	void *virt;
+	dma_addr_t phys;
+	struct ndp_block *blocks;
+
+	if (count == 0 || size == 0)
+		return NULL;
+
+	blocks = kmalloc_node(count * sizeof(struct ndp_block), GFP_KERNEL, dev_to_node(dev));
+	if (blocks == NULL)
+		return NULL;
+
+	virt = dma_alloc_coherent(dev, count * size, &phys, GFP_KERNEL | __GFP_NOWARN);
+	if (virt == NULL) {
+		kfree(blocks);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		blocks[i].virt = virt + i * size;
+		blocks[i].phys = phys + i * size;
+		blocks[i].size = size;
+	}
+	return blocks;
+}
+
 /**
  * ndp_block_alloc - alloc DMAable space (lowlevel)
  * @dev: device which will use this DMA area
@@ -167,8 +247,21 @@ static int ndp_channel_ring_alloc(struct device *dev,
 	channel->ring.block_count = 0;
 	channel->ring.vmap = NULL;
 	channel->ring.dev = dev;
+	channel->ring.contig = false;
+	channel->ring.blocks = NULL;
+
+	if (channel->ndp->ring_contig && count > 1) {
+		channel->ring.blocks = ndp_block_alloc_contig(dev, count, size);
+		if (channel->ring.blocks) {
+			channel->ring.contig = true;
+		} else {
+			dev_warn(&channel->dev, "can't allocate contiguous ring of %zu bytes, using %zu blocks\n",
+					count * size, count);
+		}
+	}
 
-	channel->ring.blocks = ndp_block_alloc(dev, count, size);
+	if (channel->ring.blocks == NULL)
+		channel->ring.blocks = ndp_block_alloc(dev, count, size);
 	if (channel->ring.blocks == NULL)
 		goto err_block_alloc;
 
@@ -198,7 +291,12 @@ static int ndp_channel_ring_alloc(struct device *dev,
 
 err_vmap:
 err_pages_alloc:
-	ndp_block_free(dev, channel->ring.blocks, count);
+	if (channel->ring.contig) {
+		dma_free_coherent(dev, count * size, channel->ring.blocks[0].virt, channel->ring.blocks[0].phys);
+		kfree(channel->ring.blocks);
+	} else {
+		ndp_block_free(dev, channel->ring.blocks, count);
+	}
 	channel->ring.blocks = NULL;
 err_block_alloc:
 	return ret;
@@ -213,14 +311,21 @@ static void ndp_channel_ring_free(struct ndp_channel * channel)
 {
 	if (channel->ring.vmap)
 		vunmap(channel->ring.vmap);
-	ndp_block_free(channel->ring.dev, channel->ring.blocks,
-			channel->ring.block_count);
+	if (channel->ring.contig) {
+		dma_free_coherent(channel->ring.dev, channel->ring.size,
+				channel->ring.blocks[0].virt, channel->ring.blocks[0].phys);
+		kfree(channel->ring.blocks);
+	} else {
+		ndp_block_free(channel->ring.dev, channel->ring.blocks,
+				channel->ring.block_count);
+	}
 
 	channel->ring.vmap = NULL;
 	channel->ring.blocks = NULL;
 	channel->ring.block_count = 0;
 	channel->ring.mmap_size = 0;
 	channel->ring.size = 0;
+	channel->ring.contig = false;
 }
 
 int ndp_ring_mmap(struct vm_area_struct *vma, unsigned long offset, unsigned long size, void *priv)
@@ -251,6 +356,18 @@ int ndp_ring_mmap(struct vm_area_struct *vma, unsigned long offset, unsigned lon
 	if (offset != ring->mmap_offset || size != channel->ring.mmap_size)
 		return -EINVAL;
 
+	if (ring->contig) {
+		/* Whole ring at once, the second half for wraparound */
+		for (offset = 0; offset < size; offset += ring->size) {
+			int ret = remap_pfn_range(vma, vma->vm_start + offset,
+					virt_to_phys(ring->blocks[0].virt) >> PAGE_SHIFT,
+					ring->size, vma->vm_page_prot);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
 	for (offset = 0; offset < size; offset += ring->blocks[0].size) {
 		block_offset = offset;
 		while (block_offset >= ring->size) {
@@ -371,3 +488,5 @@ module_param_cb(ndp_ring_size, &ndp_param_size_ops, &ndp_ring_size, S_IRUGO);
 MODULE_PARM_DESC(ndp_ring_size, "Default size for new ring [4 MiB]");
 module_param_cb(ndp_ring_block_size, &ndp_param_size_ops, &ndp_ring_block_size, S_IRUGO);
 MODULE_PARM_DESC(ndp_ring_block_size, "Default size of block in new ring [4 MiB]");
+module_param(ndp_ring_contig, bool, S_IRUGO);
+MODULE_PARM_DESC(ndp_ring_contig, "Allocate each ring as one physically contiguous area (needs CMA for large rings), fall back to blocks on failure; per device in ndp/ring_contig [0]");
@@ -21,48 +21,153 @@
 #include <linux/vmalloc.h>
 #include <linux/delay.h>
 #include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
 
+#include "../nfb.h"
 #include "ndp.h"
 
-static size_t ndp_subscriber_new_data(struct ndp_subscriber *subscriber)
+/* Shortest timer period in us, a shorter one would only burn the CPU in hrtimer interrupts */
+#define NDP_WAKE_PERIOD_MIN     10
+
+static unsigned int ndp_wake_period = 200;
+static unsigned int ndp_wake_thresh = 1;
+
+static inline unsigned int ndp_wake_period_default(void)
+{
+	return max_t(unsigned int, ndp_wake_period, NDP_WAKE_PERIOD_MIN);
+}
+
+static inline void ndp_eventfd_signal(struct eventfd_ctx *ctx)
 {
-	size_t ret = 0, max;
-	struct ndp_subscription *sub, *max_sub;
+#ifdef CONFIG_HAVE_SIMPLIFIED_EVENTFD_SIGNAL
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/* Returns the largest count of pending items over all subscriptions, -1 if there is none */
+static ssize_t ndp_subscriber_new_data(struct ndp_subscriber *subscriber)
+{
+	size_t ret, max = 0;
+	struct ndp_subscription *sub;
 
 	if (list_empty(&subscriber->list_head_subscriptions)) {
 		return -1;
 	}
 
-	max = 0;
-	max_sub = NULL;
 	list_for_each_entry(sub, &subscriber->list_head_subscriptions, ndp_subscriber_list_item) {
 		ret = ndp_subscription_rx_data_available(sub);
-		if (ret > max) {
+		if (ret > max)
 			max = ret;
-			max_sub = sub;
-			return ret;
-		}
 	}
 
-	return ret;
+	return max;
 }
 
-static enum hrtimer_restart ndp_subscriber_poll_timer(struct hrtimer *timer)
+static void ndp_subscriber_timer_start(struct ndp_subscriber *subscriber)
 {
-	int ret;
-	struct ndp_subscriber *subscriber = container_of(timer, struct ndp_subscriber, poll_timer);
+	ktime_t to;
+
+	to = ktime_get();
+	to = ktime_add_ns(to, READ_ONCE(subscriber->wake_period) * 1000ull);
+	hrtimer_start(&subscriber->poll_timer, to, HRTIMER_MODE_ABS);
+}
+
+/* Subscriber waits for data: check on timer and on each card interrupt */
+static void ndp_subscriber_arm(struct ndp_subscriber *subscriber)
+{
+	if (test_and_set_bit(NDP_WAKE_ARMED, &subscriber->wake_reason))
+		return;
+	ndp_subscriber_timer_start(subscriber);
+}
 
+static void ndp_subscriber_disarm(struct ndp_subscriber *subscriber)
+{
+	clear_bit(NDP_WAKE_ARMED, &subscriber->wake_reason);
+
+	/* The work can restart the timer and the timer can queue the work again;
+	 * the second round ends with both idle, as not armed work does nothing */
+	hrtimer_cancel(&subscriber->poll_timer);
+	cancel_work_sync(&subscriber->poll_work);
+	hrtimer_cancel(&subscriber->poll_timer);
+	cancel_work_sync(&subscriber->poll_work);
+}
+
+static void ndp_subscriber_poll_work(struct work_struct *work)
+{
+	ssize_t ret;
+	size_t thresh = 1;
+	bool timer;
+	struct eventfd_ctx *eventfd;
+	struct ndp_subscriber *subscriber = container_of(work, struct ndp_subscriber, poll_work);
+
+	if (!test_bit(NDP_WAKE_ARMED, &subscriber->wake_reason))
+		return;
+
+	/* Timer wakes up with any pending data, interrupt only over the threshold */
+	timer = test_and_clear_bit(NDP_WAKE_TIMER, &subscriber->wake_reason);
+	if (!timer)
+		thresh = max(READ_ONCE(subscriber->wake_thresh), 1u);
+
+	/* List of subscriptions is protected by ndp lock */
+	mutex_lock(&subscriber->ndp->lock);
 	ret = ndp_subscriber_new_data(subscriber);
-	if (ret > 0) {
+	mutex_unlock(&subscriber->ndp->lock);
+
+	if (ret < 0) {
+		clear_bit(NDP_WAKE_ARMED, &subscriber->wake_reason);
+		return;
+	}
+
+	if (ret >= thresh) {
+		if (!test_and_clear_bit(NDP_WAKE_ARMED, &subscriber->wake_reason))
+			return;
+		hrtimer_try_to_cancel(&subscriber->poll_timer);
+
 		set_bit(NDP_WAKE_RX, &subscriber->wake_reason);
 		wake_up_interruptible(&subscriber->poll_wait);
-		return HRTIMER_NORESTART;
-	} else if (ret < 0) {
-		return HRTIMER_NORESTART;
+
+		eventfd = READ_ONCE(subscriber->eventfd);
+		if (eventfd)
+			ndp_eventfd_signal(eventfd);
+	} else if (timer && test_bit(NDP_WAKE_ARMED, &subscriber->wake_reason)) {
+		ndp_subscriber_timer_start(subscriber);
 	}
+}
+
+static enum hrtimer_restart ndp_subscriber_poll_timer(struct hrtimer *timer)
+{
+	struct ndp_subscriber *subscriber = container_of(timer, struct ndp_subscriber, poll_timer);
 
-	hrtimer_forward(timer, hrtimer_get_expires(timer), ns_to_ktime(200 * 1000));
-	return HRTIMER_RESTART;
+	/* Checking the channels needs process context */
+	set_bit(NDP_WAKE_TIMER, &subscriber->wake_reason);
+	queue_work(system_highpri_wq, &subscriber->poll_work);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * ndp_subscriber_irq_notify - card interrupt callback, runs in hardirq context
+ *
+ * Triggers the data check of all waiting subscribers.
+ */
+int ndp_subscriber_irq_notify(struct notifier_block *nb, unsigned long irq, void *data)
+{
+	struct ndp *ndp = container_of(nb, struct ndp, irq_nb);
+	struct nfb_irq_event *ev = data;
+	struct ndp_subscriber *subscriber;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(subscriber, &ndp->list_subscribers, list_head) {
+		if (test_bit(NDP_WAKE_ARMED, &subscriber->wake_reason))
+			queue_work(system_highpri_wq, &subscriber->poll_work);
+	}
+	rcu_read_unlock();
+
+	/* The MSI vector belongs to the card only, the interrupt is never foreign */
+	ev->handled = true;
+	return NOTIFY_OK;
 }
 
 /**
@@ -87,10 +192,14 @@ struct ndp_subscriber *ndp_subscriber_create(struct ndp *ndp)
 	init_waitqueue_head(&subscriber->poll_wait);
 	hrtimer_init(&subscriber->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	subscriber->poll_timer.function = ndp_subscriber_poll_timer;
+	INIT_WORK(&subscriber->poll_work, ndp_subscriber_poll_work);
+	mutex_init(&subscriber->wake_lock);
+	subscriber->wake_thresh = ndp_wake_thresh;
+	subscriber->wake_period = ndp_wake_period_default();
 	clear_bit(NDP_WAKE_RX, &subscriber->wake_reason);
 
 	mutex_lock(&ndp->lock);
-	list_add_tail(&subscriber->list_head, &ndp->list_subscribers);
+	list_add_tail_rcu(&subscriber->list_head, &ndp->list_subscribers);
 	mutex_unlock(&ndp->lock);
 	return subscriber;
 
@@ -111,14 +220,19 @@ void ndp_subscriber_destroy(struct ndp_subscriber *subscriber)
 
 	ndp = subscriber->ndp;
 
-	hrtimer_cancel(&subscriber->poll_timer);
+	mutex_lock(&ndp->lock);
+	list_del_rcu(&subscriber->list_head);
+	mutex_unlock(&ndp->lock);
+	/* Wait for interrupt notifier, which can still walk over this subscriber */
+	synchronize_rcu();
+
+	ndp_subscriber_disarm(subscriber);
 	list_for_each_entry_safe(sub, tmp, &subscriber->list_head_subscriptions, ndp_subscriber_list_item) {
 		ndp_subscription_destroy(sub);
 	}
 
-	mutex_lock(&ndp->lock);
-	list_del(&subscriber->list_head);
-	mutex_unlock(&ndp->lock);
+	if (subscriber->eventfd)
+		eventfd_ctx_put(subscriber->eventfd);
 
 	kfree(subscriber);
 }
@@ -139,19 +253,71 @@ struct ndp_subscription *ndp_subscription_by_id(struct ndp_subscriber *subscribe
 int ndp_subscriber_poll(struct ndp_subscriber *subscriber, struct file *filp, struct poll_table_struct *wait)
 {
 	int ret;
-	ktime_t to;
 
 	ret = test_bit(NDP_WAKE_RX, &subscriber->wake_reason) ? (POLLIN | POLLRDNORM) : 0;
 	if (ret) {
-		hrtimer_cancel(&subscriber->poll_timer);
 		clear_bit(NDP_WAKE_RX, &subscriber->wake_reason);
 		return ret;
 	}
 
 	poll_wait(filp, &subscriber->poll_wait, wait);
 
-	to = ktime_get();
-	to = ktime_add_ns(to, 200 * 1000);
-	hrtimer_start(&subscriber->poll_timer, to, HRTIMER_MODE_ABS);
+	ndp_subscriber_arm(subscriber);
 	return ret;
 }
+
+/**
+ * ndp_subscriber_set_wake - configure wakeup of the subscriber
+ * @subscriber: subscriber
+ * @wake: eventfd, threshold and timer period from userspace
+ *
+ * The eventfd subscriber is armed now and again after each sync call.
+ */
+int ndp_subscriber_set_wake(struct ndp_subscriber *subscriber, struct ndp_subscriber_wake *wake)
+{
+	struct eventfd_ctx *eventfd = NULL;
+
+	if (wake->flags)
+		return -EINVAL;
+	if (wake->period && wake->period < NDP_WAKE_PERIOD_MIN)
+		return -EINVAL;
+
+	if (wake->eventfd >= 0) {
+		eventfd = eventfd_ctx_fdget(wake->eventfd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	mutex_lock(&subscriber->wake_lock);
+	ndp_subscriber_disarm(subscriber);
+
+	WRITE_ONCE(subscriber->wake_thresh, wake->thresh ? wake->thresh : ndp_wake_thresh);
+	WRITE_ONCE(subscriber->wake_period, wake->period ? wake->period : ndp_wake_period_default());
+
+	swap(subscriber->eventfd, eventfd);
+	if (eventfd)
+		eventfd_ctx_put(eventfd);
+
+	/* Also restores the possibly cancelled wait of poll */
+	ndp_subscriber_arm(subscriber);
+	mutex_unlock(&subscriber->wake_lock);
+	return 0;
+}
+
+/**
+ * ndp_subscriber_sync_rearm - arm the eventfd subscriber after it consumed data
+ * @subscriber: subscriber
+ */
+void ndp_subscriber_sync_rearm(struct ndp_subscriber *subscriber)
+{
+	if (READ_ONCE(subscriber->eventfd) == NULL)
+		return;
+
+	clear_bit(NDP_WAKE_RX, &subscriber->wake_reason);
+	ndp_subscriber_arm(subscriber);
+}
+
+module_param(ndp_wake_period, uint, S_IRUGO);
+MODULE_PARM_DESC(ndp_wake_period, "Default period of the subscriber timer, which checks for received data, in us, at least 10 [200]");
+module_param(ndp_wake_thresh, uint, S_IRUGO);
+MODULE_PARM_DESC(ndp_wake_thresh, "Default count of pending packets (bytes for SZE), which wakes up the subscriber on interrupt [1]");
@@ -19,12 +19,20 @@ size_t ndp_subscription_rx_data_available(struct ndp_subscription *sub)
 
 	channel = sub->channel;
 
+	if (sub->status != NDP_SUB_STATUS_RUNNING)
 		return 0;
 	if (channel->id.type != NDP_CHANNEL_TYPE_RX)
 		return ret;
 
-	hwptr = channel->ops->get_hwptr(channel);
-	ret = (hwptr - sub->swptr) & (channel->ring.size - 1);
+	/* Serialize with stop / ring resize and with the sync of other subscribers */
+	mutex_lock(&channel->mutex);
+	if (channel->start_count) {
+		spin_lock(&channel->lock);
+		hwptr = channel->ops->get_hwptr(channel);
+		ret = (hwptr - sub->swptr) & channel->ptrmask;
+		spin_unlock(&channel->lock);
+	}
+	mutex_unlock(&channel->mutex);
 
 	return ret;
 }
@@ -671,6 +671,10 @@ static int nfb_net_open(struct net_device *netdev)
 	ret = nfb_net_transmission_on(netdev);
 	if (ret) return ret;
 
+	// Spread flows over the RX queues, table set by the user is kept
+	if (nfb_rss_reset(&priv->rss, netdev, priv->rxqs_offset, priv->rxqs_count))
+		printk(KERN_WARNING "%s: %s - failed to set RSS indirection table\n", __func__, netdev->name);
+
 	nfb_net_mac_on(netdev);
 	nfb_net_transceiver_on(netdev);
 
@@ -832,6 +836,8 @@ struct nfb_net_device *nfb_net_device_create(struct nfb_net *module, int fdt_off
 	if (IS_ERR(device->nc_txmac))
 		device->nc_txmac = NULL;
 
+	nfb_rss_init(&device->rss, nfbdev, index, module->rxqc);
+
 	fdt_node = fdt_node_offset_by_phandle_ref(nfbdev->fdt, fdt_offset, "pmd");
 	fdt_comp = fdt_node_offset_by_phandle_ref(nfbdev->fdt, fdt_node, "status-reg");
 	device->nc_trstat = nfb_comp_open(nfbdev, fdt_comp);
@@ -896,6 +902,7 @@ struct nfb_net_device *nfb_net_device_create(struct nfb_net *module, int fdt_off
 	return device;
 
 err_register_netdev:
+	nfb_rss_deinit(&device->rss);
 	nfb_net_sysfs_deinit(device);
 err_sysfs_init:
 	nfb_net_queues_deinit(netdev);
@@ -926,6 +933,8 @@ void nfb_net_device_destroy(struct nfb_net_device *device)
 	if (device->nc_mdio)
 		nc_mdio_close(device->nc_mdio);
 
+	nfb_rss_deinit(&device->rss);
+
 	nfb_net_sysfs_deinit(device);
 	nfb_net_queues_deinit(device->netdev);
 
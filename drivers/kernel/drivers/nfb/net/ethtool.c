@@ -445,6 +445,77 @@ static int nfb_net_set_channels(struct net_device *netdev, struct ethtool_channe
 }
 
 
+static int nfb_net_get_rxnfc(struct net_device *netdev, struct ethtool_rxnfc *cmd, u32 *rule_locs)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	switch (cmd->cmd) {
+	case ETHTOOL_GRXRINGS:
+		cmd->data = priv->rxqs_count;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+
+static u32 nfb_net_get_rxfh_indir_size(struct net_device *netdev)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	return nfb_rss_get_indir_size(&priv->rss);
+}
+
+
+static u32 nfb_net_get_rxfh_key_size(struct net_device *netdev)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	return nfb_rss_get_key_size(&priv->rss);
+}
+
+
+/* Firmware hashes with Toeplitz function only */
+#ifdef CONFIG_HAVE_ETHTOOL_RXFH_PARAM
+static int nfb_net_get_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	rxfh->hfunc = ETH_RSS_HASH_TOP;
+	return nfb_rss_get(&priv->rss, rxfh->indir, rxfh->key);
+}
+
+
+static int nfb_net_set_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh, struct netlink_ext_ack *extack)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	if (rxfh->hfunc != ETH_RSS_HASH_NO_CHANGE && rxfh->hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	return nfb_rss_set(&priv->rss, rxfh->indir, rxfh->key);
+}
+#else
+static int nfb_net_get_rxfh(struct net_device *netdev, u32 *indir, u8 *key, u8 *hfunc)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	if (hfunc)
+		*hfunc = ETH_RSS_HASH_TOP;
+	return nfb_rss_get(&priv->rss, indir, key);
+}
+
+
+static int nfb_net_set_rxfh(struct net_device *netdev, const u32 *indir, const u8 *key, const u8 hfunc)
+{
+	struct nfb_net_device *priv = netdev_priv(netdev);
+
+	if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	return nfb_rss_set(&priv->rss, indir, key);
+}
+#endif
+
+
 static const struct ethtool_ops nfb_net_ethtool_ops = {
 	.get_link = ethtool_op_get_link,
 	.get_drvinfo = nfb_net_get_drvinfo,
@@ -460,6 +531,11 @@ static const struct ethtool_ops nfb_net_ethtool_ops = {
 	.get_ethtool_stats = nfb_net_get_ethtool_stats,
 	.get_channels = nfb_net_get_channels,
 	.set_channels = nfb_net_set_channels,
+	.get_rxnfc = nfb_net_get_rxnfc,
+	.get_rxfh_indir_size = nfb_net_get_rxfh_indir_size,
+	.get_rxfh_key_size = nfb_net_get_rxfh_key_size,
+	.get_rxfh = nfb_net_get_rxfh,
+	.set_rxfh = nfb_net_set_rxfh,
 };
 
 
@@ -27,6 +27,8 @@
 
 #include <netcope/tsu.h>
 
+#include "../rss.h"
+
 #include <linux/ptp_clock_kernel.h>
 
 struct nfb_net {
@@ -95,6 +97,8 @@ struct nfb_net_device {
 	struct nc_mdio *nc_mdio;
 	struct mdio_if_info mdio;
 
+	struct nfb_rss rss;
+
 	unsigned rxqs_count;
 	unsigned rxqs_offset;
 	struct nfb_net_queue *rxqs;
@@ -13,6 +13,7 @@
 #include <asm/atomic.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/notifier.h>
 
 #include <linux/nfb/nfb.h>
 
@@ -110,7 +111,8 @@ struct nfb_lock_item {
  * Top-level structure describing a NFB device
  */
 struct nfb_device {
-	struct pci_dev *pci;                   /* Associated PCI device (master) */
+	struct pci_dev *pci;                   /* Associated PCI device (master), NULL for simulated device */
+	struct device *dma_dev;                /* Device doing the DMA transfers (PCI master or simulator) */
 	int minor;                             /* Minor number assigned to this device (used for X in /dev/nfbX) */
 	const char *serial_str;                /* String version of serial number. If is NULL, the 'serial' member should be used. */
 	uint64_t serial;                       /* Card serial number */
@@ -138,6 +140,14 @@ struct nfb_device {
 
 	struct mutex lock_mutex;
 	struct list_head lock_list;
+
+	struct atomic_notifier_head irq_notifier; /* Drivers woken up by the card MSI */
+};
+
+/* Notifier data of the card MSI, callbacks set handled when the interrupt concerned them */
+struct nfb_irq_event {
+	struct nfb_device *nfb;
+	bool handled;
 };
 
 #define NFB_IS_SILICOM(nfb) ((nfb)->pci->vendor == 0x1c2c)
@@ -226,6 +236,9 @@ void nfb_driver_unregister(struct nfb_driver_ops ops);
 int nfb_pci_init(void);
 void nfb_pci_exit(void);
 
+int nfb_irq_register_notifier(struct nfb_device *nfb, struct notifier_block *nb);
+void nfb_irq_unregister_notifier(struct nfb_device *nfb, struct notifier_block *nb);
+
 struct nfb_device *nfb_create(void);
 int nfb_probe(struct nfb_device *nfb);
 void nfb_remove(struct nfb_device *nfb);
@@ -674,8 +674,38 @@ err_no_fdt:
  */
 static irqreturn_t nfb_interrupt(int irq, void *pnfb)
 {
-	//struct nfb_device *nfb = (struct nfb_device *) pnfb;
-	return IRQ_NONE;
+	struct nfb_device *nfb = (struct nfb_device *) pnfb;
+	struct nfb_irq_event ev = {.nfb = nfb, .handled = false};
+
+	/* The card has a single vector: let every interested driver check its queues.
+	 * The chain returns only the last callback's value, the flag collects all of them */
+	atomic_notifier_call_chain(&nfb->irq_notifier, irq, &ev);
+	return ev.handled ? IRQ_HANDLED : IRQ_NONE;
+}
+
+/*
+ * nfb_irq_register_notifier - register callback invoked from the card interrupt
+ * @nfb: NFB device
+ * @nb: notifier block; callback runs in hardirq context, gets struct nfb_irq_event as data
+ *      and sets its handled flag when the interrupt concerned it
+ *
+ * Return: 0 on success, -ENODEV when the MSI is not available on this card
+ */
+int nfb_irq_register_notifier(struct nfb_device *nfb, struct notifier_block *nb)
+{
+	if (nfb->pci && nfb->pci->irq == -1)
+		return -ENODEV;
+	return atomic_notifier_chain_register(&nfb->irq_notifier, nb);
+}
+
+/*
+ * nfb_irq_unregister_notifier - unregister callback registered by nfb_irq_register_notifier
+ * @nfb: NFB device
+ * @nb: notifier block
+ */
+void nfb_irq_unregister_notifier(struct nfb_device *nfb, struct notifier_block *nb)
+{
+	atomic_notifier_chain_unregister(&nfb->irq_notifier, nb);
 }
 
 /*
@@ -1105,6 +1135,7 @@ static int nfb_pci_probe_main(struct nfb_pci_device *pci_device, const struct pc
 		goto err_nfb_create;
 	}
 	nfb->pci = pci;
+	nfb->dma_dev = &pci->dev;
 	nfb->pci_name = nfb_card_name_generic;
 	nfb->nfb_pci_dev = (struct nfb_pci_dev*) id->driver_data;
 	if (nfb->nfb_pci_dev)
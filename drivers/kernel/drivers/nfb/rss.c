@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * RSS support of the NFB platform network drivers
+ *	maps ethtool rxfh onto the nic_rss firmware component
+ *
+ * Copyright (C) 2025 CESNET
+ */
+
+#include <linux/ethtool.h>
+#include <linux/netdevice.h>
+
+#include <libfdt.h>
+
+#include "nfb.h"
+#include "rss.h"
+
+#include <netcope/nic_rss.h>
+
+/**
+ * @brief Opens RSS of the port, netdev works without it
+ *
+ * @param rss
+ * @param nfb
+ * @param port index of ETH port
+ * @param queue_total number of rx queues of the card
+ */
+void nfb_rss_init(struct nfb_rss *rss, struct nfb_device *nfb, int port, u32 queue_total)
+{
+	int fdt_offset;
+
+	memset(rss, 0, sizeof(*rss));
+	rss->port = port;
+	rss->queue_total = queue_total;
+
+	fdt_offset = nfb_comp_find(nfb, COMP_CESNET_NIC_RSS, 0);
+	if (fdt_offset < 0 || !queue_total)
+		return;
+
+	rss->comp = nc_nic_rss_open(nfb, fdt_offset);
+}
+
+void nfb_rss_deinit(struct nfb_rss *rss)
+{
+	if (rss->comp)
+		nc_nic_rss_close(rss->comp);
+	rss->comp = NULL;
+}
+
+u32 nfb_rss_get_indir_size(struct nfb_rss *rss)
+{
+	return rss->comp ? nc_nic_rss_get_reta_size(rss->comp) : 0;
+}
+
+u32 nfb_rss_get_key_size(struct nfb_rss *rss)
+{
+	return rss->comp ? nc_nic_rss_get_key_size(rss->comp) : 0;
+}
+
+/**
+ * @brief Reads the indirection table and the key of the port
+ *
+ * @param rss
+ * @param indir rx rings of the netdev, can be NULL
+ * @param key can be NULL
+ * @return 0 on success
+ */
+int nfb_rss_get(struct nfb_rss *rss, u32 *indir, u8 *key)
+{
+	u32 i, size;
+	int queue, ret;
+
+	if (!rss->comp)
+		return -EOPNOTSUPP;
+
+	if (indir) {
+		size = nfb_rss_get_indir_size(rss);
+		for (i = 0; i < size; i++) {
+			if ((ret = nc_nic_rss_get_reta(rss->comp, rss->port, i, &queue)))
+				return ret;
+			queue = (queue + rss->queue_total - rss->queue_base) % rss->queue_total;
+			// queue outside of the netdev, set by someone else
+			indir[i] = queue < rss->queue_count ? queue : 0;
+		}
+	}
+
+	if (key)
+		return nc_nic_rss_read_key(rss->comp, rss->port, key, nfb_rss_get_key_size(rss));
+	return 0;
+}
+
+/**
+ * @brief Writes the indirection table and the key of the port
+ *
+ * @param rss
+ * @param indir rx rings of the netdev, NULL keeps the current table
+ * @param key NULL keeps the current key
+ * @return 0 on success
+ */
+int nfb_rss_set(struct nfb_rss *rss, const u32 *indir, const u8 *key)
+{
+	u32 i, size;
+	int ret;
+
+	if (!rss->comp)
+		return -EOPNOTSUPP;
+
+	if (indir) {
+		size = nfb_rss_get_indir_size(rss);
+		for (i = 0; i < size; i++) {
+			if (indir[i] >= rss->queue_count)
+				return -EINVAL;
+		}
+		for (i = 0; i < size; i++) {
+			if ((ret = nc_nic_rss_set_reta(rss->comp, rss->port, i, (rss->queue_base + indir[i]) % rss->queue_total)))
+				return ret;
+		}
+	}
+
+	if (key)
+		return nc_nic_rss_write_key(rss->comp, rss->port, key, nfb_rss_get_key_size(rss));
+	return 0;
+}
+
+/**
+ * @brief Updates the rx rings of the netdev.
+ * 	Indirection table is spread evenly over the rings unless the user configured it,
+ * 	so the table follows changes of the channel count.
+ *
+ * @param rss
+ * @param netdev
+ * @param queue_base card rx queue of the ring 0
+ * @param queue_count rx rings of the netdev
+ * @return 0 on success
+ */
+int nfb_rss_reset(struct nfb_rss *rss, struct net_device *netdev, u32 queue_base, u32 queue_count)
+{
+	u32 i, size;
+	int ret;
+
+	rss->queue_base = queue_base;
+	rss->queue_count = queue_count;
+
+	if (!rss->comp || !queue_count || netif_is_rxfh_configured(netdev))
+		return 0;
+
+	size = nfb_rss_get_indir_size(rss);
+	for (i = 0; i < size; i++) {
+		if ((ret = nc_nic_rss_set_reta(rss->comp, rss->port, i, (queue_base + ethtool_rxfh_indir_default(i, queue_count)) % rss->queue_total)))
+			return ret;
+	}
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * Header for RSS support of the NFB platform network drivers
+ *
+ * Copyright (C) 2025 CESNET
+ */
+
+#ifndef NFB_RSS_H
+#define NFB_RSS_H
+
+#include <linux/netdevice.h>
+
+struct nfb_device;
+struct nc_nic_rss;
+
+/*
+ * RSS of one ETH port, programmed through the firmware nic_rss component.
+ * Firmware indirection table holds card rx queues, ethtool works with
+ * rx rings of the netdev, which are a range of card queues starting at queue_base.
+ */
+struct nfb_rss {
+	struct nc_nic_rss *comp; // NULL when the firmware has no RSS
+	int port; // RSS channel of the component, index of ETH port
+	u32 queue_total; // rx queues of the card, range of the netdev can wrap around
+	u32 queue_base; // card rx queue of the netdev ring 0
+	u32 queue_count; // rx rings of the netdev
+};
+
+void nfb_rss_init(struct nfb_rss *rss, struct nfb_device *nfb, int port, u32 queue_total);
+void nfb_rss_deinit(struct nfb_rss *rss);
+
+u32 nfb_rss_get_indir_size(struct nfb_rss *rss);
+u32 nfb_rss_get_key_size(struct nfb_rss *rss);
+int nfb_rss_get(struct nfb_rss *rss, u32 *indir, u8 *key);
+int nfb_rss_set(struct nfb_rss *rss, const u32 *indir, const u8 *key);
+int nfb_rss_reset(struct nfb_rss *rss, struct net_device *netdev, u32 queue_base, u32 queue_count);
+
+#endif // NFB_RSS_H
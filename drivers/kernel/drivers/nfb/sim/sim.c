@@ -0,0 +1,799 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * Software DMA simulator of the NFB platform
+ *	emulates the Medusa NDP controllers in host memory, so the XDP driver
+ *	can run without the card
+ *
+ * Copyright (C) 2025 CESNET
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-direct.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+
+#include <libfdt.h>
+
+#include "../nfb.h"
+#include "../xdp/driver.h"
+#include "sim.h"
+
+#include <netcope/eth.h>
+#include <netcope/queue.h>
+
+#define NFB_SIM_DEVICES_MAX 4
+#define NFB_SIM_FDT_SIZE 65536
+
+#define NFB_SIM_BUS_PATH "/firmware/mi_bus0"
+// register space of one controller, counters end at 0x80
+#define NFB_SIM_CTRL_SIZE 0x100
+// controller pointers are 16 bits wide, ring sizes up to 32k
+#define NFB_SIM_PTR_MASK 0xFFFF
+
+#define NFB_SIM_FRAME_MAX 16384
+#define NFB_SIM_GEN_LEN_MIN 60
+#define NFB_SIM_BURST 64
+// frames looped back from tx, waiting for rx buffers
+#define NFB_SIM_LOOP_DEPTH 512
+#define NFB_SIM_IDLE_US 20
+
+static unsigned int sim_devices = 0;
+static unsigned int sim_ports = 1;
+static unsigned int sim_queues = 4;
+static unsigned int sim_xmit_queues = 0;
+static unsigned int sim_gen_len = 64;
+static bool sim_loopback = 1;
+
+struct nfb_sim_frame {
+	u32 len;
+	u8 data[];
+};
+
+struct nfb_sim;
+
+// state of one emulated NDP controller, registers are guarded by the lock
+struct nfb_sim_ctrl {
+	struct nfb_sim *sim;
+	spinlock_t lock;
+	bool rx;
+	u16 index; // index of the controller within its direction
+
+	u32 control;
+	u32 sdp;
+	u32 shp;
+	u32 hdp;
+	u32 hhp;
+	u32 mdp;
+	u32 mhp;
+	u32 timeout;
+	u64 desc_base;
+	u64 hdr_base;
+	u64 update_base;
+	u64 upper_addr; // set by the last type0 descriptor
+
+	// processed and discarded frames, read through the strobe latch
+	u64 cnt[4];
+	u64 cnt_latch[4];
+
+	// rx only - ring of frames looped back from tx
+	struct nfb_sim_frame *loop[NFB_SIM_LOOP_DEPTH];
+	u32 loop_head;
+	u32 loop_tail;
+	u32 gen_seq;
+};
+
+enum {
+	NFB_SIM_CNT_PKTS,
+	NFB_SIM_CNT_BYTES,
+	NFB_SIM_CNT_DISC,
+	NFB_SIM_CNT_DISC_BYTES,
+};
+
+struct nfb_sim {
+	struct platform_device *pdev;
+	struct nfb_device *nfb;
+	struct nfb_bus bus;
+	void *xdp_priv;
+	struct task_struct *thread;
+
+	u16 rxqc;
+	u16 txqc;
+	struct nfb_sim_ctrl *ctrls; // rx controllers followed by tx controllers
+
+	// template of generated frame, the engine thread patches the source port
+	u8 gen_frame[NFB_SIM_FRAME_MAX];
+	u32 gen_len;
+	// tx frame being gathered from descriptors
+	u8 tx_frame[NFB_SIM_FRAME_MAX];
+};
+
+static struct nfb_sim *nfb_sims[NFB_SIM_DEVICES_MAX];
+
+/**
+ * @brief Translates bus address written by the driver to kernel pointer.
+ * 	The simulator device has no IOMMU, dma addresses are physical addresses.
+ *
+ * @param sim
+ * @param addr
+ * @return pointer into the direct map
+ */
+static inline void *nfb_sim_dma_ptr(struct nfb_sim *sim, u64 addr)
+{
+	return phys_to_virt(dma_to_phys(&sim->pdev->dev, addr));
+}
+
+static inline void nfb_sim_write_update(struct nfb_sim_ctrl *ctrl)
+{
+	u32 *update = nfb_sim_dma_ptr(ctrl->sim, ctrl->update_base);
+
+	// data and headers must be visible before the pointers
+	smp_wmb();
+	WRITE_ONCE(update[0], ctrl->hdp);
+	if (ctrl->rx)
+		WRITE_ONCE(update[1], ctrl->hhp);
+}
+
+static inline u64 nfb_sim_desc_upper_addr(struct nc_ndp_desc desc)
+{
+	return ((u64)desc.d.type0.phys_lo << 30) | ((u64)desc.d.type0.phys_hi << 62);
+}
+
+static void nfb_sim_ctrl_purge_loop(struct nfb_sim_ctrl *ctrl)
+{
+	while (ctrl->loop_tail != ctrl->loop_head) {
+		kfree(ctrl->loop[ctrl->loop_tail]);
+		ctrl->loop_tail = (ctrl->loop_tail + 1) % NFB_SIM_LOOP_DEPTH;
+	}
+}
+
+/**
+ * @brief Writes one frame into rx buffers of the driver, frame can span more buffers.
+ * 	Nothing is committed when the driver didn't provide enough descriptors.
+ *
+ * @param ctrl locked rx controller
+ * @param data
+ * @param len
+ * @return 0 on success, -ENOBUFS when the frame doesn't fit
+ */
+static int nfb_sim_rx_frame(struct nfb_sim_ctrl *ctrl, const u8 *data, u32 len)
+{
+	struct nc_ndp_desc *descs = nfb_sim_dma_ptr(ctrl->sim, ctrl->desc_base);
+	struct nc_ndp_hdr *hdrs = nfb_sim_dma_ptr(ctrl->sim, ctrl->hdr_base);
+	struct nc_ndp_hdr *hdr;
+	struct nc_ndp_desc desc;
+	u64 upper = ctrl->upper_addr;
+	u32 hdp = ctrl->hdp;
+	u32 off = 0, chunk, buf_len;
+
+	do {
+		if (hdp == ctrl->sdp)
+			return -ENOBUFS;
+		desc = READ_ONCE(descs[hdp]);
+		hdp = (hdp + 1) & ctrl->mdp;
+		if (desc.d.type0.type == 0) {
+			upper = nfb_sim_desc_upper_addr(desc);
+			continue;
+		}
+		if (desc.d.type2.type != 2)
+			continue;
+
+		buf_len = desc.d.type2.len ? desc.d.type2.len : 65536;
+		chunk = min(len - off, buf_len);
+		memcpy(nfb_sim_dma_ptr(ctrl->sim, upper | desc.d.type2.phys), data + off, chunk);
+		off += chunk;
+	} while (off < len);
+
+	hdr = &hdrs[ctrl->hhp];
+	hdr->frame_len = len;
+	hdr->hdr_len = 0;
+	hdr->meta = 0;
+	hdr->reserved = 0;
+	hdr->free_desc = 0;
+
+	ctrl->hdp = hdp;
+	ctrl->hhp = (ctrl->hhp + 1) & ctrl->mhp;
+	ctrl->upper_addr = upper;
+	ctrl->cnt[NFB_SIM_CNT_PKTS]++;
+	ctrl->cnt[NFB_SIM_CNT_BYTES] += len;
+	return 0;
+}
+
+/**
+ * @brief Receives looped back frames first, then the generated ones.
+ *
+ * @param ctrl rx controller
+ * @return number of received frames
+ */
+static unsigned nfb_sim_rx_process(struct nfb_sim_ctrl *ctrl)
+{
+	struct nfb_sim *sim = ctrl->sim;
+	struct nfb_sim_frame *frame;
+	struct udphdr *udp = (struct udphdr *)(sim->gen_frame + ETH_HLEN + sizeof(struct iphdr));
+	unsigned cnt = 0;
+
+	spin_lock_bh(&ctrl->lock);
+	if (!(ctrl->control & NDP_CTRL_REG_CONTROL_START))
+		goto out;
+
+	while (cnt < NFB_SIM_BURST && ctrl->loop_tail != ctrl->loop_head) {
+		frame = ctrl->loop[ctrl->loop_tail];
+		if (nfb_sim_rx_frame(ctrl, frame->data, frame->len))
+			break;
+		kfree(frame);
+		ctrl->loop_tail = (ctrl->loop_tail + 1) % NFB_SIM_LOOP_DEPTH;
+		cnt++;
+	}
+
+	while (sim->gen_len && cnt < NFB_SIM_BURST) {
+		// flows differ in source port, queue index keeps the queues apart
+		udp->source = htons(1024 + ((ctrl->index << 8) | (ctrl->gen_seq & 0xFF)));
+		if (nfb_sim_rx_frame(ctrl, sim->gen_frame, sim->gen_len))
+			break;
+		ctrl->gen_seq++;
+		cnt++;
+	}
+
+	if (cnt)
+		nfb_sim_write_update(ctrl);
+out:
+	spin_unlock_bh(&ctrl->lock);
+	return cnt;
+}
+
+/**
+ * @brief Rx controller receiving the frames of tx controller in loopback.
+ * 	Spare tx queues of the port loop into the rx queues too.
+ *
+ * @param ctrl tx controller
+ * @return rx controller
+ */
+static struct nfb_sim_ctrl *nfb_sim_loop_target(struct nfb_sim_ctrl *ctrl)
+{
+	unsigned tx_per_port = sim_queues + sim_xmit_queues;
+	unsigned port = ctrl->index / tx_per_port;
+	unsigned queue = (ctrl->index % tx_per_port) % sim_queues;
+
+	return &ctrl->sim->ctrls[port * sim_queues + queue];
+}
+
+static void nfb_sim_loop_frame(struct nfb_sim_ctrl *ctrl, const u8 *data, u32 len)
+{
+	struct nfb_sim_ctrl *rx = nfb_sim_loop_target(ctrl);
+	struct nfb_sim_frame *frame;
+	u32 head;
+
+	spin_lock_bh(&rx->lock);
+	head = (rx->loop_head + 1) % NFB_SIM_LOOP_DEPTH;
+	if (!(rx->control & NDP_CTRL_REG_CONTROL_START) || head == rx->loop_tail)
+		goto err_discard;
+
+	frame = kmalloc(sizeof(*frame) + len, GFP_ATOMIC);
+	if (!frame)
+		goto err_discard;
+	frame->len = len;
+	memcpy(frame->data, data, len);
+	rx->loop[rx->loop_head] = frame;
+	rx->loop_head = head;
+	spin_unlock_bh(&rx->lock);
+	return;
+
+err_discard:
+	rx->cnt[NFB_SIM_CNT_DISC]++;
+	rx->cnt[NFB_SIM_CNT_DISC_BYTES] += len;
+	spin_unlock_bh(&rx->lock);
+}
+
+/**
+ * @brief Transmits frames from the descriptors between hdp and sdp.
+ * 	Frame whose chain isn't complete yet is left for the next round.
+ *
+ * @param ctrl tx controller
+ * @return number of transmitted frames
+ */
+static unsigned nfb_sim_tx_process(struct nfb_sim_ctrl *ctrl)
+{
+	struct nfb_sim *sim = ctrl->sim;
+	struct nc_ndp_desc *descs;
+	struct nc_ndp_desc desc;
+	u64 upper;
+	u32 hdp, len, chunk;
+	unsigned cnt = 0;
+
+	spin_lock_bh(&ctrl->lock);
+	if (!(ctrl->control & NDP_CTRL_REG_CONTROL_START))
+		goto out;
+
+	descs = nfb_sim_dma_ptr(sim, ctrl->desc_base);
+	while (cnt < NFB_SIM_BURST && ctrl->hdp != ctrl->sdp) {
+		hdp = ctrl->hdp;
+		upper = ctrl->upper_addr;
+		len = 0;
+		for (;;) {
+			if (hdp == ctrl->sdp)
+				goto out_update;
+			desc = READ_ONCE(descs[hdp]);
+			hdp = (hdp + 1) & ctrl->mdp;
+			if (desc.d.type0.type == 0) {
+				upper = nfb_sim_desc_upper_addr(desc);
+				continue;
+			}
+			if (desc.d.type2.type != 2)
+				continue;
+
+			// oversized frames are truncated
+			chunk = min_t(u32, desc.d.type2.len, NFB_SIM_FRAME_MAX - len);
+			memcpy(sim->tx_frame + len, nfb_sim_dma_ptr(sim, upper | desc.d.type2.phys), chunk);
+			len += chunk;
+			if (!desc.d.type2.next0)
+				break;
+		}
+
+		ctrl->hdp = hdp;
+		ctrl->upper_addr = upper;
+		ctrl->cnt[NFB_SIM_CNT_PKTS]++;
+		ctrl->cnt[NFB_SIM_CNT_BYTES] += len;
+		cnt++;
+
+		// lock order is tx controller, then rx controller
+		if (sim_loopback)
+			nfb_sim_loop_frame(ctrl, sim->tx_frame, len);
+	}
+
+out_update:
+	if (cnt)
+		nfb_sim_write_update(ctrl);
+out:
+	spin_unlock_bh(&ctrl->lock);
+	return cnt;
+}
+
+static int nfb_sim_thread(void *data)
+{
+	struct nfb_sim *sim = data;
+	unsigned i, rx, tx;
+	unsigned long flags;
+
+	while (!kthread_should_stop()) {
+		tx = 0;
+		for (i = 0; i < sim->txqc; i++)
+			tx += nfb_sim_tx_process(&sim->ctrls[sim->rxqc + i]);
+
+		rx = 0;
+		for (i = 0; i < sim->rxqc; i++)
+			rx += nfb_sim_rx_process(&sim->ctrls[i]);
+
+		// card raises MSI when the rx controller writes new pointers
+		if (rx) {
+			struct nfb_irq_event ev = {.nfb = sim->nfb, .handled = false};
+
+			local_irq_save(flags);
+			atomic_notifier_call_chain(&sim->nfb->irq_notifier, 0, &ev);
+			local_irq_restore(flags);
+		}
+
+		if (rx || tx)
+			cond_resched();
+		else
+			usleep_range(NFB_SIM_IDLE_US, 2 * NFB_SIM_IDLE_US);
+	}
+	return 0;
+}
+
+static u32 nfb_sim_reg_read(struct nfb_sim_ctrl *ctrl, u32 reg)
+{
+	switch (reg) {
+	case NDP_CTRL_REG_CONTROL:
+		return ctrl->control;
+	case NDP_CTRL_REG_STATUS:
+		return ctrl->control & NDP_CTRL_REG_CONTROL_START ? NDP_CTRL_REG_STATUS_RUNNING : 0;
+	case NDP_CTRL_REG_SDP:
+		return ctrl->sdp;
+	case NDP_CTRL_REG_SHP:
+		return ctrl->shp;
+	case NDP_CTRL_REG_HDP:
+		return ctrl->hdp;
+	case NDP_CTRL_REG_HHP:
+		return ctrl->hhp;
+	case NDP_CTRL_REG_TIMEOUT:
+		return ctrl->timeout;
+	case NDP_CTRL_REG_DESC_BASE:
+		return lower_32_bits(ctrl->desc_base);
+	case NDP_CTRL_REG_DESC_BASE + 4:
+		return upper_32_bits(ctrl->desc_base);
+	case NDP_CTRL_REG_HDR_BASE:
+		return lower_32_bits(ctrl->hdr_base);
+	case NDP_CTRL_REG_HDR_BASE + 4:
+		return upper_32_bits(ctrl->hdr_base);
+	case NDP_CTRL_REG_UPDATE_BASE:
+		return lower_32_bits(ctrl->update_base);
+	case NDP_CTRL_REG_UPDATE_BASE + 4:
+		return upper_32_bits(ctrl->update_base);
+	case NDP_CTRL_REG_MDP:
+		return ctrl->mdp;
+	case NDP_CTRL_REG_MHP:
+		return ctrl->mhp;
+	case NDP_CTRL_REG_CNTR_RECV ... NDP_CTRL_REG_CNTR_DISC + 0xC:
+		reg -= NDP_CTRL_REG_CNTR_RECV;
+		return reg & 4 ? upper_32_bits(ctrl->cnt_latch[reg / 8]) : lower_32_bits(ctrl->cnt_latch[reg / 8]);
+	default:
+		return 0;
+	}
+}
+
+static void nfb_sim_reg_write(struct nfb_sim_ctrl *ctrl, u32 reg, u32 val)
+{
+	switch (reg) {
+	case NDP_CTRL_REG_CONTROL:
+		if ((val & NDP_CTRL_REG_CONTROL_START) && !(ctrl->control & NDP_CTRL_REG_CONTROL_START)) {
+			ctrl->hdp = 0;
+			ctrl->hhp = 0;
+			ctrl->upper_addr = 0;
+		} else if (!(val & NDP_CTRL_REG_CONTROL_START) && ctrl->rx) {
+			// frames waiting for buffers are lost with the stop
+			nfb_sim_ctrl_purge_loop(ctrl);
+		}
+		ctrl->control = val;
+		break;
+	case NDP_CTRL_REG_SDP:
+		ctrl->sdp = val & ctrl->mdp;
+		break;
+	case NDP_CTRL_REG_SHP:
+		ctrl->shp = val & ctrl->mhp;
+		break;
+	case NDP_CTRL_REG_TIMEOUT:
+		ctrl->timeout = val;
+		break;
+	case NDP_CTRL_REG_DESC_BASE:
+		ctrl->desc_base = (ctrl->desc_base & ~0xFFFFFFFFull) | val;
+		break;
+	case NDP_CTRL_REG_DESC_BASE + 4:
+		ctrl->desc_base = lower_32_bits(ctrl->desc_base) | ((u64)val << 32);
+		break;
+	case NDP_CTRL_REG_HDR_BASE:
+		ctrl->hdr_base = (ctrl->hdr_base & ~0xFFFFFFFFull) | val;
+		break;
+	case NDP_CTRL_REG_HDR_BASE + 4:
+		ctrl->hdr_base = lower_32_bits(ctrl->hdr_base) | ((u64)val << 32);
+		break;
+	case NDP_CTRL_REG_UPDATE_BASE:
+		ctrl->update_base = (ctrl->update_base & ~0xFFFFFFFFull) | val;
+		break;
+	case NDP_CTRL_REG_UPDATE_BASE + 4:
+		ctrl->update_base = lower_32_bits(ctrl->update_base) | ((u64)val << 32);
+		break;
+	case NDP_CTRL_REG_MDP:
+		ctrl->mdp = val & NFB_SIM_PTR_MASK;
+		break;
+	case NDP_CTRL_REG_MHP:
+		ctrl->mhp = val & NFB_SIM_PTR_MASK;
+		break;
+	case NDP_CTRL_REG_CNTR_RECV:
+		if (val == CNTR_CMD_STRB || val == CNTR_CMD_STRB_RST)
+			memcpy(ctrl->cnt_latch, ctrl->cnt, sizeof(ctrl->cnt));
+		if (val == CNTR_CMD_RST || val == CNTR_CMD_STRB_RST)
+			memset(ctrl->cnt, 0, sizeof(ctrl->cnt));
+		break;
+	default:
+		break;
+	}
+}
+
+static struct nfb_sim_ctrl *nfb_sim_bus_ctrl(struct nfb_bus *bus, size_t nbyte, off_t offset)
+{
+	struct nfb_sim *sim = bus->priv;
+	unsigned index = offset / NFB_SIM_CTRL_SIZE;
+
+	// registers are accessed by aligned 32b or 64b words
+	if ((nbyte != sizeof(u32) && nbyte != sizeof(u64)) || offset % sizeof(u32))
+		return NULL;
+	if (index >= sim->rxqc + sim->txqc)
+		return NULL;
+	return &sim->ctrls[index];
+}
+
+static ssize_t nfb_sim_bus_read(struct nfb_bus *bus, void *buf, size_t nbyte, off_t offset)
+{
+	struct nfb_sim_ctrl *ctrl = nfb_sim_bus_ctrl(bus, nbyte, offset);
+	u32 reg = offset % NFB_SIM_CTRL_SIZE;
+	u32 val[2];
+	unsigned i;
+
+	if (!ctrl)
+		return -EINVAL;
+
+	spin_lock_bh(&ctrl->lock);
+	for (i = 0; i < nbyte / sizeof(u32); i++)
+		val[i] = nfb_sim_reg_read(ctrl, reg + i * sizeof(u32));
+	spin_unlock_bh(&ctrl->lock);
+
+	memcpy(buf, val, nbyte);
+	return nbyte;
+}
+
+static ssize_t nfb_sim_bus_write(struct nfb_bus *bus, const void *buf, size_t nbyte, off_t offset)
+{
+	struct nfb_sim_ctrl *ctrl = nfb_sim_bus_ctrl(bus, nbyte, offset);
+	u32 reg = offset % NFB_SIM_CTRL_SIZE;
+	u32 val[2];
+	unsigned i;
+
+	if (!ctrl)
+		return -EINVAL;
+
+	memcpy(val, buf, nbyte);
+	spin_lock_bh(&ctrl->lock);
+	for (i = 0; i < nbyte / sizeof(u32); i++)
+		nfb_sim_reg_write(ctrl, reg + i * sizeof(u32), val[i]);
+	spin_unlock_bh(&ctrl->lock);
+	return nbyte;
+}
+
+/**
+ * @brief Builds the generated frame: Ethernet, IPv4 and UDP to the discard port.
+ *
+ * @param sim
+ */
+static void nfb_sim_init_gen_frame(struct nfb_sim *sim)
+{
+	static const u8 dst[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+	static const u8 src[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+	struct ethhdr *eth = (struct ethhdr *)sim->gen_frame;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+	sim->gen_len = 0;
+	if (!sim_gen_len)
+		return;
+	sim->gen_len = clamp_t(u32, sim_gen_len, NFB_SIM_GEN_LEN_MIN, NFB_SIM_FRAME_MAX);
+
+	memset(sim->gen_frame, 0, sizeof(sim->gen_frame));
+	memcpy(eth->h_dest, dst, ETH_ALEN);
+	memcpy(eth->h_source, src, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	// benchmarking range 198.18.0.0/15
+	ip->version = 4;
+	ip->ihl = sizeof(*ip) / 4;
+	ip->tot_len = htons(sim->gen_len - ETH_HLEN);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = htonl(0xC6120001);
+	ip->daddr = htonl(0xC6120002);
+	ip->check = ip_fast_csum(ip, ip->ihl);
+
+	udp->dest = htons(9);
+	udp->len = htons(sim->gen_len - ETH_HLEN - sizeof(*ip));
+}
+
+/**
+ * @brief Creates device tree of the simulated card.
+ * 	Each port gets sim_queues rx/tx controller pairs and sim_xmit_queues spare tx controllers.
+ *
+ * @param sim
+ * @return 0 on success
+ */
+static int nfb_sim_init_fdt(struct nfb_sim *sim)
+{
+	void *fdt;
+	int node, bus, ret;
+	char name[32];
+	unsigned i;
+
+	fdt = kzalloc(NFB_SIM_FDT_SIZE, GFP_KERNEL);
+	if (!fdt)
+		return -ENOMEM;
+	fdt_create_empty_tree(fdt, NFB_SIM_FDT_SIZE);
+
+	node = fdt_add_subnode(fdt, fdt_path_offset(fdt, "/"), "firmware");
+	bus = fdt_add_subnode(fdt, node, "mi_bus0");
+	fdt_setprop_string(fdt, bus, "compatible", "cesnet,bus,sim");
+
+	for (i = 0; i < sim->rxqc + sim->txqc; i++) {
+		bool rx = i < sim->rxqc;
+
+		snprintf(name, sizeof(name), "dma_ctrl_ndp_%s%u", rx ? "rx" : "tx", rx ? i : i - sim->rxqc);
+		node = fdt_add_subnode(fdt, bus, name);
+		fdt_setprop_string(fdt, node, "compatible", rx ? COMP_NC_DMA_CTRL_NDP_RX : COMP_NC_DMA_CTRL_NDP_TX);
+		fdt_setprop_u64(fdt, node, "reg", ((u64)(i * NFB_SIM_CTRL_SIZE) << 32) | NFB_SIM_CTRL_SIZE);
+	}
+
+	for (i = 0; i < sim_ports; i++) {
+		snprintf(name, sizeof(name), "ethernet%u", i);
+		node = fdt_add_subnode(fdt, fdt_path_offset(fdt, "/firmware"), name);
+		ret = fdt_setprop_string(fdt, node, "compatible", COMP_NETCOPE_ETH);
+		if (ret < 0) {
+			kfree(fdt);
+			return -ENOSPC;
+		}
+	}
+
+	sim->nfb->fdt = fdt;
+	return 0;
+}
+
+static struct nfb_sim *nfb_sim_create(int id)
+{
+	struct nfb_sim *sim;
+	struct nfb_device *nfb;
+	unsigned i;
+	int ret;
+
+	sim = vzalloc(sizeof(*sim));
+	if (!sim) {
+		ret = -ENOMEM;
+		goto err_alloc_sim;
+	}
+
+	sim->rxqc = sim_ports * sim_queues;
+	sim->txqc = sim_ports * (sim_queues + sim_xmit_queues);
+	sim->ctrls = kcalloc(sim->rxqc + sim->txqc, sizeof(*sim->ctrls), GFP_KERNEL);
+	if (!sim->ctrls) {
+		ret = -ENOMEM;
+		goto err_alloc_ctrls;
+	}
+	for (i = 0; i < sim->rxqc + sim->txqc; i++) {
+		spin_lock_init(&sim->ctrls[i].lock);
+		sim->ctrls[i].sim = sim;
+		sim->ctrls[i].rx = i < sim->rxqc;
+		sim->ctrls[i].index = sim->ctrls[i].rx ? i : i - sim->rxqc;
+	}
+	nfb_sim_init_gen_frame(sim);
+
+	// platform device without IOMMU, the controllers access memory through the direct map
+	sim->pdev = platform_device_register_simple("nfb_sim", id, NULL, 0);
+	if (IS_ERR(sim->pdev)) {
+		ret = PTR_ERR(sim->pdev);
+		goto err_pdev;
+	}
+	ret = dma_coerce_mask_and_coherent(&sim->pdev->dev, DMA_BIT_MASK(64));
+	if (ret)
+		goto err_dma_mask;
+
+	nfb = nfb_create();
+	if (IS_ERR(nfb)) {
+		ret = PTR_ERR(nfb);
+		goto err_nfb_create;
+	}
+	sim->nfb = nfb;
+	nfb->dma_dev = &sim->pdev->dev;
+	nfb->pci_name = "Simulated NFB";
+	nfb->serial = id;
+
+	ret = nfb_sim_init_fdt(sim);
+	if (ret)
+		goto err_init_fdt;
+
+	sim->bus.read = nfb_sim_bus_read;
+	sim->bus.write = nfb_sim_bus_write;
+	sim->bus.priv = sim;
+	strscpy(sim->bus.path, NFB_SIM_BUS_PATH, sizeof(sim->bus.path));
+	nfb_bus_register(nfb, &sim->bus);
+	nfb_lock_probe(nfb);
+
+	ret = nfb_char_probe(nfb);
+	if (ret)
+		goto err_char_probe;
+
+	sim->thread = kthread_run(nfb_sim_thread, sim, "nfb_sim%d", nfb->minor);
+	if (IS_ERR(sim->thread)) {
+		ret = PTR_ERR(sim->thread);
+		goto err_thread;
+	}
+
+	// only the XDP driver runs on the simulated card
+	ret = nfb_xdp_attach(nfb, &sim->xdp_priv);
+	if (ret)
+		goto err_xdp_attach;
+	if (!sim->xdp_priv)
+		dev_warn(nfb->dev, "nfb_sim: XDP driver is disabled, load the module with xdp_enable=1\n");
+
+	dev_info(nfb->dev, "nfb_sim: simulated card with %u ports, %u rx and %u tx queues\n",
+			sim_ports, sim->rxqc, sim->txqc);
+	return sim;
+
+err_xdp_attach:
+	kthread_stop(sim->thread);
+err_thread:
+err_char_probe:
+	nfb_lock_remove(nfb);
+	nfb_bus_unregister(nfb, &sim->bus);
+	kfree(nfb->fdt);
+err_init_fdt:
+	// releases the minor, the char device may not exist yet
+	nfb_char_remove(nfb);
+	nfb_destroy(nfb);
+err_nfb_create:
+err_dma_mask:
+	platform_device_unregister(sim->pdev);
+err_pdev:
+	kfree(sim->ctrls);
+err_alloc_ctrls:
+	vfree(sim);
+err_alloc_sim:
+	return ERR_PTR(ret);
+}
+
+static void nfb_sim_destroy(struct nfb_sim *sim)
+{
+	struct nfb_device *nfb = sim->nfb;
+	unsigned i;
+
+	// controllers are stopped by the driver, the engine must outlive them
+	nfb_xdp_detach(nfb, sim->xdp_priv);
+	kthread_stop(sim->thread);
+
+	nfb_char_remove(nfb);
+	nfb_lock_remove(nfb);
+	nfb_bus_unregister(nfb, &sim->bus);
+	kfree(nfb->fdt);
+	nfb_destroy(nfb);
+
+	platform_device_unregister(sim->pdev);
+	for (i = 0; i < sim->rxqc; i++)
+		nfb_sim_ctrl_purge_loop(&sim->ctrls[i]);
+	kfree(sim->ctrls);
+	vfree(sim);
+}
+
+/*
+ * nfb_sim_init - create simulated cards requested by the sim_devices parameter
+ */
+int nfb_sim_init(void)
+{
+	struct nfb_sim *sim;
+	unsigned i;
+
+	if (!sim_devices)
+		return 0;
+
+	if (sim_devices > NFB_SIM_DEVICES_MAX || !sim_ports || !sim_queues) {
+		printk(KERN_ERR "nfb_sim: invalid configuration\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < sim_devices; i++) {
+		sim = nfb_sim_create(i);
+		if (IS_ERR(sim)) {
+			printk(KERN_ERR "nfb_sim: failed to create simulated card %u: %ld\n", i, PTR_ERR(sim));
+			nfb_sim_exit();
+			return PTR_ERR(sim);
+		}
+		nfb_sims[i] = sim;
+	}
+	return 0;
+}
+
+/*
+ * nfb_sim_exit - remove all simulated cards
+ */
+void nfb_sim_exit(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NFB_SIM_DEVICES_MAX; i++) {
+		if (nfb_sims[i])
+			nfb_sim_destroy(nfb_sims[i]);
+		nfb_sims[i] = NULL;
+	}
+}
+
+module_param(sim_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_devices, "Number of simulated cards with software DMA controllers, XDP driver only [0]");
+module_param(sim_ports, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_ports, "Number of ETH ports of each simulated card [1]");
+module_param(sim_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_queues, "Number of rx/tx queue pairs of each simulated port [4]");
+module_param(sim_xmit_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_xmit_queues, "Number of spare tx queues of each simulated port [0]");
+module_param(sim_gen_len, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_gen_len, "Length of frames generated on every simulated rx queue, 0 disables the generator [64]");
+module_param(sim_loopback, bool, S_IRUGO);
+MODULE_PARM_DESC(sim_loopback, "Frames sent by simulated tx queue are received on the rx queue of the same index [yes]");
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * Software DMA simulator of the NFB platform - header file
+ *
+ * Copyright (C) 2025 CESNET
+ */
+
+#ifndef NFB_SIM_H
+#define NFB_SIM_H
+
+int nfb_sim_init(void);
+void nfb_sim_exit(void);
+
+#endif /* NFB_SIM_H */
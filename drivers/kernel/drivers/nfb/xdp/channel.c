@@ -8,88 +8,333 @@
  *   Richard Hyros <hyros@cesnet.cz>
  */
 
+#include <linux/delay.h>
+#include <linux/kthread.h>
+
+#include "../nfb.h"
+
+#include <netcope/rxqueue.h>
+
 #include "ctrl_xdp.h"
 #include "channel.h"
 #include "ethdev.h"
 
+/**
+ * @brief Hybrid scheduling of the queue napi.
+ *	While the napi finds work it is rescheduled right away (busy polling).
+ *	When the queue goes idle the thread keeps polling for busy_poll_us
+ *	and then sleeps with exponential backoff from sleep_min_us to sleep_max_us.
+ *	The sleep can be ended early by the card interrupt, see channel_irq_wakeup().
+ *
+ * @param channel
+ * @param queue
+ * @param napi
+ */
+static void nfb_xdp_queue_poll(struct nfb_xdp_channel *channel, struct nfb_xdp_queue *queue, struct napi_struct *napi)
+{
+	struct nfb_xdp_poll_params *params = &channel->poll;
+	u64 work, last_work = READ_ONCE(queue->poll_work);
+	ktime_t last_active = ktime_get();
+	u32 sleep_min, sleep_us = 0;
+
+	while (!kthread_should_stop()) {
+		local_bh_disable();
+		napi_schedule(napi);
+		local_bh_enable();
+		sleep_min = READ_ONCE(params->sleep_min_us);
+		// napi keeps itself scheduled while it has work, there is no need to spin here
+		while (!kthread_should_stop() && test_bit(NAPI_STATE_SCHED, &napi->state))
+			usleep_range(sleep_min, 2 * sleep_min);
+
+		// traffic -> poll again right away
+		work = READ_ONCE(queue->poll_work);
+		if (work != last_work) {
+			last_work = work;
+			last_active = ktime_get();
+			sleep_us = 0;
+			cond_resched();
+			continue;
+		}
+
+		// idle, but still in the busy poll window
+		if (ktime_us_delta(ktime_get(), last_active) < READ_ONCE(params->busy_poll_us)) {
+			cond_resched();
+			continue;
+		}
+
+		// idle -> exponential backoff
+		sleep_us = sleep_us ? min(2 * sleep_us, READ_ONCE(params->sleep_max_us)) : sleep_min;
+		wait_event_interruptible_hrtimeout(queue->wait,
+				kthread_should_stop() || atomic_xchg(&queue->irq_pending, 0),
+				ns_to_ktime((u64)sleep_us * NSEC_PER_USEC));
+	}
+}
+
 static int nfb_xdp_rx_thread(void *rxqptr)
 {
-	struct nfb_ethdev *ethdev;
-	struct net_device *netdev;
 	struct nfb_xdp_queue *rxq;
 	struct nfb_xdp_channel *channel;
 	struct napi_struct *napi;
-	int ret;
 
 	rxq = rxqptr;
 	channel = container_of(rxq, struct nfb_xdp_channel, rxq);
-	ethdev = channel->ethdev;
-	netdev = ethdev->netdev;
-	ret = 0;
 	if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) {
 		napi = &rxq->napi_pp;
 	} else {
 		napi = &rxq->napi_xsk;
 	}
 
-	while (!kthread_should_stop()) {
-		local_bh_disable();
-		napi_schedule(napi);
-		local_bh_enable();
-		while (!kthread_should_stop() && test_bit(NAPI_STATE_SCHED, &napi->state))
-			usleep_range(10, 20);
-	}
-	return ret;
+	nfb_xdp_queue_poll(channel, rxq, napi);
+	return 0;
 }
 
 static int nfb_xdp_tx_thread(void *txqptr)
 {
-	struct nfb_ethdev *ethdev;
-	struct net_device *netdev;
 	struct nfb_xdp_queue *txq;
 	struct nfb_xdp_channel *channel;
-	int ret;
 
 	txq = txqptr;
 	channel = container_of(txq, struct nfb_xdp_channel, txq);
-	ethdev = channel->ethdev;
-	netdev = ethdev->netdev;
-	ret = 0;
 
 	if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) // In page pool mode tx exits
-		return ret;
+		return 0;
 
-	while (!kthread_should_stop()) {
+	nfb_xdp_queue_poll(channel, txq, &txq->napi_xsk);
+	return 0;
+}
+
+static enum hrtimer_restart nfb_xdp_queue_timer(struct hrtimer *timer)
+{
+	struct nfb_xdp_queue *queue = container_of(timer, struct nfb_xdp_queue, timer);
+
+	napi_schedule(queue->napi);
+	return HRTIMER_NORESTART;
+}
+
+static void nfb_xdp_queue_init_timer(struct nfb_xdp_queue *queue)
+{
+#ifdef CONFIG_HAVE_HRTIMER_SETUP
+	hrtimer_setup(&queue->timer, nfb_xdp_queue_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&queue->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	queue->timer.function = nfb_xdp_queue_timer;
+#endif
+}
+
+// datapath fields of the queue and controller must stay within one cache line,
+// rx and tx side of the channel must not share one
+static inline void channel_check_layout(void)
+{
+	BUILD_BUG_ON(offsetofend(struct nfb_xdp_queue, napi) > SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetofend(struct xctrl, desc_buffer_virt) > SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct nfb_xdp_channel, txq) / SMP_CACHE_BYTES <=
+			(offsetofend(struct nfb_xdp_channel, rx_syncp) - 1) / SMP_CACHE_BYTES);
+}
+
+void channel_init_poll(struct nfb_xdp_channel *channel)
+{
+	channel_check_layout();
+
+	channel->poll.busy_poll_us = NFB_XDP_BUSY_POLL_US;
+	channel->poll.sleep_min_us = NFB_XDP_SLEEP_MIN_US;
+	channel->poll.sleep_max_us = NFB_XDP_SLEEP_MAX_US;
+	channel->poll.irq_wakeup = false;
+	channel->poll.native_napi = false;
+
+	init_waitqueue_head(&channel->rxq.wait);
+	init_waitqueue_head(&channel->txq.wait);
+	atomic_set(&channel->rxq.irq_pending, 0);
+	atomic_set(&channel->txq.irq_pending, 0);
+	nfb_xdp_queue_init_timer(&channel->rxq);
+	nfb_xdp_queue_init_timer(&channel->txq);
+}
+
+/**
+ * @brief Completes the napi poll of the queue.
+ * 	In native napi mode the queue has no interrupt, the timer reschedules the napi
+ * 	after idle backoff from sleep_min_us to sleep_max_us instead.
+ * 	The timer isn't armed when napi_complete_done() refuses to complete, the napi is then
+ * 	owned by a busy polling socket or deferred by napi_defer_hard_irqs and the kernel reschedules it.
+ *
+ * @param channel
+ * @param queue
+ * @param napi
+ * @param work packets processed in this poll
+ */
+void channel_napi_complete(struct nfb_xdp_channel *channel, struct nfb_xdp_queue *queue, struct napi_struct *napi, int work)
+{
+	struct nfb_xdp_poll_params *params = &channel->poll;
+	u32 sleep_min;
+
+	if (!napi_complete_done(napi, work) || !queue->native)
+		return;
+
+	sleep_min = READ_ONCE(params->sleep_min_us);
+	if (work || !queue->sleep_us)
+		queue->sleep_us = sleep_min;
+	else
+		queue->sleep_us = min(2 * queue->sleep_us, max(sleep_min, READ_ONCE(params->sleep_max_us)));
+	hrtimer_start(&queue->timer, ns_to_ktime((u64)queue->sleep_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+}
+
+/**
+ * @brief Initializes the channel counters.
+ * 	The rx dma controller component is opened for its packet counters,
+ * 	channel works without it, only the hw counters read as zero.
+ *
+ * @param channel
+ */
+void channel_init_stats(struct nfb_xdp_channel *channel)
+{
+	struct nfb_device *nfb = channel->ethdev->nfb;
+	int fdt_offset;
+
+	u64_stats_init(&channel->rx_syncp);
+	u64_stats_init(&channel->tx_syncp);
+	spin_lock_init(&channel->hw_stats_lock);
+
+	channel->nc_rxqueue = NULL;
+	fdt_offset = nfb_comp_find(nfb, COMP_NETCOPE_RXQUEUE_NDP, channel->nfb_index);
+	if (fdt_offset >= 0)
+		channel->nc_rxqueue = nc_rxqueue_open(nfb, fdt_offset);
+}
+
+void channel_deinit_stats(struct nfb_xdp_channel *channel)
+{
+	if (channel->nc_rxqueue)
+		nc_rxqueue_close(channel->nc_rxqueue);
+	channel->nc_rxqueue = NULL;
+}
+
+/**
+ * @brief Reads the packet counters of the rx dma controller.
+ * 	Discarded are the packets the controller dropped for lack of rx descriptors.
+ *
+ * @param channel
+ * @param received
+ * @param discarded
+ */
+void channel_read_hw_stats(struct nfb_xdp_channel *channel, u64 *received, u64 *discarded)
+{
+	struct nc_rxqueue_counters cntrs;
+
+	if (!channel->nc_rxqueue) {
+		*received = 0;
+		*discarded = 0;
+		return;
+	}
+
+	spin_lock_bh(&channel->hw_stats_lock);
+	nc_rxqueue_read_counters(channel->nc_rxqueue, &cntrs);
+	spin_unlock_bh(&channel->hw_stats_lock);
+
+	*received = cntrs.received;
+	*discarded = cntrs.discarded;
+}
+
+/**
+ * @brief Wakes up sleeping queue threads of the channel. Called from the card interrupt.
+ *
+ * @param channel
+ * @return true if the channel uses interrupt wakeups
+ */
+bool channel_irq_wakeup(struct nfb_xdp_channel *channel)
+{
+	if (!READ_ONCE(channel->poll.irq_wakeup))
+		return false;
+
+	if (channel->rxq.native) {
+		if (channel->rxq.napi)
+			napi_schedule(channel->rxq.napi);
+		if (channel->txq.napi)
+			napi_schedule(channel->txq.napi);
+		return true;
+	}
+
+	atomic_set(&channel->rxq.irq_pending, 1);
+	wake_up(&channel->rxq.wait);
+	atomic_set(&channel->txq.irq_pending, 1);
+	wake_up(&channel->txq.wait);
+	return true;
+}
+
+/**
+ * @brief Enables the queue napi and publishes its id for busy polling sockets.
+ *
+ * @param channel
+ * @param queue
+ * @param napi napi of the running mode, NULL when the queue has none
+ */
+static void channel_enable_napi(struct nfb_xdp_channel *channel, struct nfb_xdp_queue *queue, struct napi_struct *napi)
+{
+	queue->napi = napi;
+	queue->native = READ_ONCE(channel->poll.native_napi);
+	queue->sleep_us = 0;
+	if (!napi)
+		return;
+
+	napi_enable(napi);
+	// the id is known only after napi_enable on newer kernels
+	if (queue == &channel->rxq)
+		queue->ctrl->rx.rxq_info.napi_id = napi->napi_id;
+
+	if (queue->native) {
+		// first poll fills the rx ring, then the napi keeps itself scheduled
 		local_bh_disable();
-		napi_schedule(&txq->napi_xsk);
+		napi_schedule(napi);
 		local_bh_enable();
-		while (!kthread_should_stop() && test_bit(NAPI_STATE_SCHED, &txq->napi_xsk.state))
-			usleep_range(10, 20);
 	}
-	return ret;
+}
+
+static void channel_disable_napi(struct nfb_xdp_queue *queue)
+{
+	if (!queue->napi)
+		return;
+
+	napi_disable(queue->napi);
+	while (napi_disable_pending(queue->napi))
+		;
+	// napi is disabled, the timer can't be armed again
+	hrtimer_cancel(&queue->timer);
+}
+
+// skbs of the previous controller were freed without completion, BQL starts from scratch
+static void channel_start_tx_queue(struct nfb_xdp_channel *channel)
+{
+	struct netdev_queue *ndq = netdev_get_tx_queue(channel->ethdev->netdev, channel->index);
+
+	netdev_tx_reset_queue(ndq);
+	netif_tx_start_queue(ndq);
 }
 
 static int channel_create_threads(struct nfb_xdp_channel *channel)
 {
 	int ret = 0;
 	struct net_device *netdev = channel->ethdev->netdev;
+	bool xsk = test_bit(NFB_STATUS_IS_XSK, &channel->status);
+
+	// native napi mode is driven by the kernel and the napi timers
+	if (READ_ONCE(channel->poll.native_napi)) {
+		channel_enable_napi(channel, &channel->rxq, xsk ? &channel->rxq.napi_xsk : &channel->rxq.napi_pp);
+		// pagepool doesn't use tx napi
+		channel_enable_napi(channel, &channel->txq, xsk ? &channel->txq.napi_xsk : NULL);
+		channel_start_tx_queue(channel);
+		return 0;
+	}
 
 	channel->rxq.thread = kthread_create_on_node(nfb_xdp_rx_thread, &channel->rxq, channel->numa, "%s/%u", netdev->name, channel->nfb_index);
 	if (IS_ERR(channel->rxq.thread)) {
 		printk(KERN_ERR "nfb: %s - failed to create rx thread (error: %ld, channel: %d)\n",
 		       netdev->name, PTR_ERR(channel->rxq.thread), channel->nfb_index);
 		ret = PTR_ERR(channel->rxq.thread);
+		channel->rxq.thread = NULL;
 		goto err_kthread_rx;
 	}
 	// increment reference counter to kthread so the thread can exit on error and kthread_stop() won't crash
 	// put_task_struct() must be called after kthread_stop()
 	get_task_struct(channel->rxq.thread);
 	// Wake up thread
-	if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) {
-		napi_enable(&channel->rxq.napi_pp);
-	} else {
-		napi_enable(&channel->rxq.napi_xsk);
-	}
+	channel_enable_napi(channel, &channel->rxq, xsk ? &channel->rxq.napi_xsk : &channel->rxq.napi_pp);
 	wake_up_process(channel->rxq.thread);
 
 	// Create TX thread for each queue
@@ -98,17 +343,15 @@ static int channel_create_threads(struct nfb_xdp_channel *channel)
 		printk(KERN_ERR "nfb: %s - failed to create tx thread (error: %ld, channel: %d)\n",
 		       netdev->name, PTR_ERR(channel->txq.thread), channel->nfb_index);
 		ret = PTR_ERR(channel->txq.thread);
+		channel->txq.thread = NULL;
 		goto err_kthread_tx;
 	}
 	// increment reference counter to struct_task so the thread can exit on error and kthread_stop() won't crash
 	// put_task_struct() must be called after kthread_stop() on driver detach
 	get_task_struct(channel->txq.thread);
-	if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) {
-		// pagepool doesn't use tx napi
-	} else {
-		napi_enable(&channel->txq.napi_xsk);
-	}
-	netif_tx_start_queue(netdev_get_tx_queue(netdev, channel->index));
+	// pagepool doesn't use tx napi
+	channel_enable_napi(channel, &channel->txq, xsk ? &channel->txq.napi_xsk : NULL);
+	channel_start_tx_queue(channel);
 	// Wake up thread
 	wake_up_process(channel->txq.thread);
 
@@ -122,14 +365,63 @@ err_kthread_tx:
 		put_task_struct(channel->rxq.thread);
 		channel->rxq.thread = NULL;
 	}
+	channel_disable_napi(&channel->rxq);
 err_kthread_rx:
 	return ret;
 }
 
-int channel_start_pp(struct nfb_xdp_channel *channel)
+/**
+ * @brief Allocates rx and tx controllers of the channel, the channel itself isn't touched.
+ * 	Can run while the controllers of the other mode are still running on the same queues.
+ *
+ * @param channel
+ * @param pool xsk pool for AF_XDP mode, NULL for page pool mode
+ * @param rx
+ * @param tx
+ * @return int
+ */
+static int channel_alloc_ctrls(struct nfb_xdp_channel *channel, struct xsk_buff_pool *pool, struct xctrl **rx, struct xctrl **tx)
 {
 	struct nfb_ethdev *ethdev = channel->ethdev;
 	struct net_device *netdev = ethdev->netdev;
+
+	if (pool)
+		*rx = nfb_xctrl_alloc_xsk(netdev, channel->index, pool, NFB_XCTRL_RX);
+	else
+		*rx = nfb_xctrl_alloc_pp(netdev, channel->index, READ_ONCE(ethdev->rx_desc_cnt), NFB_XCTRL_RX);
+	if (!*rx) {
+		printk(KERN_ERR "nfb: %s - failed to alloc rx queue %d (error: %d)\n", netdev->name, channel->nfb_index, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	if (pool)
+		*tx = nfb_xctrl_alloc_xsk(netdev, channel->index, pool, NFB_XCTRL_TX);
+	else
+		*tx = nfb_xctrl_alloc_pp(netdev, channel->index, READ_ONCE(ethdev->tx_desc_cnt), NFB_XCTRL_TX);
+	if (!*tx) {
+		printk(KERN_ERR "nfb: %s - failed to alloc tx queue %d (error: %d)\n", netdev->name, channel->nfb_index, -ENOMEM);
+		if (pool)
+			nfb_xctrl_destroy_xsk(*rx);
+		else
+			nfb_xctrl_destroy_pp(*rx);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * @brief Starts the channel on allocated controllers.
+ * 	On failure the controllers are destroyed.
+ *
+ * @param channel
+ * @param pool xsk pool the controllers were allocated with, NULL for page pool mode
+ * @param rx
+ * @param tx
+ * @return int
+ */
+static int channel_start_ctrls(struct nfb_xdp_channel *channel, struct xsk_buff_pool *pool, struct xctrl *rx, struct xctrl *tx)
+{
+	struct net_device *netdev = channel->ethdev->netdev;
 	struct nfb_xdp_queue *rxq = &channel->rxq;
 	struct nfb_xdp_queue *txq = &channel->txq;
 	int ret = 0;
@@ -141,17 +433,12 @@ int channel_start_pp(struct nfb_xdp_channel *channel)
 			goto err_channel_running;
 		}
 
-		if (!(rxq->ctrl = nfb_xctrl_alloc_pp(netdev, channel->index, NFB_XDP_DESC_CNT, NFB_XCTRL_RX))) {
-			ret = -ENOMEM;
-			printk(KERN_ERR "nfb: %s - failed to alloc rx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_alloc_rx;
-		}
-
-		if (!(txq->ctrl = nfb_xctrl_alloc_pp(netdev, channel->index, NFB_XDP_DESC_CNT, NFB_XCTRL_TX))) {
-			ret = -ENOMEM;
-			printk(KERN_ERR "nfb: %s - failed to alloc tx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_alloc_tx;
-		}
+		rxq->ctrl = rx;
+		txq->ctrl = tx;
+		if (pool)
+			set_bit(NFB_STATUS_IS_XSK, &channel->status);
+		else
+			clear_bit(NFB_STATUS_IS_XSK, &channel->status);
 
 		if ((ret = nfb_xctrl_start(rxq->ctrl))) {
 			printk(KERN_ERR "nfb: %s - failed to start rx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
@@ -168,6 +455,7 @@ int channel_start_pp(struct nfb_xdp_channel *channel)
 			goto err_threads;
 		}
 		set_bit(NFB_STATUS_IS_RUNNING, &channel->status);
+		rcu_assign_pointer(channel->xmit_ctrl, txq->ctrl);
 	}
 	mutex_unlock(&channel->state_mutex);
 	return ret;
@@ -175,75 +463,72 @@ int channel_start_pp(struct nfb_xdp_channel *channel)
 err_threads:
 err_start_tx:
 err_start_rx:
-	nfb_xctrl_destroy_pp(txq->ctrl);
-err_alloc_tx:
-	nfb_xctrl_destroy_pp(rxq->ctrl);
-err_alloc_rx:
 err_channel_running:
 	mutex_unlock(&channel->state_mutex);
+	if (pool) {
+		nfb_xctrl_destroy_xsk(tx);
+		nfb_xctrl_destroy_xsk(rx);
+	} else {
+		nfb_xctrl_destroy_pp(tx);
+		nfb_xctrl_destroy_pp(rx);
+	}
 	return ret;
 }
 
-int channel_start_xsk(struct nfb_xdp_channel *channel)
+int channel_start_pp(struct nfb_xdp_channel *channel)
 {
-	struct nfb_ethdev *ethdev = channel->ethdev;
-	struct net_device *netdev = ethdev->netdev;
-	struct nfb_xdp_queue *rxq = &channel->rxq;
-	struct nfb_xdp_queue *txq = &channel->txq;
-	int ret = 0;
-
-	mutex_lock(&channel->state_mutex);
-	{
-		if (test_bit(NFB_STATUS_IS_RUNNING, &channel->status)) {
-			ret = -EBUSY;
-			goto err_channel_running;
-		}
-
-		if (!(rxq->ctrl = nfb_xctrl_alloc_xsk(netdev, channel->index, channel->pool, NFB_XCTRL_RX))) {
-			ret = -ENOMEM;
-			printk(KERN_ERR "nfb: %s - failed to alloc rx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_alloc_rx;
-		}
+	struct xctrl *rx, *tx;
+	int ret;
 
-		if (!(txq->ctrl = nfb_xctrl_alloc_xsk(netdev, channel->index, channel->pool, NFB_XCTRL_TX))) {
-			ret = -ENOMEM;
-			printk(KERN_ERR "nfb: %s - failed to alloc tx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_alloc_tx;
-		}
+	if ((ret = channel_alloc_ctrls(channel, NULL, &rx, &tx)))
+		return ret;
+	return channel_start_ctrls(channel, NULL, rx, tx);
+}
 
-		if ((ret = nfb_xctrl_start(rxq->ctrl))) {
-			printk(KERN_ERR "nfb: %s - failed to start rx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_start_rx;
-		}
+int channel_start_xsk(struct nfb_xdp_channel *channel)
+{
+	struct xctrl *rx, *tx;
+	int ret;
 
-		if ((ret = nfb_xctrl_start(txq->ctrl))) {
-			printk(KERN_ERR "nfb: %s - failed to start tx queue %d (error: %d)\n", netdev->name, channel->nfb_index, ret);
-			goto err_start_tx;
-		}
+	if ((ret = channel_alloc_ctrls(channel, channel->pool, &rx, &tx)))
+		return ret;
+	return channel_start_ctrls(channel, channel->pool, rx, tx);
+}
 
-		if ((ret = channel_create_threads(channel))) {
-			goto err_threads;
-		}
+/**
+ * @brief Switches the channel between page pool and AF_XDP mode.
+ * 	Controllers of the new mode are allocated while the old ones still run,
+ * 	so the queue is down only for the DMA stop and start. Other channels aren't touched.
+ *
+ * @param channel
+ * @param pool xsk pool to switch to, NULL to switch back to page pool mode
+ * @return int
+ */
+int channel_swap_mode(struct nfb_xdp_channel *channel, struct xsk_buff_pool *pool)
+{
+	struct xctrl *rx, *tx;
+	int ret;
 
-		set_bit(NFB_STATUS_IS_RUNNING, &channel->status);
-	}
-	mutex_unlock(&channel->state_mutex);
+	// port is down, open starts the channel in the mode given by channel->pool
+	if (!netif_running(channel->ethdev->netdev))
+		return 0;
 
-	return ret;
+	if ((ret = channel_alloc_ctrls(channel, pool, &rx, &tx)))
+		return ret;
 
-err_threads:
-err_start_tx:
-err_start_rx:
-	nfb_xctrl_destroy_xsk(txq->ctrl);
-err_alloc_tx:
-	nfb_xctrl_destroy_xsk(rxq->ctrl);
-err_alloc_rx:
-err_channel_running:
-	mutex_unlock(&channel->state_mutex);
-	return ret;
+	channel_stop(channel);
+	return channel_start_ctrls(channel, pool, rx, tx);
 }
 
-int channel_stop(struct nfb_xdp_channel *channel)
+/**
+ * @brief Stops the queue threads and napis and starts stopping the DMA in the background.
+ * 	Channel stays marked running until channel_stop_wait() collects it,
+ * 	so stopping channels of the whole port takes the time of the slowest one.
+ *
+ * @param channel
+ * @return 0 or -EINVAL when the channel isn't running
+ */
+int channel_stop_async(struct nfb_xdp_channel *channel)
 {
 	struct nfb_xdp_queue *rxq = &channel->rxq;
 	struct nfb_xdp_queue *txq = &channel->txq;
@@ -251,11 +536,18 @@ int channel_stop(struct nfb_xdp_channel *channel)
 	int ret = 0;
 	mutex_lock(&channel->state_mutex);
 	{
-		if (!test_bit(NFB_STATUS_IS_RUNNING, &channel->status)) {
+		if (!test_bit(NFB_STATUS_IS_RUNNING, &channel->status) || test_bit(NFB_STATUS_IS_STOPPING, &channel->status)) {
 			ret = -EINVAL;
 			goto err_channel_not_running;
 		}
 
+		// ndo_xdp_xmit must not reach the tx controller once it stops,
+		// bulk stops hide all channels first and wait just once
+		if (rcu_access_pointer(channel->xmit_ctrl)) {
+			channel_hide_xmit(channel);
+			synchronize_net();
+		}
+
 		// collect rx thread
 		if (rxq->thread != NULL) {
 			kthread_stop(rxq->thread);
@@ -263,15 +555,7 @@ int channel_stop(struct nfb_xdp_channel *channel)
 			put_task_struct(rxq->thread);
 			rxq->thread = NULL;
 		}
-		if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) { // base XDP operation
-			napi_disable(&rxq->napi_pp);
-			while (napi_disable_pending(&rxq->napi_pp))
-				;
-		} else { // AF_XDP operation
-			napi_disable(&rxq->napi_xsk);
-			while (napi_disable_pending(&rxq->napi_xsk))
-				;
-		}
+		channel_disable_napi(rxq);
 
 		// collect tx thread
 		netif_tx_stop_queue(netdev_get_tx_queue(netdev, channel->index));
@@ -280,12 +564,37 @@ int channel_stop(struct nfb_xdp_channel *channel)
 			put_task_struct(channel->txq.thread);
 			channel->txq.thread = NULL;
 		}
-		if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) { // base XDP operation
-			// no napi
-		} else { // AF_XDP operation
-			napi_disable(&txq->napi_xsk);
-			while (napi_disable_pending(&txq->napi_xsk))
-				;
+		channel_disable_napi(txq);
+
+		nfb_xctrl_stop_async(rxq->ctrl);
+		nfb_xctrl_stop_async(txq->ctrl);
+		set_bit(NFB_STATUS_IS_STOPPING, &channel->status);
+	}
+	mutex_unlock(&channel->state_mutex);
+	return ret;
+
+err_channel_not_running:
+	mutex_unlock(&channel->state_mutex);
+	return ret;
+}
+
+/**
+ * @brief Waits for the DMA stopped by channel_stop_async() and frees the controllers.
+ *
+ * @param channel
+ * @return 0 or -EINVAL when the channel isn't stopping
+ */
+int channel_stop_wait(struct nfb_xdp_channel *channel)
+{
+	struct nfb_xdp_queue *rxq = &channel->rxq;
+	struct nfb_xdp_queue *txq = &channel->txq;
+	int ret = 0;
+
+	mutex_lock(&channel->state_mutex);
+	{
+		if (!test_bit(NFB_STATUS_IS_STOPPING, &channel->status)) {
+			ret = -EINVAL;
+			goto err_channel_not_stopping;
 		}
 
 		if (!test_bit(NFB_STATUS_IS_XSK, &channel->status)) {
@@ -295,12 +604,32 @@ int channel_stop(struct nfb_xdp_channel *channel)
 			nfb_xctrl_destroy_xsk(rxq->ctrl);
 			nfb_xctrl_destroy_xsk(txq->ctrl);
 		}
+		rxq->ctrl = NULL;
+		txq->ctrl = NULL;
+		clear_bit(NFB_STATUS_IS_STOPPING, &channel->status);
 		clear_bit(NFB_STATUS_IS_RUNNING, &channel->status);
 	}
+err_channel_not_stopping:
 	mutex_unlock(&channel->state_mutex);
 	return ret;
+}
 
-err_channel_not_running:
-	mutex_unlock(&channel->state_mutex);
-	return ret;
+/**
+ * @brief Hides the channel from the ndo_xdp_xmit fallback.
+ * 	The caller must wait for synchronize_net() before the tx controller is stopped.
+ *
+ * @param channel
+ */
+void channel_hide_xmit(struct nfb_xdp_channel *channel)
+{
+	RCU_INIT_POINTER(channel->xmit_ctrl, NULL);
+}
+
+int channel_stop(struct nfb_xdp_channel *channel)
+{
+	int ret;
+
+	if ((ret = channel_stop_async(channel)))
+		return ret;
+	return channel_stop_wait(channel);
 }
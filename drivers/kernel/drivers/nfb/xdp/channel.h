@@ -11,42 +11,207 @@
 #define NFB_XDP_CHANNEL_H
 
 #include <linux/netdevice.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/u64_stats_sync.h>
 
+// default ring size, can be changed with ethtool -G
 #define NFB_XDP_DESC_CNT 4096
+#define NFB_XDP_DESC_CNT_MIN 256
+// page_pool refuses rings bigger than 32768, rx ring size is the pool size
+#define NFB_XDP_DESC_CNT_MAX 32768
+
+// defaults of the queue thread scheduling, see struct nfb_xdp_poll_params
+#define NFB_XDP_BUSY_POLL_US 50
+#define NFB_XDP_SLEEP_MIN_US 10
+#define NFB_XDP_SLEEP_MAX_US 1000
 
 struct nfb_xdp_queue {
+	// hot - read or written by the napi on every poll
 	// dma controller
 	struct xctrl *ctrl;
+	// rx only - copy of ethdev->prog, the napi doesn't touch the shared ethdev
+	struct bpf_prog __rcu *prog;
+	// packets processed by napi; the thread uses it to detect traffic
+	u64 poll_work;
+	// native napi mode - no queue thread, the timer reschedules idle napi
+	bool native;
+	u32 sleep_us; // current idle backoff
+	struct napi_struct *napi; // napi of the running mode, NULL when the queue has none
+
+	// queue thread, woken by the card interrupt from other CPU
+	struct task_struct *thread ____cacheline_aligned_in_smp;
+	// thread sleeps here when the queue is idle
+	wait_queue_head_t wait;
+	// set by the card interrupt to end the idle sleep early
+	atomic_t irq_pending;
 
-	// queue thread
-	struct task_struct *thread;
+	struct hrtimer timer;
 
 	// napi structs - so far only xsk mode uses tx napi
 	struct napi_struct napi_pp;
 	struct napi_struct napi_xsk;
 };
 
-// structure describing one queue pair
+/* Tunables of the hybrid queue thread scheduler.
+ * While the napi does some work the thread reschedules it right away.
+ * When the queue goes idle the thread keeps polling for busy_poll_us,
+ * then sleeps for sleep_min_us doubling the sleep up to sleep_max_us.
+ * With irq_wakeup set the card interrupt ends the sleep early.
+ *
+ * With native_napi set the channel has no queue threads. The napi runs
+ * in softirq, in kernel napi threads (/sys/class/net/<if>/threaded) or
+ * in the busy polling socket (SO_BUSY_POLL, SO_PREFER_BUSY_POLL).
+ * When the napi completes idle a timer reschedules it after the sleep,
+ * which acts as the interrupt of the queue; napi_defer_hard_irqs and
+ * gro_flush_timeout defer the timer as they would defer an interrupt.
+ * The mode is picked up on the next channel start.
+ */
+struct nfb_xdp_poll_params {
+	u32 busy_poll_us;
+	u32 sleep_min_us;
+	u32 sleep_max_us;
+	bool irq_wakeup;
+	bool native_napi;
+};
+
+// software counters of the rx queue, written only by the rx napi
+struct nfb_xdp_rx_stats {
+	u64 packets;
+	u64 bytes;
+	u64 xdp_pass;
+	u64 xdp_drop;
+	u64 xdp_tx;
+	u64 xdp_redirect;
+	u64 xdp_aborted;
+	u64 redirect_err;
+	u64 alloc_fail; // rx buffer allocation failures
+	u64 dropped; // frames dropped by driver before reaching the program
+};
+
+// software counters of the tx queue, written under the tx lock
+struct nfb_xdp_tx_stats {
+	u64 packets;
+	u64 bytes;
+	u64 ring_full; // frames dropped because the tx ring was full
+};
+
+/* Structure describing one queue pair.
+ * Rx and tx side are driven by napis on different CPUs, each side with its
+ * counters starts on its own cache line, the control path fields go first.
+ */
 #define NFB_STATUS_IS_XSK BIT(0)
 #define NFB_STATUS_IS_RUNNING BIT(1)
+#define NFB_STATUS_IS_STOPPING BIT(2) // dma is being stopped, see channel_stop_async()
 struct nfb_xdp_channel {
 	struct nfb_ethdev *ethdev; // reference to ETH port holding this channel
 	u16 index; // in the context of ETH port
 	u16 nfb_index; // in the context of the card
+	u16 nfb_tx_index; // tx queue in the context of the card, differs when card has spare tx queues
 	int numa; // numa node of the pci device
 
-	struct nfb_xdp_queue txq;
-	struct nfb_xdp_queue rxq;
-
 	// Synchronize the state of rx and tx queue switching
 	struct mutex state_mutex;
 	unsigned long status;
 
 	struct xsk_buff_pool *pool;
+
+	struct nfb_xdp_poll_params poll;
+	struct device sysfsdev;
+
+	// rx dma controller counters, the strobe and read must not interleave
+	struct nc_rxqueue *nc_rxqueue;
+	spinlock_t hw_stats_lock;
+
+	// rx side - written by the rx napi
+	struct nfb_xdp_queue rxq ____cacheline_aligned_in_smp;
+	struct nfb_xdp_rx_stats rx_stats;
+	struct u64_stats_sync rx_syncp;
+
+	// tx side - written by the tx napi and under the tx lock
+	struct nfb_xdp_queue txq ____cacheline_aligned_in_smp;
+	struct nfb_xdp_tx_stats tx_stats;
+	struct u64_stats_sync tx_syncp;
+	// txq ctrl as seen by the ndo_xdp_xmit fallback, NULL while the channel isn't usable
+	struct xctrl __rcu *xmit_ctrl;
 };
 
+/**
+ * @brief Adds counters of one napi poll to the channel rx stats
+ *
+ * @param channel
+ * @param s
+ */
+static inline void nfb_xdp_rx_stats_add(struct nfb_xdp_channel *channel, const struct nfb_xdp_rx_stats *s)
+{
+	struct nfb_xdp_rx_stats *d = &channel->rx_stats;
+
+	u64_stats_update_begin(&channel->rx_syncp);
+	d->packets += s->packets;
+	d->bytes += s->bytes;
+	d->xdp_pass += s->xdp_pass;
+	d->xdp_drop += s->xdp_drop;
+	d->xdp_tx += s->xdp_tx;
+	d->xdp_redirect += s->xdp_redirect;
+	d->xdp_aborted += s->xdp_aborted;
+	d->redirect_err += s->redirect_err;
+	d->alloc_fail += s->alloc_fail;
+	d->dropped += s->dropped;
+	u64_stats_update_end(&channel->rx_syncp);
+}
+
+static inline void nfb_xdp_rx_stats_read(struct nfb_xdp_channel *channel, struct nfb_xdp_rx_stats *s)
+{
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&channel->rx_syncp);
+		*s = channel->rx_stats;
+	} while (u64_stats_fetch_retry(&channel->rx_syncp, start));
+}
+
+/**
+ * @brief Updates tx stats, caller must be the only writer (holds tx lock or owns the queue)
+ *
+ * @param stats
+ * @param syncp
+ * @param packets
+ * @param bytes
+ * @param ring_full
+ */
+static inline void nfb_xdp_tx_stats_add(struct nfb_xdp_tx_stats *stats, struct u64_stats_sync *syncp, u64 packets, u64 bytes, u64 ring_full)
+{
+	u64_stats_update_begin(syncp);
+	stats->packets += packets;
+	stats->bytes += bytes;
+	stats->ring_full += ring_full;
+	u64_stats_update_end(syncp);
+}
+
+static inline void nfb_xdp_tx_stats_read(struct nfb_xdp_tx_stats *stats, struct u64_stats_sync *syncp, struct nfb_xdp_tx_stats *s)
+{
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(syncp);
+		*s = *stats;
+	} while (u64_stats_fetch_retry(syncp, start));
+}
+
+void channel_init_poll(struct nfb_xdp_channel *channel);
+bool channel_irq_wakeup(struct nfb_xdp_channel *channel);
+void channel_napi_complete(struct nfb_xdp_channel *channel, struct nfb_xdp_queue *queue, struct napi_struct *napi, int work);
+
+void channel_init_stats(struct nfb_xdp_channel *channel);
+void channel_deinit_stats(struct nfb_xdp_channel *channel);
+void channel_read_hw_stats(struct nfb_xdp_channel *channel, u64 *received, u64 *discarded);
+
 int channel_start_pp(struct nfb_xdp_channel *channel);
 int channel_start_xsk(struct nfb_xdp_channel *channel);
 int channel_stop(struct nfb_xdp_channel *channel);
+int channel_stop_async(struct nfb_xdp_channel *channel);
+int channel_stop_wait(struct nfb_xdp_channel *channel);
+void channel_hide_xmit(struct nfb_xdp_channel *channel);
+int channel_swap_mode(struct nfb_xdp_channel *channel, struct xsk_buff_pool *pool);
 
 #endif // NFB_XDP_CHANNEL_H
@@ -10,6 +10,10 @@
 #ifndef CTRL_XDP_H
 #define CTRL_XDP_H
 #include <linux/types.h>
+#include <linux/if_vlan.h>
+#include <linux/filter.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <net/xdp_sock_drv.h>
 
 #include "../nfb.h"
@@ -17,6 +21,39 @@
 
 #define NFB_XDP_CTRL_PACKET_BURST 64
 
+// Descriptors one linear skb can take (type0 + data), stack tx queue is stopped below this
+#define NFB_XCTRL_TX_SKB_DESC 2
+// Free descriptors needed to wake the stopped stack tx queue
+#define NFB_XCTRL_TX_WAKE_THRESH NFB_XDP_CTRL_PACKET_BURST
+
+// Time given to the controller to drain before it is stopped by force
+#define NFB_XCTRL_STOP_TIMEOUT_MS 100
+
+// Headroom and skb_shared_info tailroom reserved in each page_pool rx buffer
+#define NFB_XDP_PP_BUF_RESERVE SKB_DATA_ALIGN(XDP_PACKET_HEADROOM + sizeof(struct skb_shared_info))
+// Data capacity of one page_pool rx buffer
+#define NFB_XDP_PP_BUF_LEN (PAGE_SIZE - NFB_XDP_PP_BUF_RESERVE)
+// Highest page order the rx buffers are carved from in page_pool frag mode
+#define NFB_XDP_PP_FRAG_ORDER_MAX 1
+// Largest MTU which is received into a single buffer
+#define NFB_XDP_SB_MTU (NFB_XDP_PP_BUF_LEN - ETH_HLEN - VLAN_HLEN - ETH_FCS_LEN)
+
+// Metadata of the received frame found in the NDP header
+#define NFB_XDP_META_TS BIT(0)
+#define NFB_XDP_META_HASH BIT(1)
+
+/**
+ * xdp_buff extended with the NDP metadata of the frame for the xdp metadata kfuncs.
+ * Page pool buffers are allocated as this struct, xsk buffers keep
+ * the extension in the private area of struct xdp_buff_xsk.
+ */
+struct nfb_xdp_buff {
+	struct xdp_buff xdp;
+	u64 ts; // hardware timestamp in ns
+	u32 hash; // flow hash computed by firmware
+	u8 meta_flags; // NFB_XDP_META_*
+};
+
 enum xdp_ctrl_type {
 	NFB_XCTRL_RX,
 	NFB_XCTRL_TX,
@@ -28,6 +65,8 @@ enum xdp_ctrl_tx_buff_type {
 	NFB_XCTRL_BUFF_FRAME,		// used with frames which needs to be unmapped
 	NFB_XCTRL_BUFF_SKB,			// used for linux netdev tx ndo
 	NFB_XCTRL_BUFF_XSK,			// used for counting the xsk frames
+	NFB_XCTRL_BUFF_FRAG,		// non-last piece of multi-buffer frame, only unmapped; the frame is freed with its last piece
+	NFB_XCTRL_BUFF_XSK_TX,		// XDP_TX of xsk rx buffer, umem chunk is sent as is and returned to the pool by rx napi
 };
 
 // Used for freeing tx buffers after tx completes
@@ -36,6 +75,7 @@ struct xctrl_tx_buffer {
 	union {
 		struct sk_buff *skb;
 		struct xdp_frame *frame;
+		struct xdp_buff *xdp;
 		// for counting xsk completions
 		// when we drop packet on tx this is more than 1
 		u32 num_of_xsk_completions;
@@ -44,10 +84,19 @@ struct xctrl_tx_buffer {
 	u32 len;
 };
 
+/* Layout of the controller:
+ * the first cache line holds the ring pointers and the descriptor ring
+ * touched on every poll (56 + 8 bytes on 64-bit), followed by the rx or tx ring state,
+ * the control path fields start on their own cache line.
+ * See channel_check_layout() for the compile time checks.
+ */
 // TODO: clean up
 #define XCTRL_STATUS_IS_RUNNING BIT(0)
+#define XCTRL_STATUS_IS_STOPPING BIT(1)
 struct xctrl {
-	enum xdp_ctrl_type type;
+	// hot - datapath
+	struct nc_ndp_ctrl c; // underlying controller
+	struct nc_ndp_desc *desc_buffer_virt;
 	union {
 		struct {
 			/** RX - Driver handles allocation of pages for rx through page_pool
@@ -67,7 +116,13 @@ struct xctrl {
 					struct xsk_buff_pool *pool;
 				} xsk;
 			};
-			u32 php; // RX - processed header pointers
+			u32 php; // RX - processed header pointers, index of the next buffer posted onto xdp_ring
+			u32 cbp; // RX - consumed buffer pointer, index of the next received buffer on xdp_ring
+			u32 buf_len; // RX - data capacity of one buffer, longer frames span more buffers
+			u32 frag_size; // RX - truesize of one buffer, PAGE_SIZE unless the buffers are page_pool fragments
+			// RX - offsets of metadata in the NDP header, -1 when not provided by firmware
+			s16 ts_offset;
+			s16 hash_offset;
 			// hdr_buff is only used on rx
 			u32 nb_hdr;
 			void *hdr_buffer_cpu;
@@ -83,8 +138,7 @@ struct xctrl {
 			 * 	2. from XDP_TX - packet is on rx page_pool page
 			 * 		=> get page dma -> send to nic -> return from nic -> recycle to page pool.
 			 * 	3. from XDP_REDIRECT - we get xdp_frame from XDP core. XDP core handles the deallocation.
-			 * 		=> dma map frame -> send to nic -> return from nic -> dma unmap -> xdp_return_frame()
-			 * 		TODO: checkout xdp_return_frame_bulk()
+			 * 		=> dma map frame -> send to nic -> return from nic -> dma unmap -> xdp_return_frame_bulk()
 			 */
 			struct xctrl_tx_buffer *buffers;
 			u32 fdp; // TX - freed descriptor pointers
@@ -95,19 +149,32 @@ struct xctrl {
 			// So we count num of frames we can return from tx_buffer
 			u32 completed_xsk_tx; // num of frames ready to be returned to userspace on tx_buffer_free
 			u32 last_napi_xsk_drops; // if we drop packets on tx we add them for completion with the next packet
+			// completed XDP_TX xsk buffers, xsk pool is not thread safe
+			// so only the rx napi returns them, see nfb_xctrl_tx_xsk_recycle_needs_lock()
+			struct xdp_buff **xsk_done;
+			u32 xsk_done_cnt;
+			// stack tx queue fed by ndo_start_xmit, NULL for xmit queues
+			// skb completions are reported to BQL and the queue is woken on reclaim
+			struct netdev_queue *ndq;
 		} tx;
 	};
 
+	// cold - control path
 	// common control buffers
-	void *update_buffer_virt;
+	void *update_buffer_virt ____cacheline_aligned_in_smp;
 	dma_addr_t update_buffer_dma;
 
 	u32 nb_desc;
-	void *desc_buffer_virt;
 	dma_addr_t desc_buffer_dma;
 
 	unsigned long status; // status of xctrl, used to check if underliing controller is running
-	struct nc_ndp_ctrl c; // underlying controller
+	enum xdp_ctrl_type type;
+
+	// asynchronous stop, the work retries stop_step until the controller drains
+	struct delayed_work stop_work;
+	struct completion stop_done;
+	unsigned long stop_deadline; // jiffies, then the controller is stopped by force
+	int (*stop_step)(struct xctrl *ctrl); // one attempt to stop, -EAGAIN or -EINPROGRESS to retry
 	struct device *dma_dev; // device used for dma allocation
 
 	// queue id in context of nfb device
@@ -118,6 +185,38 @@ struct xctrl {
 	u32 tu_max;
 };
 
+/**
+ * @brief Checks whether the program can handle frames of given MTU.
+ * 	Frames bigger than one rx buffer are multi-buffer and need a frags aware program.
+ * 
+ * @param prog 
+ * @param mtu 
+ * @return true if program can be used
+ */
+static inline bool nfb_xdp_prog_mtu_ok(struct bpf_prog *prog, int mtu)
+{
+	if (!prog || mtu <= NFB_XDP_SB_MTU)
+		return true;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	return prog->aux->xdp_has_frags;
+#else
+	return false;
+#endif
+}
+
+/**
+ * @brief Checks whether frames of given MTU fit into single chunk of the xsk pool.
+ * 	AF_XDP mode doesn't receive multi-buffer frames.
+ *
+ * @param pool
+ * @param mtu
+ * @return true if the pool can be used
+ */
+static inline bool nfb_xdp_xsk_mtu_ok(struct xsk_buff_pool *pool, int mtu)
+{
+	return mtu + ETH_HLEN + VLAN_HLEN + ETH_FCS_LEN <= xsk_pool_get_rx_frame_size(pool);
+}
+
 /**
  * @brief Allocates struct xdp_ctrl for basic XDP operation.
  * Use nfb_xdp_ctrl_destroy() for cleanup
@@ -137,6 +236,17 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
  */
 void nfb_xctrl_destroy_pp(struct xctrl *ctrl);
 
+/**
+ * @brief Allocates TX only struct xdp_ctrl used by ndo_xdp_xmit on spare tx queue.
+ * Use nfb_xctrl_destroy_pp() for cleanup
+ * 
+ * @param netdev 
+ * @param nfb_queue_id tx queue in the context of the card
+ * @param desc_cnt 
+ * @return struct xdp_ctrl* 
+ */
+struct xctrl *nfb_xctrl_alloc_xmit(struct net_device *netdev, u32 nfb_queue_id, u32 desc_cnt);
+
 /**
  * @brief Allocates struct xdp_ctrl for AF_XDP operation.
  * Use nfb_xdp_ctrl_destroy() for cleanup
@@ -165,6 +275,42 @@ void nfb_xctrl_destroy_xsk(struct xctrl *ctrl);
  */
 int nfb_xctrl_start(struct xctrl *ctrl);
 
+/**
+ * @brief Initializes the asynchronous stop of freshly allocated controller.
+ *
+ * @param ctrl
+ * @param stop_step mode specific attempt to stop the controller
+ */
+void nfb_xctrl_init_stop(struct xctrl *ctrl, int (*stop_step)(struct xctrl *ctrl));
+
+/**
+ * @brief Starts stopping the DMA in the background.
+ * 	Napi of the controller must be disabled, the work drains the rings.
+ * 	Stopping many controllers at once takes the time of the slowest one.
+ *
+ * @param ctrl
+ */
+void nfb_xctrl_stop_async(struct xctrl *ctrl);
+
+/**
+ * @brief Waits until the DMA started by nfb_xctrl_stop_async() is stopped.
+ *
+ * @param ctrl
+ */
+void nfb_xctrl_stop_wait(struct xctrl *ctrl);
+
+struct nfb_ethdev;
+
+/**
+ * @brief Replaces the XDP program of the ethdev and of every rx queue.
+ * 	Caller must wait for an RCU grace period before releasing the returned program.
+ *
+ * @param ethdev
+ * @param prog new program, may be NULL
+ * @return struct bpf_prog* previous program
+ */
+struct bpf_prog *nfb_xdp_xchg_prog(struct nfb_ethdev *ethdev, struct bpf_prog *prog);
+
 /* netdev_tx_t (*ndo_start_xmit)(struct sk_buff *skb,
  *                               struct net_device *dev);
  *	Called when a packet needs to be transmitted.
@@ -202,6 +348,11 @@ int nfb_xdp(struct net_device *dev, struct netdev_bpf *xdp);
  */
 int nfb_xsk_wakeup(struct net_device *dev, u32 queue_id, u32 flags);
 
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+// xdp metadata kfuncs (bpf_xdp_metadata_rx_timestamp, bpf_xdp_metadata_rx_hash)
+extern const struct xdp_metadata_ops nfb_xdp_metadata_ops;
+#endif
+
 // Napi poll functions
 int nfb_xctrl_napi_poll_pp(struct napi_struct *napi, int budget);
 int nfb_xctrl_napi_poll_rx_xsk(struct napi_struct *napi, int budget);
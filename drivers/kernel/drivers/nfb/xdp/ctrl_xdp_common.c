@@ -9,6 +9,7 @@
  */
 
 #include "ctrl_xdp_common.h"
+#include "xmitq.h"
 #include <linux/skbuff.h>
 #include <linux/pci.h>
 
@@ -36,33 +37,80 @@ int nfb_xctrl_start(struct xctrl *ctrl)
 	return ret;
 }
 
+static void nfb_xctrl_stop_work(struct work_struct *work)
+{
+	struct xctrl *ctrl = container_of(to_delayed_work(work), struct xctrl, stop_work);
+	int err;
+
+	err = ctrl->stop_step(ctrl);
+	if ((err == -EAGAIN || err == -EINPROGRESS) && time_before(jiffies, ctrl->stop_deadline)) {
+		// sleep instead of spinning, other queues keep their CPUs
+		queue_delayed_work(system_unbound_wq, &ctrl->stop_work, 1);
+		return;
+	}
+
+	if (err) {
+		nc_ndp_ctrl_stop_force(&ctrl->c);
+		printk(KERN_WARNING "nfb: queue id %u didn't stop in %u msecs; Force stopping dma ctrl; This might damage firmware.\n",
+				ctrl->nfb_queue_id, NFB_XCTRL_STOP_TIMEOUT_MS);
+	}
+	complete(&ctrl->stop_done);
+}
+
+void nfb_xctrl_init_stop(struct xctrl *ctrl, int (*stop_step)(struct xctrl *ctrl))
+{
+	INIT_DELAYED_WORK(&ctrl->stop_work, nfb_xctrl_stop_work);
+	init_completion(&ctrl->stop_done);
+	ctrl->stop_step = stop_step;
+}
+
+void nfb_xctrl_stop_async(struct xctrl *ctrl)
+{
+	if (!test_bit(XCTRL_STATUS_IS_RUNNING, &ctrl->status) || test_and_set_bit(XCTRL_STATUS_IS_STOPPING, &ctrl->status))
+		return;
+
+	ctrl->stop_deadline = jiffies + msecs_to_jiffies(NFB_XCTRL_STOP_TIMEOUT_MS);
+	queue_delayed_work(system_unbound_wq, &ctrl->stop_work, 0);
+}
+
+void nfb_xctrl_stop_wait(struct xctrl *ctrl)
+{
+	if (!test_bit(XCTRL_STATUS_IS_STOPPING, &ctrl->status))
+		return;
+
+	wait_for_completion(&ctrl->stop_done);
+	clear_bit(XCTRL_STATUS_IS_RUNNING, &ctrl->status);
+	clear_bit(XCTRL_STATUS_IS_STOPPING, &ctrl->status);
+}
+
 netdev_tx_t nfb_xctrl_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 {
 	struct nfb_ethdev *ethdev = netdev_priv(netdev);
 	struct nfb_xdp_channel *channel = &ethdev->channels[skb->queue_mapping];
 	struct nfb_xdp_queue *txq = &channel->txq;
 	struct xctrl *ctrl = txq->ctrl;
+	struct netdev_queue *ndq = netdev_get_tx_queue(netdev, skb->queue_mapping);
 
 	dma_addr_t dma;
 	u32 len;
 	u32 min_len = ETH_ZLEN;
-	u32 sdp;
-	u32 mdp;
-
-	struct nc_ndp_desc *descs;
-	u64 last_upper_addr;
-	u32 free_desc;
+	u32 idx;
 	u32 ret;
 
 	spin_lock(&ctrl->tx.tx_lock);
 	{
 		nc_ndp_ctrl_hdp_update(&ctrl->c);
-		nfb_xctrl_tx_free_buffers(ctrl);
-
-		sdp = ctrl->c.sdp;
-		mdp = ctrl->c.mdp;
-		free_desc = (ctrl->c.hdp - sdp - 1) & mdp;
-		descs = ctrl->desc_buffer_virt;
+		nfb_xctrl_tx_free_buffers(ctrl, 0);
+
+		// queue is stopped before the ring fills up, this should not happen
+		if (unlikely(nfb_xctrl_tx_free_desc(ctrl) < NFB_XCTRL_TX_SKB_DESC)) {
+			netif_tx_stop_queue(ndq);
+			nfb_xdp_tx_stats_add(&channel->tx_stats, &channel->tx_syncp, 0, 0, 1);
+			// previous skbs of the batch may still wait for the doorbell
+			nc_ndp_ctrl_sdp_flush(&ctrl->c);
+			spin_unlock(&ctrl->tx.tx_lock);
+			return NETDEV_TX_BUSY;
+		}
 
 		if (skb_linearize(skb)) {
 			printk(KERN_ERR "nfb: %s failed to linearize skb. queue: %u\n", __func__, channel->nfb_index);
@@ -82,133 +130,151 @@ netdev_tx_t nfb_xctrl_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 			goto free_locked;
 		}
 
-		last_upper_addr = ctrl->c.last_upper_addr;
-		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
-			if (unlikely(free_desc < 2)) {
-				dev_warn(ethdev->nfb->dev, "nfb: %s busy warning. Packets are dropped. queue: %u\n", __func__, channel->nfb_index);
-				goto free_locked_unmap;
-			}
-
-			last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(dma);
-			ctrl->c.last_upper_addr = last_upper_addr;
+		idx = nfb_xctrl_tx_write_desc_needs_lock(ctrl, dma, len, 0);
+		ctrl->tx.buffers[idx].type = NFB_XCTRL_BUFF_SKB;
+		ctrl->tx.buffers[idx].skb = skb;
+		ctrl->tx.buffers[idx].dma = dma;
+		ctrl->tx.buffers[idx].len = len;
+		nfb_xdp_tx_stats_add(&channel->tx_stats, &channel->tx_syncp, 1, len, 0);
 
-			descs[sdp] = nc_ndp_tx_desc0(dma);
-
-			ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_DESC_TYPE0;
-			free_desc--;
-			sdp = (sdp + 1) & mdp;
-		}
-
-		if (unlikely(free_desc == 0)) {
-			dev_warn(ethdev->nfb->dev, "nfb: %s busy warning. Packets are dropped. queue: %u\n", __func__, channel->nfb_index);
-			goto free_locked_unmap;
-		}
-
-		free_desc--;
-
-		// TODO:
-		// If socket uses up all it's allocated skbs before first skb is freed
-		// then socket can no longer send another packet
-		// and tx completition is not called causing socket to deadlock
-		// skb_orphan releases skb from socket pool so it is a working temporary solution
-		// tx timeout should still be introduced
-		skb_orphan(skb);
-
-		ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_SKB;
-		ctrl->tx.buffers[sdp].skb = skb;
-		ctrl->tx.buffers[sdp].dma = dma;
-		ctrl->tx.buffers[sdp].len = len;
-
-		descs[sdp] = nc_ndp_tx_desc2(dma, len, 0, 0);
-		sdp = (sdp + 1) & mdp;
-		ctrl->c.sdp = sdp;
+		// stop while the next skb still fits, queue is woken on tx reclaim
+		if (unlikely(nfb_xctrl_tx_free_desc(ctrl) < NFB_XCTRL_TX_SKB_DESC))
+			netif_tx_stop_queue(ndq);
 
 		// NOTE: Calling dma_map_single with DMA_TO_DEVICE should do the sync for dev
 		//		 Calling unmap should do the sync for cpu
 		//		 Therefore the sync functions are only really needed when using DMA_BIDIRECTINAL
 		// dma_sync_single_for_device(ctrl->dma_dev, dma, len, DMA_TO_DEVICE);
-		nc_ndp_ctrl_sdp_flush(&ctrl->c);
+
+		// ring the doorbell once per batch of the stack, or when the queue got stopped
+		if (__netdev_tx_sent_queue(ndq, len, netdev_xmit_more()))
+			nc_ndp_ctrl_sdp_flush(&ctrl->c);
 	}
 	spin_unlock(&ctrl->tx.tx_lock);
 
 	return NETDEV_TX_OK;
 
-free_locked_unmap:
-	dma_unmap_single(ctrl->dma_dev, dma, len, DMA_TO_DEVICE);
 free_locked:
 	dev_kfree_skb(skb);
 freed_locked:
+	// previous skbs of the batch may still wait for the doorbell
+	nc_ndp_ctrl_sdp_flush(&ctrl->c);
 	spin_unlock(&ctrl->tx.tx_lock);
 
-	// NOTE: It is possible to return NETDEV_TX_BUSY
-	// Kernel then tries to xmit packet again
-	// It is slow and it is possible to completely
-	// freeze system this way on error.
 	return NETDEV_TX_OK;
 }
 
+/**
+ * @brief Submits frames onto tx ring.
+ * 
+ * @param ctrl 
+ * @param n 
+ * @param xdp 
+ * @param stats tx stats of the queue, caller is the only writer
+ * @param syncp 
+ * @param flags XDP_XMIT_FLUSH rings the doorbell, the rest of the bulk follows otherwise
+ * @return number of submitted frames
+ */
+static inline int nfb_xctrl_xdp_xmit_needs_lock(struct xctrl *ctrl, int n, struct xdp_frame **xdp,
+		struct nfb_xdp_tx_stats *stats, struct u64_stats_sync *syncp, u32 flags)
+{
+	u64 bytes = 0;
+	int cnt;
+
+	// reclaim tx buffers, we are not in napi of this channel
+	nc_ndp_ctrl_hdp_update(&ctrl->c);
+	nfb_xctrl_tx_free_buffers(ctrl, 0);
+	// process tx
+	for (cnt = 0; cnt < n; cnt++) {
+		if (unlikely(nfb_xctrl_tx_submit_frame_needs_lock(ctrl, xdp[cnt]))) {
+			// on error caller frees the frames (see ndo_xdp_xmit docs)
+			break;
+		}
+		bytes += nfb_xctrl_frame_len(xdp[cnt]);
+	}
+	if (flags & XDP_XMIT_FLUSH)
+		nc_ndp_ctrl_sdp_flush(&ctrl->c);
+	nfb_xdp_tx_stats_add(stats, syncp, cnt, bytes, n - cnt);
+	return cnt;
+}
+
 int nfb_xctrl_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **xdp, u32 flags)
 {
 	struct nfb_ethdev *ethdev = netdev_priv(dev);
+	struct nfb_xdp_xmitq *xmitq;
 	u32 qid;
 	struct nfb_xdp_channel *channel;
-	struct nfb_xdp_queue *txq;
 	struct xctrl *ctrl;
-	struct xdp_frame *frame;
 	int cnt = 0;
 
-	if (n == 0) {
-		return 0;
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+
+	// Spare tx queue owned by this CPU, the lock is contended only by its reclaim timer
+	// when the timer got migrated away by CPU hotplug
+	xmitq = nfb_xdp_xmitq_get(ethdev);
+	if (likely(xmitq)) {
+		ctrl = xmitq->ctrl;
+		spin_lock(&ctrl->tx.tx_lock);
+		{
+			cnt = nfb_xctrl_xdp_xmit_needs_lock(ctrl, n, xdp, &xmitq->stats, &xmitq->syncp, flags);
+		}
+		spin_unlock(&ctrl->tx.tx_lock);
+		nfb_xdp_xmitq_arm(xmitq);
+		return cnt;
 	}
 
-	// There doesn't seem to be a good way to decide which queue to use for tx other than semi random
-	qid = smp_processor_id() % ethdev->channel_count;
+	// Fallback, there doesn't seem to be a good way to decide which queue to use for tx other than semi random
+	qid = smp_processor_id() % READ_ONCE(ethdev->channel_count);
 	channel = &ethdev->channels[qid];
-	txq = &channel->txq;
-	ctrl = txq->ctrl;
+	// channel being stopped or restarted, the caller frees the frames
+	ctrl = rcu_dereference_check(channel->xmit_ctrl, rcu_read_lock_bh_held());
+	if (unlikely(!ctrl))
+		return 0;
 	spin_lock(&ctrl->tx.tx_lock);
 	{
-		// reclaim tx buffers
-		nc_ndp_ctrl_hdp_update(&ctrl->c);
-		nfb_xctrl_tx_free_buffers(ctrl);
-		// process tx
-		for (cnt = 0; cnt < n; cnt++) {
-			frame = xdp[cnt];
-			if (unlikely(nfb_xctrl_tx_submit_frame_needs_lock(ctrl, frame))) {
-				// on error caller frees the frames (see ndo_xdp_xmit docs)
-				break;
-			}
-		}
-		// flush
-		nc_ndp_ctrl_sdp_flush(&ctrl->c);
+		cnt = nfb_xctrl_xdp_xmit_needs_lock(ctrl, n, xdp, &channel->tx_stats, &channel->tx_syncp, flags);
 	}
 	spin_unlock(&ctrl->tx.tx_lock);
-	if (cnt != n) {
-		printk(KERN_WARNING "%s didn't manage to tx all packets; %d packets dropped\n", __func__, n - cnt);
-	}
 	return cnt;
 }
 
-// TODO: currently the prog pointer is held in the netdev_priv.
-//	Maybe for performance there should be pointer inside each queue struct.
+struct bpf_prog *nfb_xdp_xchg_prog(struct nfb_ethdev *ethdev, struct bpf_prog *prog)
+{
+	struct bpf_prog *old_prog;
+	unsigned i;
+
+	spin_lock(&ethdev->prog_lock);
+	{
+		old_prog = rcu_replace_pointer(ethdev->prog, prog, lockdep_is_held(&ethdev->prog_lock));
+		// napi reads the copy next to its own queue, not the shared ethdev line
+		for (i = 0; i < ethdev->channel_max; i++)
+			rcu_assign_pointer(ethdev->channels[i].rxq.prog, prog);
+	}
+	spin_unlock(&ethdev->prog_lock);
+	return old_prog;
+}
+
 /**
  * @brief Replaces pointer to xdp prog.
  * 
  * @param netdev 
  * @param prog 
+ * @param extack 
  * @return int 
  */
-static int nfb_xdp_setup_prog(struct net_device *netdev, struct bpf_prog *prog)
+static int nfb_xdp_setup_prog(struct net_device *netdev, struct bpf_prog *prog, struct netlink_ext_ack *extack)
 {
 	struct nfb_ethdev *ethdev = netdev_priv(netdev);
 	struct bpf_prog *old_prog;
 
-	// Swap program pointer
-	spin_lock(&ethdev->prog_lock);
-	{
-		old_prog = rcu_replace_pointer(ethdev->prog, prog, lockdep_is_held(&ethdev->prog_lock));
+	if (!nfb_xdp_prog_mtu_ok(prog, netdev->mtu)) {
+		NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP program without frags support");
+		return -EOPNOTSUPP;
 	}
-	spin_unlock(&ethdev->prog_lock);
+
+	// Swap program pointer
+	old_prog = nfb_xdp_xchg_prog(ethdev, prog);
 	synchronize_rcu();
 
 	if (old_prog) {
@@ -235,17 +301,24 @@ static int nfb_setup_xsk_pool(struct net_device *dev, struct xsk_buff_pool *pool
 	u32 nfb_queue_id = channel->nfb_index;
 	int ret = 0;
 
+	if (!nfb_xdp_xsk_mtu_ok(pool, dev->mtu)) {
+		printk(KERN_ERR "nfb: %s - xsk pool frame size %u too small for MTU %d\n", dev->name, xsk_pool_get_rx_frame_size(pool), dev->mtu);
+		return -EINVAL;
+	}
+
 	// printk(KERN_DEBUG "LOG: inside %s\n", __func__);
-	if ((ret = xsk_pool_dma_map(pool, &ethdev->nfb->pci->dev, DMA_ATTR_SKIP_CPU_SYNC))) {
+	if ((ret = xsk_pool_dma_map(pool, ethdev->nfb->dma_dev, DMA_ATTR_SKIP_CPU_SYNC))) {
 		printk(KERN_ERR "nfb: Failed to switch queue %d pool could't be mapped err: %d\n", nfb_queue_id, ret);
 		goto exit;
 	}
 
-	channel_stop(channel);
-	set_bit(NFB_STATUS_IS_XSK, &channel->status);
+	// the new controllers are ready before the page pool ones stop
 	channel->pool = pool;
-	if ((ret = channel_start_xsk(channel))) {
+	nfb_xdp_set_rx_frame_len(ethdev);
+	if ((ret = channel_swap_mode(channel, pool))) {
 		printk(KERN_WARNING "nfb: Failed to start channel %d, channel unusable\n", nfb_queue_id);
+		channel->pool = NULL;
+		nfb_xdp_set_rx_frame_len(ethdev);
 		goto unmap;
 	}
 	printk("nfb: channel %d switched to AF_XDP operation\n", nfb_queue_id);
@@ -276,9 +349,7 @@ static int nfb_teardown_xsk_pool(struct net_device *dev, struct xsk_buff_pool *p
 	u32 nfb_queue_id = channel->nfb_index;
 	u32 ret = 0;
 
-	channel_stop(channel);
-	clear_bit(NFB_STATUS_IS_XSK, &channel->status);
-	if ((ret = channel_start_pp(channel))) {
+	if ((ret = channel_swap_mode(channel, NULL))) {
 		printk(KERN_WARNING "nfb: Failed to start channel %d, channel unusable\n", nfb_queue_id);
 		goto unmap;
 	}
@@ -286,10 +357,9 @@ static int nfb_teardown_xsk_pool(struct net_device *dev, struct xsk_buff_pool *p
 	printk("nfb: channel %d switched to XDP operation\n", nfb_queue_id);
 unmap:
 	old_pool = xchg(&channel->pool, NULL);
-	if (!old_pool) {
+	if (old_pool)
 		xsk_pool_dma_unmap(old_pool, DMA_ATTR_SKIP_CPU_SYNC);
-		channel->pool = NULL;
-	}
+	nfb_xdp_set_rx_frame_len(ethdev);
 	return ret;
 }
 
@@ -303,7 +373,7 @@ int nfb_xdp(struct net_device *dev, struct netdev_bpf *xdp)
 	int ret;
 	switch (xdp->command) {
 	case XDP_SETUP_PROG:
-		return nfb_xdp_setup_prog(dev, xdp->prog);
+		return nfb_xdp_setup_prog(dev, xdp->prog, xdp->extack);
 	case XDP_SETUP_XSK_POOL:
 		if (xdp->xsk.pool) {
 			ret = nfb_setup_xsk_pool(dev, xdp->xsk.pool, xdp->xsk.queue_id);
@@ -346,3 +416,45 @@ int nfb_xsk_wakeup(struct net_device *dev, u32 queue_id, u32 flags)
 
 	return 0;
 }
+
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+/* int (*xmo_rx_timestamp)(const struct xdp_md *ctx, u64 *timestamp);
+ *	Backs bpf_xdp_metadata_rx_timestamp(), ctx is the xdp_buff of the frame.
+ *	Both page pool and xsk buffers have struct nfb_xdp_buff layout.
+ */
+static int nfb_xdp_rx_timestamp(const struct xdp_md *ctx, u64 *timestamp)
+{
+	const struct nfb_xdp_buff *nxdp = (const void *)ctx;
+
+	if (!(nxdp->meta_flags & NFB_XDP_META_TS))
+		return -ENODATA;
+
+	*timestamp = nxdp->ts;
+	return 0;
+}
+
+/* int (*xmo_rx_hash)(const struct xdp_md *ctx, u32 *hash,
+ *		      enum xdp_rss_hash_type *rss_type);
+ *	Backs bpf_xdp_metadata_rx_hash().
+ */
+static int nfb_xdp_rx_hash(const struct xdp_md *ctx, u32 *hash, enum xdp_rss_hash_type *rss_type)
+{
+	const struct nfb_xdp_buff *nxdp = (const void *)ctx;
+
+	// xsk buffers keep the extension in their private area
+	XSK_CHECK_PRIV_TYPE(struct nfb_xdp_buff);
+
+	if (!(nxdp->meta_flags & NFB_XDP_META_HASH))
+		return -ENODATA;
+
+	*hash = nxdp->hash;
+	// layers covered by the firmware hash are unknown, see nfb_xctrl_skb_set_meta()
+	*rss_type = XDP_RSS_TYPE_L3;
+	return 0;
+}
+
+const struct xdp_metadata_ops nfb_xdp_metadata_ops = {
+	.xmo_rx_timestamp = nfb_xdp_rx_timestamp,
+	.xmo_rx_hash = nfb_xdp_rx_hash,
+};
+#endif
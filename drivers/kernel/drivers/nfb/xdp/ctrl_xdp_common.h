@@ -14,6 +14,7 @@
 #include "ctrl_xdp.h"
 #include "ethdev.h"
 #include "channel.h"
+#include "driver.h"
 
 #ifdef CONFIG_HAVE_PAGE_POOL_HELPERS
 #include <net/page_pool/helpers.h>
@@ -21,37 +22,198 @@
 #include <net/page_pool.h>
 #endif
 
-// TODO: to make the logic easier this could be split into pp and xsk version of the function
+#ifdef CONFIG_HAVE_XDP_RETURN_FRAME_BULK
+#ifndef CONFIG_HAVE_XDP_FRAME_BULK_INIT
+static inline void xdp_frame_bulk_init(struct xdp_frame_bulk *bq)
+{
+	bq->xa = NULL;
+	bq->count = 0;
+}
+#endif
+#else
+// Fallback for older kernels, frames are returned one by one
+struct xdp_frame_bulk {
+	int count;
+};
+
+static inline void xdp_frame_bulk_init(struct xdp_frame_bulk *bq)
+{
+	bq->count = 0;
+}
+
+static inline void xdp_return_frame_bulk(struct xdp_frame *frame, struct xdp_frame_bulk *bq)
+{
+	xdp_return_frame(frame);
+}
+
+static inline void xdp_flush_frame_bulk(struct xdp_frame_bulk *bq)
+{
+}
+#endif
+
+#ifndef CONFIG_HAVE_NAPI_BUILD_SKB
+static inline struct sk_buff *napi_build_skb(void *data, unsigned int frag_size)
+{
+	return build_skb(data, frag_size);
+}
+#endif
+
+/**
+ * @brief Sets up which metadata the rx queue takes from the NDP header.
+ * 	Offsets outside of the header (hdr_len is 8 bits wide) are ignored.
+ * 
+ * @param ctrl 
+ */
+static inline void nfb_xctrl_rx_meta_init(struct xctrl *ctrl)
+{
+	ctrl->rx.ts_offset = (nfb_xdp_rx_ts_offset >= 0 && nfb_xdp_rx_ts_offset + sizeof(u64) <= U8_MAX) ? nfb_xdp_rx_ts_offset : -1;
+	ctrl->rx.hash_offset = (nfb_xdp_rx_hash_offset >= 0 && nfb_xdp_rx_hash_offset + sizeof(u32) <= U8_MAX) ? nfb_xdp_rx_hash_offset : -1;
+}
+
+/**
+ * @brief Strips the NDP header from the start of received frame.
+ * 	Timestamp and hash the firmware placed into the header are kept for the kfuncs and skb.
+ * 	Must be called after data and data_end are set to the whole received buffer.
+ * 
+ * @param ctrl 
+ * @param xdp page pool buffer or xsk buffer, both have struct nfb_xdp_buff layout
+ * @param hdr_len length of the NDP header in front of the frame
+ */
+static inline void nfb_xctrl_rx_meta(struct xctrl *ctrl, struct xdp_buff *xdp, u32 hdr_len)
+{
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+	struct nfb_xdp_buff *nxdp = container_of(xdp, struct nfb_xdp_buff, xdp);
+	const u8 *hdr = xdp->data;
+	__le64 ts;
+	__le32 hash;
+	u64 ns;
+
+	nxdp->meta_flags = 0;
+#endif
+	if (likely(!hdr_len))
+		return;
+	if (unlikely(hdr_len > xdp->data_end - xdp->data))
+		hdr_len = xdp->data_end - xdp->data;
+
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+	if (ctrl->rx.ts_offset >= 0 && ctrl->rx.ts_offset + sizeof(u64) <= hdr_len) {
+		// TSU format, seconds in the upper half and nanoseconds in the lower
+		// header fields are not aligned
+		memcpy(&ts, hdr + ctrl->rx.ts_offset, sizeof(ts));
+		ns = le64_to_cpu(ts);
+		nxdp->ts = (ns >> 32) * NSEC_PER_SEC + (u32)ns;
+		nxdp->meta_flags |= NFB_XDP_META_TS;
+	}
+	if (ctrl->rx.hash_offset >= 0 && ctrl->rx.hash_offset + sizeof(u32) <= hdr_len) {
+		memcpy(&hash, hdr + ctrl->rx.hash_offset, sizeof(hash));
+		nxdp->hash = le32_to_cpu(hash);
+		nxdp->meta_flags |= NFB_XDP_META_HASH;
+	}
+#endif
+	// frame follows the header
+	xdp->data += hdr_len;
+	xdp->data_meta = xdp->data;
+}
+
+/**
+ * @brief Passes the NDP metadata of XDP_PASS frame to skb
+ * 
+ * @param skb 
+ * @param xdp 
+ */
+static inline void nfb_xctrl_skb_set_meta(struct sk_buff *skb, struct xdp_buff *xdp)
+{
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+	struct nfb_xdp_buff *nxdp = container_of(xdp, struct nfb_xdp_buff, xdp);
+
+	if (!nxdp->meta_flags)
+		return;
+	// layers covered by the firmware hash are unknown, L3 is the safe claim
+	if (nxdp->meta_flags & NFB_XDP_META_HASH)
+		skb_set_hash(skb, nxdp->hash, PKT_HASH_TYPE_L3);
+	if (nxdp->meta_flags & NFB_XDP_META_TS)
+		skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(nxdp->ts);
+#endif
+}
+
+/**
+ * @brief Number of descriptors available for submission
+ * 
+ * @param ctrl 
+ * @return u32 
+ */
+static inline u32 nfb_xctrl_tx_free_desc(struct xctrl *ctrl)
+{
+	return (ctrl->c.hdp - ctrl->c.sdp - 1) & ctrl->c.mdp;
+}
+
+/**
+ * @brief Reports completed skbs to BQL and wakes the stack tx queue once there is room again.
+ * 
+ * @param ctrl 
+ * @param pkts 
+ * @param bytes 
+ */
+static inline void nfb_xctrl_tx_complete_skbs(struct xctrl *ctrl, u32 pkts, u32 bytes)
+{
+	struct netdev_queue *ndq = ctrl->tx.ndq;
+
+	netdev_tx_completed_queue(ndq, pkts, bytes);
+	if (unlikely(netif_tx_queue_stopped(ndq)) && nfb_xctrl_tx_free_desc(ctrl) >= NFB_XCTRL_TX_WAKE_THRESH)
+		netif_tx_wake_queue(ndq);
+}
+
 /**
  * @brief Reclaims buffers from tx
+ * 	Frames are returned in bulk, skbs are consumed through napi cache when possible.
  * 
  * @param ctrl 
+ * @param napi_budget nonzero only when called from napi owning the rx page pool of this channel,
+ * 	pages of NFB_XCTRL_BUFF_FRAME_PP are then recycled directly into the pool cache
  */
-static inline void nfb_xctrl_tx_free_buffers(struct xctrl *ctrl)
+static inline void nfb_xctrl_tx_free_buffers(struct xctrl *ctrl, int napi_budget)
 {
+	struct xctrl_tx_buffer *buf;
+	struct xdp_frame_bulk bq;
 	u32 i;
 	u32 hdp = ctrl->c.hdp;
 	u32 mdp = ctrl->c.mdp;
 	u32 fdp = ctrl->tx.fdp;
+	u32 skb_pkts = 0, skb_bytes = 0;
 
+	if (fdp == hdp)
+		return;
+
+	xdp_frame_bulk_init(&bq);
+	// bulk return uses page pool lookup which must be done under rcu
+	rcu_read_lock();
 	for (i = fdp; i != hdp; i++, i &= mdp) {
-		switch (ctrl->tx.buffers[i].type) {
+		buf = &ctrl->tx.buffers[i];
+		switch (buf->type) {
 		case NFB_XCTRL_BUFF_FRAME_PP: // xdp buff to be recycled to page pool
-			// xdp_return_buff definition is missing in 4.18.0-477.10.1.el8_8.x86_64
-			// xdp_return_buff(ctrl->tx.buffers[i].buff);
-			xdp_return_frame(ctrl->tx.buffers[i].frame);
+			if (napi_budget)
+				xdp_return_frame_rx_napi(buf->frame);
+			else
+				xdp_return_frame_bulk(buf->frame, &bq);
 			break;
 		case NFB_XCTRL_BUFF_XSK:
-			ctrl->tx.completed_xsk_tx += ctrl->tx.buffers[i].num_of_xsk_completions;
+			ctrl->tx.completed_xsk_tx += buf->num_of_xsk_completions;
 			break;
 		case NFB_XCTRL_BUFF_SKB:
-			dma_unmap_single(ctrl->dma_dev, ctrl->tx.buffers[i].dma, ctrl->tx.buffers[i].len, DMA_TO_DEVICE);
-			dev_kfree_skb(ctrl->tx.buffers[i].skb);
+			dma_unmap_single(ctrl->dma_dev, buf->dma, buf->len, DMA_TO_DEVICE);
+			napi_consume_skb(buf->skb, napi_budget);
+			skb_pkts++;
+			skb_bytes += buf->len;
 			break;
 		case NFB_XCTRL_BUFF_FRAME: // redirectedd frame - can be from another device all together
-			// TODO check out xdp_return_frame_bulk()
-			dma_unmap_single(ctrl->dma_dev, ctrl->tx.buffers[i].dma, ctrl->tx.buffers[i].len, DMA_TO_DEVICE);
-			xdp_return_frame(ctrl->tx.buffers[i].frame);
+			dma_unmap_single(ctrl->dma_dev, buf->dma, buf->len, DMA_TO_DEVICE);
+			xdp_return_frame_bulk(buf->frame, &bq);
+			break;
+		case NFB_XCTRL_BUFF_FRAG: // piece of a redirected multi-buffer frame
+			dma_unmap_single(ctrl->dma_dev, buf->dma, buf->len, DMA_TO_DEVICE);
+			break;
+		case NFB_XCTRL_BUFF_XSK_TX: // umem chunk, mapped by the xsk pool
+			ctrl->tx.xsk_done[ctrl->tx.xsk_done_cnt++] = buf->xdp;
 			break;
 		case NFB_XCTRL_BUFF_DESC_TYPE0:
 			break;
@@ -60,17 +222,135 @@ static inline void nfb_xctrl_tx_free_buffers(struct xctrl *ctrl)
 			BUG();
 			break;
 		}
-		ctrl->tx.buffers[i].type = NFB_XCTRL_BUFF_DESC_TYPE0;
+		buf->type = NFB_XCTRL_BUFF_DESC_TYPE0;
 	}
+	xdp_flush_frame_bulk(&bq);
+	rcu_read_unlock();
 	ctrl->tx.fdp = hdp;
+
+	if (ctrl->tx.ndq)
+		nfb_xctrl_tx_complete_skbs(ctrl, skb_pkts, skb_bytes);
+}
+
+/**
+ * @brief Tx completion from napi.
+ * 	Submitters reclaim the ring too, but only when they transmit again.
+ * 	Napi returns skbs and frames promptly even when nothing else is sent,
+ * 	socket back-pressure (TSQ) and the stopped stack tx queue depend on it.
+ * 
+ * @param ctrl 
+ * @param napi_budget see nfb_xctrl_tx_free_buffers()
+ * @return number of descriptors reclaimed by this call
+ */
+static inline u32 nfb_xctrl_tx_reclaim(struct xctrl *ctrl, int napi_budget)
+{
+	u32 fdp;
+
+	// nothing in flight, don't touch the lock
+	if (READ_ONCE(ctrl->tx.fdp) == READ_ONCE(ctrl->c.sdp))
+		return 0;
+
+	// submitter holding the lock reclaims by itself
+	if (!spin_trylock(&ctrl->tx.tx_lock))
+		return 0;
+	{
+		fdp = ctrl->tx.fdp;
+		nc_ndp_ctrl_hdp_update(&ctrl->c);
+		nfb_xctrl_tx_free_buffers(ctrl, napi_budget);
+		fdp = (ctrl->tx.fdp - fdp) & ctrl->c.mdp;
+	}
+	spin_unlock(&ctrl->tx.tx_lock);
+	return fdp;
+}
+
+/**
+ * @brief Fills skb fragment, hides API differences between kernel versions
+ * 
+ * @param frag 
+ * @param page 
+ * @param off 
+ * @param size 
+ */
+#ifdef CONFIG_HAVE_XDP_FRAGS
+static inline void nfb_xctrl_frag_fill(skb_frag_t *frag, struct page *page, u32 off, u32 size)
+{
+#ifdef CONFIG_HAVE_SKB_FRAG_FILL_PAGE_DESC
+	skb_frag_fill_page_desc(frag, page, off, size);
+#else
+	__skb_frag_set_page(frag, page);
+	skb_frag_off_set(frag, off);
+	skb_frag_size_set(frag, size);
+#endif
+}
+#endif
+
+/**
+ * @brief Number of buffers (head + fragments) the frame occupies
+ * 
+ * @param frame 
+ * @return u32 
+ */
+static inline u32 nfb_xctrl_frame_nr_bufs(struct xdp_frame *frame)
+{
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	if (unlikely(xdp_frame_has_frags(frame)))
+		return 1 + xdp_get_shared_info_from_frame(frame)->nr_frags;
+#endif
+	return 1;
+}
+
+/**
+ * @brief Length of the frame including fragments
+ * 
+ * @param frame 
+ * @return u32 
+ */
+static inline u32 nfb_xctrl_frame_len(struct xdp_frame *frame)
+{
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	return xdp_get_frame_len(frame);
+#else
+	return frame->len;
+#endif
+}
+
+/**
+ * @brief Writes one data descriptor onto tx ring, preceded by type0 descriptor when upper address changes.
+ * 	Caller must check there are 2 free descriptors.
+ * 
+ * @param ctrl 
+ * @param dma 
+ * @param len 
+ * @param next set when the frame continues in the next data descriptor
+ * @return u32 index of the written data descriptor, caller sets up the tx.buffers entry
+ */
+static inline u32 nfb_xctrl_tx_write_desc_needs_lock(struct xctrl *ctrl, dma_addr_t dma, u32 len, int next)
+{
+	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
+	u32 sdp = ctrl->c.sdp;
+	u32 mdp = ctrl->c.mdp;
+
+	if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != ctrl->c.last_upper_addr)) {
+		ctrl->c.last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(dma);
+		descs[sdp] = nc_ndp_tx_desc0(dma);
+		ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_DESC_TYPE0;
+		sdp = (sdp + 1) & mdp;
+	}
+
+	descs[sdp] = nc_ndp_tx_desc2(dma, len, 0, next);
+	ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_DESC_TYPE0;
+	ctrl->c.sdp = (sdp + 1) & mdp;
+	return sdp;
 }
 
 /**
  * @brief Submits and maps frame onto tx. Not as straight forward as i would have liked -> check note
+ * 	Multi-buffer frames are chained through the next flag, each piece is mapped separately.
+ * 	Frame is returned with its last piece.
  * @note 
  * spin_lock(&lock)
  * 	  nc_ndp_ctrl_hdp_update(&ctrl->c);
- * 	  nfb_xctrl_tx_free_buffers(ctrl);
+ * 	  nfb_xctrl_tx_free_buffers(ctrl, napi_budget);
  * 	  for (;;)
  * 	     nfb_xctrl_tx_submit_frame_needs_lock()
  *	  nc_ndp_ctrl_sdp_flush()
@@ -86,68 +366,66 @@ static inline int nfb_xctrl_tx_submit_frame_needs_lock(struct xctrl *ctrl, struc
 	u32 len;
 	u16 min_len = ETH_ZLEN;
 	int ret = 0;
-
-	// ctrl vars
-	u64 last_upper_addr = ctrl->c.last_upper_addr;
+	u32 i, nr_bufs, idx;
 	u32 sdp = ctrl->c.sdp;
-	u32 mdp = ctrl->c.mdp;
-	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
+	u64 last_upper_addr = ctrl->c.last_upper_addr;
+	void *data;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	struct skb_shared_info *sinfo = NULL;
+#endif
 
-	free_desc = (ctrl->c.hdp - sdp - 1) & mdp;
+	nr_bufs = nfb_xctrl_frame_nr_bufs(frame);
+	free_desc = (ctrl->c.hdp - sdp - 1) & ctrl->c.mdp;
+	// worst case every piece needs a type0 descriptor
+	if (unlikely(free_desc < 2 * nr_bufs))
+		return -EBUSY;
 
 	// handle small frames
 	len = max(frame->len, min_len);
 	// Here we don't know where the frames came from. (Could be different driver all together)
 	// Therefore if we cannot make the frame bigger we would have to alloc a new one. -ENOTSUPP
 	if (frame->len < min_len) { // Usable frame space is smaller than min_len.
-		if (unlikely(frame->frame_sz - frame->headroom < min_len)) {
-			ret = -ENOTSUPP;
-			goto exit;
+		if (unlikely(nr_bufs > 1 || frame->frame_sz - frame->headroom < min_len)) {
+			return -ENOTSUPP;
 		}
 		memset(frame->data + frame->len, 0, min_len - frame->len);
 	}
 
-	dma = dma_map_single(ctrl->dma_dev, frame->data, len, DMA_TO_DEVICE);
-	if (unlikely(ret = dma_mapping_error(ctrl->dma_dev, dma))) {
-		printk(KERN_ERR "nfb: %s failed to map frame\n", __func__);
-		goto exit;
-	}
-
-	if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
-		if (unlikely(free_desc < 2)) {
-			printk(KERN_ERR "nfb: %s busy warning\n", __func__);
-			dma_unmap_single(ctrl->dma_dev, dma, len, DMA_TO_DEVICE);
-			ret = -EBUSY;
-			goto exit;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	if (nr_bufs > 1)
+		sinfo = xdp_get_shared_info_from_frame(frame);
+#endif
+	for (i = 0; i < nr_bufs; i++) {
+		data = frame->data;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+		if (i) {
+			data = skb_frag_address(&sinfo->frags[i - 1]);
+			len = skb_frag_size(&sinfo->frags[i - 1]);
+		}
+#endif
+		dma = dma_map_single(ctrl->dma_dev, data, len, DMA_TO_DEVICE);
+		if (unlikely(ret = dma_mapping_error(ctrl->dma_dev, dma))) {
+			printk(KERN_ERR "nfb: %s failed to map frame\n", __func__);
+			goto err_unmap;
 		}
 
-		last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(dma);
-		ctrl->c.last_upper_addr = last_upper_addr;
-
-		descs[sdp] = nc_ndp_tx_desc0(dma);
-
-		ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_DESC_TYPE0;
-		free_desc--;
-		sdp = (sdp + 1) & mdp;
+		idx = nfb_xctrl_tx_write_desc_needs_lock(ctrl, dma, len, i + 1 < nr_bufs);
+		ctrl->tx.buffers[idx].type = (i + 1 < nr_bufs) ? NFB_XCTRL_BUFF_FRAG : NFB_XCTRL_BUFF_FRAME;
+		ctrl->tx.buffers[idx].frame = frame;
+		ctrl->tx.buffers[idx].dma = dma;
+		ctrl->tx.buffers[idx].len = len;
 	}
+	return 0;
 
-	if (unlikely(free_desc == 0)) {
-		printk(KERN_ERR "nfb: nfb_xctrl_xmit busy warning\n");
-		dma_unmap_single(ctrl->dma_dev, dma, len, DMA_TO_DEVICE);
-		ret = -EBUSY;
-		goto exit;
+err_unmap:
+	// roll back the pieces already written, nothing was flushed to the card yet
+	for (idx = sdp; idx != ctrl->c.sdp; idx = (idx + 1) & ctrl->c.mdp) {
+		if (ctrl->tx.buffers[idx].type == NFB_XCTRL_BUFF_FRAG)
+			dma_unmap_single(ctrl->dma_dev, ctrl->tx.buffers[idx].dma, ctrl->tx.buffers[idx].len, DMA_TO_DEVICE);
+		ctrl->tx.buffers[idx].type = NFB_XCTRL_BUFF_DESC_TYPE0;
 	}
-
-	ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_FRAME;
-	ctrl->tx.buffers[sdp].frame = frame;
-	ctrl->tx.buffers[sdp].dma = dma;
-	ctrl->tx.buffers[sdp].len = len;
-	descs[sdp] = nc_ndp_tx_desc2(dma, len, 0, 0);
-	sdp = (sdp + 1) & mdp;
-
-	// update ctrl state
 	ctrl->c.sdp = sdp;
-exit:
+	ctrl->c.last_upper_addr = last_upper_addr;
 	return ret;
 }
 
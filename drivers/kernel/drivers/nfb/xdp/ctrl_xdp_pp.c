@@ -9,106 +9,221 @@
  */
 
 #include <linux/slab.h>
-#include <linux/delay.h>
 #include <linux/dma-mapping.h>
 #include <linux/pci.h>
 #include <net/xdp_sock_drv.h>
 
 #include "ctrl_xdp_common.h"
+#include "driver.h"
 
 /**
- * @brief Tries to rexmit pp page. Frees page on fail via xdp_return_buff (gets the page_pool from mem info)
+ * @brief XDP_TX frames staged during one napi poll
+ * 	Frames are written onto tx ring in a single critical section at the end of the poll.
+ */
+struct nfb_xctrl_tx_bulk {
+	u32 count;
+	struct xdp_frame *frames[NAPI_POLL_WEIGHT];
+};
+
+/**
+ * @brief Returns the head buffer and all attached frags to the page pool.
+ * 	Used where the buffer is dropped without being converted to a frame.
  * 
- * @param ctrl 
  * @param xdp 
- * @return int 
+ * @param pool page pool of the rx queue
  */
-static inline int nfb_xctrl_rexmit_pp(struct xctrl *ctrl, struct xdp_buff *xdp)
+static inline void nfb_xctrl_put_buff_pp(struct xdp_buff *xdp, struct page_pool *pool)
 {
-	dma_addr_t dma;
-	u32 free_desc;
-	u32 len;
-	u32 min_len = ETH_ZLEN;
-	int ret = 0;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	struct skb_shared_info *sinfo;
+	u32 i;
 
-	// ctrl vars
-	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
-	u32 sdp = ctrl->c.sdp;
-	u32 mdp = ctrl->c.mdp;
-	u64 last_upper_addr = ctrl->c.last_upper_addr;
+	// shared info lives in the head page, frags go first
+	if (unlikely(xdp_buff_has_frags(xdp))) {
+		sinfo = xdp_get_shared_info_from_buff(xdp);
+		for (i = 0; i < sinfo->nr_frags; i++)
+			page_pool_put_full_page(pool, skb_frag_page(&sinfo->frags[i]), true);
+	}
+#endif
+	page_pool_put_full_page(pool, virt_to_head_page(xdp->data_hard_start), true);
+}
+
+/**
+ * @brief Stages pp buffer for XDP_TX. Returns the buffer with all its frags to the pool on fail.
+ * 
+ * @param bulk 
+ * @param xdp 
+ * @param pool page pool of the rx queue
+ * @return 0 on success
+ */
+static inline int nfb_xctrl_tx_bulk_add_pp(struct nfb_xctrl_tx_bulk *bulk, struct xdp_buff *xdp, struct page_pool *pool)
+{
+	struct xdp_frame *frame;
+	u32 min_len = ETH_ZLEN;
 
 	// handle small packets
-	len = max((u32)(xdp->data_end - xdp->data), min_len);
-	// it is assumed here that we have whole page and that the headroom is XDP_PACKET_HEADROOM
+	// it is assumed here that we have whole page and that the tailroom is reserved
 	if (xdp->data_end - xdp->data < min_len) {
-		memset(xdp->data_end, 0, ETH_ZLEN);
+		memset(xdp->data_end, 0, min_len - (xdp->data_end - xdp->data));
+		xdp->data_end = xdp->data + min_len;
 	}
 
-	spin_lock(&ctrl->tx.tx_lock);
-	{
-		// Reclaim tx buffers
-		nc_ndp_ctrl_hdp_update(&ctrl->c);
-		nfb_xctrl_tx_free_buffers(ctrl);
-
-		free_desc = (ctrl->tx.fdp - sdp - 1) & mdp;
-
-		dma = page_pool_get_dma_addr(virt_to_page(xdp->data_hard_start)) + XDP_PACKET_HEADROOM;
-
-		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
-			if (unlikely(free_desc < 2)) {
-				printk(KERN_ERR "nfb: %s busy warning\n", __func__);
-				ret = -EBUSY;
-				goto exit_free;
-			}
+	// Here the xdp buffer is located on the ctrl.rx.xdp_ring
+	// converting buff to frame writes the metadata into XDP_PACKET_HEADROOM
+	// this frees the ctrl.rx.xdp_ring buffer to be reused
+	frame = xdp_convert_buff_to_frame(xdp);
+	if (unlikely(!frame)) {
+		// program ate the headroom reserved for frame metadata
+		nfb_xctrl_put_buff_pp(xdp, pool);
+		return -ENOMEM;
+	}
+	bulk->frames[bulk->count++] = frame;
+	return 0;
+}
 
-			last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(dma);
-			ctrl->c.last_upper_addr = last_upper_addr;
-			descs[sdp] = nc_ndp_tx_desc0(dma);
-			ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_DESC_TYPE0;
-			free_desc--;
-			sdp = (sdp + 1) & mdp;
+/**
+ * @brief Writes pp frame onto tx ring.
+ * 	Multi-buffer frames are sent as a chain of descriptors, one for each page.
+ * 
+ * @param ctrl 
+ * @param frame 
+ * @return 0 on success
+ */
+static inline int nfb_xctrl_tx_submit_frame_pp_needs_lock(struct xctrl *ctrl, struct xdp_frame *frame)
+{
+	// frame can sit in a fragment of higher order page
+	struct page *page = virt_to_head_page(frame->data);
+	u32 offset = frame->data - page_address(page);
+	u32 len = frame->len;
+	u32 free_desc;
+	u32 i, idx, nr_bufs;
+	dma_addr_t dma;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	struct skb_shared_info *sinfo = NULL;
+#endif
+
+	nr_bufs = nfb_xctrl_frame_nr_bufs(frame);
+	// worst case every piece needs a type0 descriptor
+	free_desc = (ctrl->tx.fdp - ctrl->c.sdp - 1) & ctrl->c.mdp;
+	if (unlikely(free_desc < 2 * nr_bufs))
+		return -EBUSY;
+
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	if (nr_bufs > 1)
+		sinfo = xdp_get_shared_info_from_frame(frame);
+#endif
+	for (i = 0; i < nr_bufs; i++) {
+#ifdef CONFIG_HAVE_XDP_FRAGS
+		if (i) {
+			page = skb_frag_page(&sinfo->frags[i - 1]);
+			offset = skb_frag_off(&sinfo->frags[i - 1]);
+			len = skb_frag_size(&sinfo->frags[i - 1]);
 		}
+#endif
+		dma = page_pool_get_dma_addr(page) + offset;
+		dma_sync_single_for_device(ctrl->dma_dev, dma, len, DMA_BIDIRECTIONAL);
+		idx = nfb_xctrl_tx_write_desc_needs_lock(ctrl, dma, len, i + 1 < nr_bufs);
+	}
+	// whole frame is recycled with its last piece
+	ctrl->tx.buffers[idx].type = NFB_XCTRL_BUFF_FRAME_PP;
+	ctrl->tx.buffers[idx].frame = frame;
+	return 0;
+}
 
-		if (unlikely(free_desc == 0)) {
-			printk(KERN_ERR "nfb: %s busy warning\n", __func__);
-			ret = -EBUSY;
-			goto exit_free;
-		}
+/**
+ * @brief Sends all staged XDP_TX frames with one lock and one doorbell.
+ * 	Frames which don't fit onto tx ring are returned to page pool.
+ * 
+ * @param channel 
+ * @param bulk 
+ * @param budget napi budget, used for tx reclaim
+ */
+static inline void nfb_xctrl_tx_bulk_flush_pp(struct nfb_xdp_channel *channel, struct nfb_xctrl_tx_bulk *bulk, int budget)
+{
+	struct xctrl *ctrl = channel->txq.ctrl;
+	u64 bytes = 0;
+	u32 i = 0;
 
-		ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_FRAME_PP;
-		// Here the xdp buffer is located on the ctrl.rx.xdp_ring
-		// converting buff to frame writes the metadata into XDP_PACKET_HEADROOM
-		// this frees the ctrl.rx.xdp_ring buffer to be reused
-		ctrl->tx.buffers[sdp].frame = xdp_convert_buff_to_frame(xdp);
-		descs[sdp] = nc_ndp_tx_desc2(dma, len, 0, 0);
-		dma_sync_single_for_device(ctrl->dma_dev, dma, len, DMA_BIDIRECTIONAL);
-		sdp = (sdp + 1) & mdp;
+	if (!bulk->count)
+		return;
 
-		// update ctrl
-		ctrl->c.sdp = sdp;
+	spin_lock(&ctrl->tx.tx_lock);
+	{
+		// Reclaim tx buffers
+		nc_ndp_ctrl_hdp_update(&ctrl->c);
+		nfb_xctrl_tx_free_buffers(ctrl, budget);
 
-exit_free:
-		if (unlikely(ret)) {
-			// xdp_return_buff definition is missing in 4.18.0-477.10.1.el8_8.x86_64
-			// xdp_return_buff(xdp);
-			xdp_return_frame(xdp_convert_buff_to_frame(xdp));
+		for (i = 0; i < bulk->count; i++) {
+			if (unlikely(nfb_xctrl_tx_submit_frame_pp_needs_lock(ctrl, bulk->frames[i])))
+				break;
+			bytes += nfb_xctrl_frame_len(bulk->frames[i]);
 		}
 
 		// flush counters when done
 		nc_ndp_ctrl_sdp_flush(&ctrl->c);
+		nfb_xdp_tx_stats_add(&channel->tx_stats, &channel->tx_syncp, i, bytes, bulk->count - i);
 	}
 	spin_unlock(&ctrl->tx.tx_lock);
-	return ret;
+
+	// frames which didn't fit are counted as ring_full
+	if (unlikely(i != bulk->count)) {
+		for (; i < bulk->count; i++)
+			xdp_return_frame_rx_napi(bulk->frames[i]);
+	}
+	bulk->count = 0;
+}
+
+/**
+ * @brief Allocates one rx buffer from the page pool, whole page or its fragment.
+ * 
+ * @param ctrl 
+ * @param dma dma address of the buffer start
+ * @return start of the buffer, NULL on fail
+ */
+static inline void *nfb_xctrl_rx_alloc_pp(struct xctrl *ctrl, dma_addr_t *dma)
+{
+	struct page_pool *pool = ctrl->rx.pp.pool;
+	struct page *page;
+	unsigned int offset = 0;
+
+#ifdef CONFIG_HAVE_PAGE_POOL_DEV_ALLOC_FRAG
+	if (ctrl->rx.frag_size != PAGE_SIZE)
+		page = page_pool_dev_alloc_frag(pool, &offset, ctrl->rx.frag_size);
+	else
+#endif
+		page = page_pool_dev_alloc_pages(pool);
+	if (unlikely(!page))
+		return NULL;
+
+	*dma = page_pool_get_dma_addr(page) + offset;
+	return page_address(page) + offset;
+}
+
+/**
+ * @brief Syncs received part of rx buffer for cpu, the rest of the page is left alone.
+ * 
+ * @param ctrl 
+ * @param hard_start start of the buffer
+ * @param len received data length
+ * @return head page of the buffer
+ */
+static inline struct page *nfb_xctrl_rx_sync_pp(struct xctrl *ctrl, void *hard_start, u32 len)
+{
+	struct page *page = virt_to_head_page(hard_start);
+
+	dma_sync_single_range_for_cpu(ctrl->dma_dev, page_pool_get_dma_addr(page), hard_start - page_address(page),
+			XDP_PACKET_HEADROOM + len, DMA_BIDIRECTIONAL);
+	return page;
 }
 
 /**
  * @brief Page pool operation to fill card with rx descriptors.
  * 
  * @param ctrl 
- * @param pool struct page_pool
+ * @param stats allocation failures are counted here
  * @return int number of descriptors fileld
  */
-static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl)
+static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl, struct nfb_xdp_rx_stats *stats)
 {
 	const u32 batch_size = NFB_XDP_CTRL_PACKET_BURST;
 
@@ -120,9 +235,9 @@ static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl)
 	u32 php = ctrl->rx.php;
 
 	// NOTE: XDP should have reserved tailroom for passing the page to the network stack
-	const u32 frame_len = PAGE_SIZE - SKB_DATA_ALIGN(XDP_PACKET_HEADROOM + sizeof(struct skb_shared_info));
+	const u32 frame_len = ctrl->rx.buf_len;
 	struct page_pool *pool = ctrl->rx.pp.pool;
-	struct page *page;
+	void *va;
 	dma_addr_t dma;
 	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
 	u32 free_desc, free_hdrs;
@@ -130,21 +245,22 @@ static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl)
 
 	// Check if refill needed
 	nc_ndp_ctrl_hdp_update(&ctrl->c);
-	free_hdrs = (ctrl->c.shp - php - 1) & mhp;
+	// one frame can span more buffers, so the ring is bounded by the received buffers, not headers
+	free_hdrs = (ctrl->rx.cbp - php - 1) & mhp;
 	free_desc = (ctrl->c.hdp - sdp - 1) & mdp;
 	if (free_hdrs < batch_size || free_desc < batch_size)
 		return 0;
 
 	// Alloc buffers and send them to card
 	for (i = 0; i < batch_size; i++) {
-		if (!(page = page_pool_dev_alloc_pages(pool))) {
-			printk(KERN_WARNING "nfb: failed to allocate page from page pool\n");
+		if (!(va = nfb_xctrl_rx_alloc_pp(ctrl, &dma))) {
+			stats->alloc_fail++;
 			break;
 		}
-		dma = page_pool_get_dma_addr(page) + XDP_PACKET_HEADROOM;
+		dma += XDP_PACKET_HEADROOM;
 		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
 			if (unlikely(free_desc == 0)) {
-				page_pool_put_full_page(pool, page, false);
+				page_pool_put_full_page(pool, virt_to_head_page(va), false);
 				break;
 			}
 			last_upper_addr = NDP_CTRL_DESC_UPPER_ADDR(dma);
@@ -154,11 +270,11 @@ static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl)
 			free_desc--;
 		}
 		if (unlikely(free_desc == 0)) {
-			page_pool_put_full_page(pool, page, false);
+			page_pool_put_full_page(pool, virt_to_head_page(va), false);
 			break;
 		}
-		xdp_init_buff(ctrl->rx.pp.xdp_ring[php], PAGE_SIZE, &ctrl->rx.rxq_info);
-		xdp_prepare_buff(ctrl->rx.pp.xdp_ring[php], page_to_virt(page), XDP_PACKET_HEADROOM, 0, false);
+		xdp_init_buff(ctrl->rx.pp.xdp_ring[php], ctrl->rx.frag_size, &ctrl->rx.rxq_info);
+		xdp_prepare_buff(ctrl->rx.pp.xdp_ring[php], va, XDP_PACKET_HEADROOM, 0, true);
 		descs[sdp] = nc_ndp_rx_desc2(dma, frame_len, 0);
 		sdp = (sdp + 1) & mdp;
 		php = (php + 1) & mhp;
@@ -172,25 +288,95 @@ static inline int nfb_xctrl_rx_fill_pp(struct xctrl *ctrl)
 	return i;
 }
 
+/**
+ * @brief Builds skb around page pool buffer of XDP_PASS frame without copy.
+ * 	Pages are returned to the page pool when the stack frees the skb.
+ * 
+ * @param xdp 
+ * @param netdev 
+ * @return skb or NULL, the buffer is left untouched on fail
+ */
+static inline struct sk_buff *nfb_xctrl_build_skb_pp(struct xdp_buff *xdp, struct net_device *netdev)
+{
+#ifdef CONFIG_HAVE_SKB_MARK_FOR_RECYCLE
+	u32 metasize = xdp->data - xdp->data_meta;
+	struct sk_buff *skb;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	struct skb_shared_info *sinfo;
+	u32 nr_frags = 0, frags_size = 0, frags_truesize = 0;
+
+	// build_skb clears the shared info
+	if (unlikely(xdp_buff_has_frags(xdp))) {
+		sinfo = xdp_get_shared_info_from_buff(xdp);
+		nr_frags = sinfo->nr_frags;
+		frags_size = sinfo->xdp_frags_size;
+		frags_truesize = sinfo->xdp_frags_truesize;
+	}
+#endif
+
+	skb = napi_build_skb(xdp->data_hard_start, xdp->frame_sz);
+	if (unlikely(!skb))
+		return NULL;
+
+	skb_reserve(skb, xdp->data - xdp->data_hard_start);
+	__skb_put(skb, xdp->data_end - xdp->data);
+	if (metasize)
+		skb_metadata_set(skb, metasize);
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	if (unlikely(nr_frags))
+		xdp_update_skb_shared_info(skb, nr_frags, frags_size, frags_truesize, xdp_buff_is_frag_pfmemalloc(xdp));
+#endif
+	skb_mark_for_recycle(skb);
+	skb->protocol = eth_type_trans(skb, netdev);
+	nfb_xctrl_skb_set_meta(skb, xdp);
+	return skb;
+#else
+	struct xdp_frame *frame;
+	struct sk_buff *skb;
+
+	frame = xdp_convert_buff_to_frame(xdp);
+	if (unlikely(!frame)) {
+		// program ate the headroom reserved for frame metadata
+		return NULL;
+	}
+	// older kernels release the pages from the page pool when converting to skb
+	skb = xdp_build_skb_from_frame(frame, netdev);
+	if (likely(skb))
+		nfb_xctrl_skb_set_meta(skb, xdp);
+	return skb;
+#endif
+}
+
 /**
  * @brief XDP handler
  * 
- * @param prog 
+ * @param xdp_prog program of the queue, dereferenced by the napi
  * @param xdp 
  * @param rxq 
+ * @param tx_bulk XDP_TX frames are staged here
+ * @param stats verdicts are counted here
  * @return result
  */
-static inline void nfb_xctrl_handle_pp(struct bpf_prog *prog, struct xdp_buff *xdp, struct nfb_xdp_queue *rxq)
+static inline void nfb_xctrl_handle_pp(struct bpf_prog *xdp_prog, struct xdp_buff *xdp, struct nfb_xdp_queue *rxq,
+		struct nfb_xctrl_tx_bulk *tx_bulk, struct nfb_xdp_rx_stats *stats)
 {
 	unsigned act;
 	int ret;
-	struct bpf_prog *xdp_prog;
 	struct nfb_xdp_channel *channel = container_of(rxq, struct nfb_xdp_channel, rxq);
 	struct nfb_ethdev *ethdev = channel->ethdev;
 	struct sk_buff *skb;
 
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	// the MAC limit follows the MTU checked against the program, this catches
+	// frames received before the limit was lowered or a program swapped in between
+	if (unlikely(xdp_prog && xdp_buff_has_frags(xdp) && !xdp_prog->aux->xdp_has_frags)) {
+		nfb_xctrl_put_buff_pp(xdp, rxq->ctrl->rx.pp.pool);
+		stats->dropped++;
+		return;
+	}
+#endif
+
 	rcu_read_lock();
-	xdp_prog = rcu_dereference(prog);
 	if (xdp_prog) {
 		act = bpf_prog_run_xdp(xdp_prog, xdp);
 	} else {
@@ -199,68 +385,123 @@ static inline void nfb_xctrl_handle_pp(struct bpf_prog *prog, struct xdp_buff *x
 
 	switch (act) {
 	case XDP_PASS:
-		// NOTE: This function does a lot of things internally, check it's implementation
-		// if you ever want to add support for fragmented packets
-		skb = xdp_build_skb_from_frame(xdp_convert_buff_to_frame(xdp), ethdev->netdev);
-		if (IS_ERR_OR_NULL(skb)) {
-			printk(KERN_DEBUG "SKB build failed\n");
+		skb = nfb_xctrl_build_skb_pp(xdp, ethdev->netdev);
+		if (unlikely(!skb)) {
 			goto aborted;
 		}
 		// receive packet onto queue it arriverd on
 		skb_record_rx_queue(skb, channel->index);
-		// TODO: gro_receive is supposed to be a free
-		// 		performance boost but it is quite bad for
-		//		debugging because you cannot check if all packet
-		//		received are the same as sent
-		// napi_gro_receive(napi, skb);
-		// Send packet to the kernel network stack, it will be freed via xdp_return_frame
-		netif_receive_skb(skb);
-		// TODO: future extension
-		// if (netif_receive_skb(skb) != NET_RX_DROP) {
-		// 	ctrl.stats = ...
-		// } else {
-		// 	ctrl.stats = ...
-		// }
+		// GRO batches the skbs and delivers them as a list at the end of napi poll,
+		// use ethtool -K <if> gro off to see every packet as received
+		napi_gro_receive(&rxq->napi_pp, skb);
+		stats->xdp_pass++;
 		break;
 	case XDP_TX:
-		// returned via xdp_return_frame on tx reclaim;
-		nfb_xctrl_rexmit_pp(channel->txq.ctrl, xdp);
+		// sent at the end of napi poll, returned via xdp_return_frame on tx reclaim;
+		if (unlikely(nfb_xctrl_tx_bulk_add_pp(tx_bulk, xdp, rxq->ctrl->rx.pp.pool))) {
+			// buffer is already back in the pool
+			stats->xdp_aborted++;
+			break;
+		}
+		stats->xdp_tx++;
 		break;
 	case XDP_REDIRECT:
 		// redirected packet is internally returned via xdp_return_frame
 		ret = xdp_do_redirect(ethdev->netdev, xdp, xdp_prog);
 		if (unlikely(ret)) {
-			printk(KERN_INFO "nfb: xdp_do_redirect error ret: %d, maybe RX cannot keep up.\n", ret);
-			goto aborted;
+			stats->redirect_err++;
+			goto drop;
 		}
+		stats->xdp_redirect++;
 		break;
 	default:
 		fallthrough;
 	case XDP_ABORTED:
 aborted:
-		printk(KERN_ERR "nfb: %s packet aborted\n", __func__);
-		fallthrough;
+		stats->xdp_aborted++;
+		goto drop;
 	case XDP_DROP:
+		stats->xdp_drop++;
+drop:
 		// TODO: add this into autoconf
 		// xdp_return_buff definition is missing in 4.18.0-477.10.1.el8_8.x86_64
 		// xdp_return_buff(xdp);
-		xdp_return_frame(xdp_convert_buff_to_frame(xdp));
+		// we are in the napi owning the page pool so the page can go directly to pool cache,
+		// the buffer is not converted as the program may have eaten the frame headroom
+		nfb_xctrl_put_buff_pp(xdp, rxq->ctrl->rx.pp.pool);
 		break;
 	}
 	rcu_read_unlock();
 }
 
-static inline u16 nfb_xctrl_rx_pp(struct xctrl *ctrl, struct xdp_buff **buffs, u16 nb_pkts)
+/**
+ * @brief Attaches the following buffers of a frame as xdp frags.
+ * 	The controller continues with the next descriptor when frame doesn't fit into one buffer.
+ * 	When the frame cannot be assembled all of its buffers are returned to the page pool.
+ * 
+ * @param ctrl 
+ * @param xdp head buffer
+ * @param remaining length of the frame not in the head buffer
+ * @param cbp consumed buffer pointer, moved past the frame
+ * @return 0 on success
+ */
+static inline int nfb_xctrl_rx_frags_pp(struct xctrl *ctrl, struct xdp_buff *xdp, u32 remaining, u32 *cbp)
+{
+	struct page_pool *pool = ctrl->rx.pp.pool;
+	struct page *page;
+	void *hard_start;
+	u32 len;
+	int ret = 0;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	struct skb_shared_info *sinfo = xdp_get_shared_info_from_buff(xdp);
+
+	sinfo->nr_frags = 0;
+	sinfo->xdp_frags_size = 0;
+	sinfo->xdp_frags_truesize = 0;
+	xdp_buff_set_frags_flag(xdp);
+#endif
+
+	while (remaining) {
+		hard_start = ctrl->rx.pp.xdp_ring[*cbp]->data_hard_start;
+		page = virt_to_head_page(hard_start);
+		*cbp = (*cbp + 1) & ctrl->c.mhp;
+		len = min(remaining, ctrl->rx.buf_len);
+		remaining -= len;
+#ifdef CONFIG_HAVE_XDP_FRAGS
+		if (likely(!ret && sinfo->nr_frags < MAX_SKB_FRAGS)) {
+			nfb_xctrl_rx_sync_pp(ctrl, hard_start, len);
+			nfb_xctrl_frag_fill(&sinfo->frags[sinfo->nr_frags++], page,
+					hard_start - page_address(page) + XDP_PACKET_HEADROOM, len);
+			sinfo->xdp_frags_size += len;
+			sinfo->xdp_frags_truesize += ctrl->rx.frag_size;
+			continue;
+		}
+#endif
+		page_pool_put_full_page(pool, page, true);
+		ret = -EMSGSIZE;
+	}
+
+	if (unlikely(ret)) {
+		// returns the head buffer together with the already attached frags
+		nfb_xctrl_put_buff_pp(xdp, pool);
+	}
+	return ret;
+}
+
+static inline u16 nfb_xctrl_rx_pp(struct xctrl *ctrl, struct xdp_buff **buffs, u16 nb_pkts, struct nfb_xdp_rx_stats *stats)
 {
 	struct nc_ndp_hdr *hdrs = ctrl->rx.hdr_buffer_cpu;
 	struct nc_ndp_hdr *hdr;
-	u32 i;
-	u16 nb_rx;
+	struct xdp_buff *xdp;
+	u32 i, len;
+	u16 nb_rx, cnt = 0;
 	u32 shp = ctrl->c.shp;
 	u32 mhp = ctrl->c.mhp;
+	u32 cbp = ctrl->rx.cbp;
+	u32 buf_len = ctrl->rx.buf_len;
 
 	// fill the card with empty buffers
-	while (nfb_xctrl_rx_fill_pp(ctrl))
+	while (nfb_xctrl_rx_fill_pp(ctrl, stats))
 		;
 	nc_ndp_ctrl_sdp_flush(&ctrl->c);
 
@@ -273,41 +514,65 @@ static inline u16 nfb_xctrl_rx_pp(struct xctrl *ctrl, struct xdp_buff **buffs, u
 	// ready packets for receive
 	for (i = 0; i < nb_rx; ++i) {
 		hdr = &hdrs[shp];
-		buffs[i] = ctrl->rx.pp.xdp_ring[shp];
-		dma_sync_single_for_cpu(ctrl->dma_dev, page_pool_get_dma_addr(virt_to_page(buffs[i]->data_hard_start)), PAGE_SIZE, DMA_BIDIRECTIONAL);
-		buffs[i]->data_end = buffs[i]->data + hdr->frame_len;
-		// NOTE: Right now fragmented buffers are not supported
-		// Setting this is important if SKB is to be built from pagepool page without copying
-		// xdp_get_shared_info_from_buff(buffs[i])->nr_frags = 0;
+		xdp = ctrl->rx.pp.xdp_ring[cbp];
+		cbp = (cbp + 1) & mhp;
 		shp = (shp + 1) & mhp;
+		len = min_t(u32, hdr->frame_len, buf_len);
+		nfb_xctrl_rx_sync_pp(ctrl, xdp->data_hard_start, len);
+		xdp->data_end = xdp->data + len;
+		nfb_xctrl_rx_meta(ctrl, xdp, hdr->hdr_len);
+		stats->packets++;
+		stats->bytes += hdr->frame_len;
+		if (unlikely(hdr->frame_len > buf_len)) {
+			// frame continues in the following buffers
+			if (nfb_xctrl_rx_frags_pp(ctrl, xdp, hdr->frame_len - buf_len, &cbp)) {
+				stats->dropped++;
+				continue;
+			}
+		}
+		buffs[cnt++] = xdp;
 	}
 
 	// update ctrl state
 	ctrl->c.shp = shp;
+	ctrl->rx.cbp = cbp;
 
-	return nb_rx;
+	return cnt;
 }
 
 int nfb_xctrl_napi_poll_pp(struct napi_struct *napi, int budget)
 {
 	struct nfb_xdp_queue *rxq = container_of(napi, struct nfb_xdp_queue, napi_pp);
 	struct xctrl *ctrl = rxq->ctrl;
-	struct net_device *netdev = napi->dev;
-	struct nfb_ethdev *ethdev = netdev_priv(netdev);
-	unsigned received, i = 0;
+	struct nfb_xdp_channel *channel = container_of(rxq, struct nfb_xdp_channel, rxq);
+	struct bpf_prog *prog;
+	unsigned received, work, i = 0;
 	struct xdp_buff *xdp[NAPI_POLL_WEIGHT];
+	struct nfb_xctrl_tx_bulk tx_bulk;
+	struct nfb_xdp_rx_stats stats = {};
 
-	if (unlikely(budget > NAPI_POLL_WEIGHT)) {
-		printk(KERN_ERR "nfb: NAPI budget is bigger than weight. This is a driver bug.\n");
-		BUG();
-	}
+	// busy polling sockets pass sk_busy_poll_budget, which can exceed the weight
+	// the on-stack arrays are sized for; the caller polls again for the rest
+	budget = min(budget, NAPI_POLL_WEIGHT);
 
-	received = nfb_xctrl_rx_pp(ctrl, xdp, budget);
+	tx_bulk.count = 0;
+	received = nfb_xctrl_rx_pp(ctrl, xdp, budget, &stats);
+	rcu_read_lock();
+	prog = rcu_dereference(rxq->prog);
 	for (i = 0; i < received; i++) {
-		nfb_xctrl_handle_pp(ethdev->prog, xdp[i], rxq);
+		nfb_xctrl_handle_pp(prog, xdp[i], rxq, &tx_bulk, &stats);
 	}
+	rcu_read_unlock();
+	// send XDP_TX frames with single doorbell
+	nfb_xctrl_tx_bulk_flush_pp(channel, &tx_bulk, budget);
+	nfb_xdp_rx_stats_add(channel, &stats);
 	// flush sdp and shp after software processing is done
 	nc_ndp_ctrl_sp_flush(&ctrl->c);
+	// tx completion, page pool mode has no tx napi
+	// reclaimed completions count as traffic, tx in flight doesn't, the card may never complete it
+	work = received + !!nfb_xctrl_tx_reclaim(channel->txq.ctrl, budget);
+	// let the queue thread know there is traffic
+	WRITE_ONCE(rxq->poll_work, rxq->poll_work + work);
 
 	// Flushes redirect maps
 	xdp_do_flush();
@@ -316,53 +581,97 @@ int nfb_xctrl_napi_poll_pp(struct napi_struct *napi, int budget)
 	if (received == budget)
 		return budget;
 
-	// Work done -> finish
-	napi_complete_done(napi, received);
+	// Work done -> finish, native timer stays short while completions come in
+	channel_napi_complete(channel, rxq, napi, work);
 	return received;
 }
 
-// TODO: asynchronous stopping (waiting synchronously for timeout is terrible)
-static void nfb_xctrl_stop_pp(struct xctrl *ctrl)
+/**
+ * @brief Returns buffers of received frames to the page pool
+ * 
+ * @param ctrl 
+ * @param count number of headers
+ */
+static void nfb_xctrl_rx_drop_pp(struct xctrl *ctrl, u32 count)
+{
+	struct nc_ndp_hdr *hdrs = ctrl->rx.hdr_buffer_cpu;
+	u32 shp = ctrl->c.shp;
+	u32 mhp = ctrl->c.mhp;
+	u32 cbp = ctrl->rx.cbp;
+	u32 i, nr_bufs;
+
+	for (i = 0; i < count; ++i) {
+		nr_bufs = max(1u, DIV_ROUND_UP((u32)hdrs[shp].frame_len, ctrl->rx.buf_len));
+		while (nr_bufs--) {
+			page_pool_put_full_page(ctrl->rx.pp.pool, virt_to_head_page(ctrl->rx.pp.xdp_ring[cbp]->data_hard_start), false);
+			cbp = (cbp + 1) & mhp;
+		}
+		shp = (shp + 1) & mhp;
+	}
+	ctrl->c.shp = shp;
+	ctrl->rx.cbp = cbp;
+}
+
+/**
+ * @brief One attempt to stop the controller, run from the stop work.
+ * 	Frames the card still delivers on rx are dropped so the controller can drain.
+ *
+ * @param ctrl
+ * @return 0 when stopped, -EAGAIN or -EINPROGRESS to try again
+ */
+static int nfb_xctrl_stop_step_pp(struct xctrl *ctrl)
 {
-	int cnt, i = 0;
 	int err;
 	u32 count;
-	u32 shp = ctrl->c.shp;
-	u32 mhp = ctrl->c.mhp;
 	u32 status;
 
-	do {
-		status = nfb_comp_read32(ctrl->c.comp, NDP_CTRL_REG_STATUS);
-		if (status & NDP_CTRL_REG_STATUS_RUNNING) {
-			err = nc_ndp_ctrl_stop(&ctrl->c);
-			if (err != -EAGAIN && err != -EINPROGRESS)
-				break;
+	status = nfb_comp_read32(ctrl->c.comp, NDP_CTRL_REG_STATUS);
+	if (!(status & NDP_CTRL_REG_STATUS_RUNNING))
+		return 0;
 
-			if (ctrl->type == NFB_XCTRL_RX) {
-				// receive packets from card and try again
-				nc_ndp_ctrl_hhp_update(&ctrl->c);
-				count = (ctrl->c.hhp - shp) & mhp;
-				for (i = 0; i < count; ++i) {
-					// Returns pages to page_pool
-					// xdp_return_buff definition is missing in 4.18.0-477.10.1.el8_8.x86_64
-					// xdp_return_buff(ctrl->rx.pp.xdp_ring[shp]);
-					xdp_return_frame(xdp_convert_buff_to_frame(ctrl->rx.pp.xdp_ring[shp]));
-					shp = (shp + 1) & mhp;
-				}
-				ctrl->c.shp = shp;
-				nc_ndp_ctrl_sp_flush(&ctrl->c);
-				err = nc_ndp_ctrl_stop(&ctrl->c);
-				if (err != -EAGAIN && err != -EINPROGRESS)
-					break;
+	err = nc_ndp_ctrl_stop(&ctrl->c);
+	if (err != -EAGAIN && err != -EINPROGRESS)
+		return err;
+
+	if (ctrl->type == NFB_XCTRL_RX) {
+		// receive packets from card and try again
+		nc_ndp_ctrl_hhp_update(&ctrl->c);
+		count = (ctrl->c.hhp - ctrl->c.shp) & ctrl->c.mhp;
+		nfb_xctrl_rx_drop_pp(ctrl, count);
+		nc_ndp_ctrl_sp_flush(&ctrl->c);
+		err = nc_ndp_ctrl_stop(&ctrl->c);
+	}
+	return err;
+}
+
+/**
+ * @brief Chooses truesize of the rx buffers.
+ * 	In frag mode the buffers are sized to the MTU and carved from the pool pages,
+ * 	the mode is used only when it takes less memory than a page per buffer.
+ * 
+ * @param netdev 
+ * @param order page order of the pool
+ * @return truesize of one rx buffer, PAGE_SIZE when each buffer has whole page
+ */
+static u32 nfb_xctrl_rx_frag_size_pp(struct net_device *netdev, u32 *order)
+{
+#ifdef CONFIG_HAVE_PAGE_POOL_DEV_ALLOC_FRAG
+	u32 size = SKB_DATA_ALIGN(netdev->mtu + ETH_HLEN + VLAN_HLEN + ETH_FCS_LEN) + NFB_XDP_PP_BUF_RESERVE;
+	u32 o, n;
+
+	if (nfb_xdp_rx_frag) {
+		for (o = 0; o <= NFB_XDP_PP_FRAG_ORDER_MAX; o++) {
+			n = (PAGE_SIZE << o) / size;
+			if (n > (1u << o)) {
+				*order = o;
+				// spread the leftover space among the buffers
+				return ALIGN_DOWN((PAGE_SIZE << o) / n, SMP_CACHE_BYTES);
 			}
-			mdelay(1);
 		}
-	} while (cnt++ < 100);
-
-	if (err) {
-		err = nc_ndp_ctrl_stop_force(&ctrl->c);
-		printk("nfb: queue id %u didn't stop in 100 msecs; Force stopping dma ctrl; This might damage firmware.\n", ctrl->nfb_queue_id);
 	}
+#endif
+	*order = 0;
+	return PAGE_SIZE;
 }
 
 struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 desc_cnt, enum xdp_ctrl_type type)
@@ -374,11 +683,12 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 	struct xctrl *ctrl;
 	int fdt_offset;
 	u32 i;
-	struct xdp_buff *buffs;
+	struct nfb_xdp_buff *buffs;
+	u32 order = 0;
 
 	struct page_pool_params ppp = {
 		.flags = PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV,
-		.dev = &nfb->pci->dev,
+		.dev = nfb->dma_dev,
 		.dma_dir = DMA_BIDIRECTIONAL,
 		.max_len = PAGE_SIZE,
 		.offset = 0,
@@ -395,7 +705,7 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 		break;
 	case NFB_XCTRL_TX:
 		queue = &channel->txq;
-		fdt_offset = nfb_comp_find(nfb, "netcope,dma_ctrl_ndp_tx", channel->nfb_index);
+		fdt_offset = nfb_comp_find(nfb, "netcope,dma_ctrl_ndp_tx", channel->nfb_tx_index);
 		break;
 	default:
 		err = -EINVAL;
@@ -418,17 +728,21 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 	ctrl->type = type;
 	ctrl->nfb_queue_id = channel->nfb_index;
 	ctrl->netdev_queue_id = channel->index;
-	ctrl->dma_dev = &nfb->pci->dev;
+	ctrl->dma_dev = nfb->dma_dev;
 	ctrl->nb_desc = desc_cnt;
+	nfb_xctrl_init_stop(ctrl, nfb_xctrl_stop_step_pp);
 
 	// Allocating control buffers
 	switch (type) {
 	case NFB_XCTRL_RX:
+		ctrl->rx.frag_size = nfb_xctrl_rx_frag_size_pp(netdev, &order);
+		ctrl->rx.buf_len = ctrl->rx.frag_size - NFB_XDP_PP_BUF_RESERVE;
+		nfb_xctrl_rx_meta_init(ctrl);
 		if (!(ctrl->rx.pp.xdp_ring = kzalloc_node(sizeof(struct xdp_buff *) * desc_cnt, GFP_KERNEL, channel->numa))) {
 			err = -ENOMEM;
 			goto buff_alloc_fail;
 		}
-		if (!(buffs = kzalloc_node(sizeof(struct xdp_buff) * desc_cnt, GFP_KERNEL, channel->numa))) {
+		if (!(buffs = kzalloc_node(sizeof(struct nfb_xdp_buff) * desc_cnt, GFP_KERNEL, channel->numa))) {
 			err = -ENOMEM;
 			goto buffs_alloc_fail;
 		}
@@ -439,6 +753,7 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 			err = -ENOMEM;
 			goto buff_alloc_fail;
 		}
+		ctrl->tx.ndq = netdev_get_tx_queue(netdev, channel->index);
 		break;
 	default:
 		err = -EINVAL;
@@ -466,6 +781,12 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 
 	// creating page pool and info
 	if (type == NFB_XCTRL_RX) {
+		ppp.order = order;
+		ppp.max_len = PAGE_SIZE << order;
+#ifdef PP_FLAG_PAGE_FRAG
+		if (ctrl->rx.frag_size != PAGE_SIZE)
+			ppp.flags |= PP_FLAG_PAGE_FRAG;
+#endif
 		if (!(ctrl->rx.pp.pool = page_pool_create(&ppp))) {
 			printk(KERN_ERR "nfb: Failed to create pagepool\n");
 			err = -ENOMEM;
@@ -481,7 +802,7 @@ struct xctrl *nfb_xctrl_alloc_pp(struct net_device *netdev, u32 queue_id, u32 de
 		}
 
 		for (i = 0; i < desc_cnt; i++) {
-			ctrl->rx.pp.xdp_ring[i] = &buffs[i];
+			ctrl->rx.pp.xdp_ring[i] = &buffs[i].xdp;
 		}
 	}
 
@@ -533,17 +854,84 @@ fdt_offset_fail:
 	return NULL;
 }
 
-void nfb_xctrl_destroy_pp(struct xctrl *ctrl)
+struct xctrl *nfb_xctrl_alloc_xmit(struct net_device *netdev, u32 nfb_queue_id, u32 desc_cnt)
 {
-	if (test_bit(XCTRL_STATUS_IS_RUNNING, &ctrl->status)) {
-		nfb_xctrl_stop_pp(ctrl);
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	struct nfb_device *nfb = ethdev->nfb;
+	int numa = dev_to_node(nfb->dma_dev);
+	struct xctrl *ctrl;
+	int fdt_offset;
+	int err;
+
+	fdt_offset = nfb_comp_find(nfb, "netcope,dma_ctrl_ndp_tx", nfb_queue_id);
+	if (fdt_offset < 0) {
+		err = -ENODEV;
+		goto fdt_offset_fail;
+	}
+
+	if (!(ctrl = kzalloc_node(sizeof(struct xctrl), GFP_KERNEL, numa))) {
+		err = -ENOMEM;
+		goto ctrl_alloc_fail;
+	}
+
+	ctrl->type = NFB_XCTRL_TX;
+	ctrl->nfb_queue_id = nfb_queue_id;
+	ctrl->netdev_queue_id = -1; // not exposed as netdev queue
+	ctrl->dma_dev = nfb->dma_dev;
+	ctrl->nb_desc = desc_cnt;
+	nfb_xctrl_init_stop(ctrl, nfb_xctrl_stop_step_pp);
+
+	spin_lock_init(&ctrl->tx.tx_lock);
+	if (!(ctrl->tx.buffers = kzalloc_node(sizeof(struct xctrl_tx_buffer) * desc_cnt, GFP_KERNEL, numa))) {
+		err = -ENOMEM;
+		goto buff_alloc_fail;
 	}
+
+	if (!(ctrl->desc_buffer_virt = dma_alloc_coherent(ctrl->dma_dev, ctrl->nb_desc * sizeof(struct nc_ndp_desc), &ctrl->desc_buffer_dma, GFP_KERNEL))) {
+		err = -ENOMEM;
+		goto dma_data_fail;
+	}
+	if (!(ctrl->update_buffer_virt = dma_alloc_coherent(ctrl->dma_dev, sizeof(u32) * 2, &ctrl->update_buffer_dma, GFP_KERNEL))) {
+		err = -ENOMEM;
+		goto dma_update_fail;
+	}
+
+	if ((err = nc_ndp_ctrl_open(nfb, fdt_offset, &ctrl->c))) {
+		goto ndp_ctrl_open_fail;
+	}
+
+	return ctrl;
+
+ndp_ctrl_open_fail:
+	dma_free_coherent(ctrl->dma_dev, sizeof(u32) * 2, ctrl->update_buffer_virt, ctrl->update_buffer_dma);
+dma_update_fail:
+	dma_free_coherent(ctrl->dma_dev, ctrl->nb_desc * sizeof(struct nc_ndp_desc), ctrl->desc_buffer_virt, ctrl->desc_buffer_dma);
+dma_data_fail:
+	kfree(ctrl->tx.buffers);
+buff_alloc_fail:
+	kfree(ctrl);
+ctrl_alloc_fail:
+fdt_offset_fail:
+	printk(KERN_ERR "nfb: Error opening xdp xmit dma ctrl on queue %d; %d", nfb_queue_id, err);
+	return NULL;
+}
+
+void nfb_xctrl_destroy_pp(struct xctrl *ctrl)
+{
+	// no-op when the caller already started the stop
+	nfb_xctrl_stop_async(ctrl);
+	nfb_xctrl_stop_wait(ctrl);
 	nc_ndp_ctrl_close(&ctrl->c);
 	dma_free_coherent(ctrl->dma_dev, ctrl->nb_desc * sizeof(struct nc_ndp_desc), ctrl->desc_buffer_virt, ctrl->desc_buffer_dma);
 	dma_free_coherent(ctrl->dma_dev, sizeof(u32) * 2, ctrl->update_buffer_virt, ctrl->update_buffer_dma);
 	switch (ctrl->type) {
 	case NFB_XCTRL_RX:
 		dma_free_coherent(ctrl->dma_dev, ctrl->rx.nb_hdr * sizeof(struct nc_ndp_hdr), ctrl->rx.hdr_buffer_cpu, ctrl->rx.hdr_buffer_dma);
+		// return buffers the card didn't fill
+		while (ctrl->rx.cbp != ctrl->rx.php) {
+			page_pool_put_full_page(ctrl->rx.pp.pool, virt_to_head_page(ctrl->rx.pp.xdp_ring[ctrl->rx.cbp]->data_hard_start), false);
+			ctrl->rx.cbp = (ctrl->rx.cbp + 1) & ctrl->c.mhp;
+		}
 		// Unreg_mem_model calls page_pool_destroy internally
 		// page_pool_destroy(ctrl->rx.pp.pool);
 		xdp_rxq_info_unreg_mem_model(&ctrl->rx.rxq_info);
@@ -552,9 +940,10 @@ void nfb_xctrl_destroy_pp(struct xctrl *ctrl)
 		kfree(ctrl->rx.pp.xdp_ring);
 		break;
 	case NFB_XCTRL_TX:
-		// free all enqueued tx buffers
+		// free all enqueued tx buffers, BQL is reset when the queue starts again
+		ctrl->tx.ndq = NULL;
 		ctrl->c.hdp = ctrl->c.sdp;
-		nfb_xctrl_tx_free_buffers(ctrl);
+		nfb_xctrl_tx_free_buffers(ctrl, 0);
 		kfree(ctrl->tx.buffers);
 		break;
 	default:
@@ -11,42 +11,125 @@
 #include "ctrl_xdp_common.h"
 #include <linux/pci.h>
 
-// NOTE: This is not zero copy operation, the correct way to rexmit a frame
-//		 in XSK mode is through the userspace from RX ring to TX ring.
+// XDP_TX buffers staged during one napi poll
+struct nfb_xctrl_xsk_tx_bulk {
+	u32 count;
+	struct xdp_buff *buffs[NAPI_POLL_WEIGHT];
+};
+
+/**
+ * @brief Checks the buffer can be described by single data descriptor.
+ * 	Data descriptor holds only the lower address bits, the upper part comes from the last type0 descriptor.
+ * 	Page sized aligned chunks never cross the boundary, unaligned chunks of a hugepage umem can.
+ *
+ * @param dma
+ * @param len
+ * @return true if the whole buffer shares the upper address bits
+ */
+static inline bool nfb_xctrl_xsk_dma_ok(dma_addr_t dma, u32 len)
+{
+	return NDP_CTRL_DESC_UPPER_ADDR(dma) == NDP_CTRL_DESC_UPPER_ADDR(dma + len - 1);
+}
+
 /**
- * @brief Tries to rexmit xsk buffer. Frees buffer on fail via xdp_return_frame();
+ * @brief Returns completed XDP_TX buffers to the xsk pool, they are reused for rx fill.
+ * 	Must be called from the rx napi of the channel, the pool isn't thread safe.
  * 
- * @param ctrl 
+ * @param ctrl tx ctrl
+ */
+static inline void nfb_xctrl_tx_xsk_recycle_needs_lock(struct xctrl *ctrl)
+{
+	u32 i;
+
+	for (i = 0; i < ctrl->tx.xsk_done_cnt; i++)
+		xsk_buff_free(ctrl->tx.xsk_done[i]);
+	ctrl->tx.xsk_done_cnt = 0;
+}
+
+/**
+ * @brief Writes xsk rx buffer onto tx ring without copying.
+ * 	The umem chunk is already mapped by the xsk pool.
+ * 
+ * @param ctrl tx ctrl
+ * @param pool 
  * @param xdp 
  * @return 0 on success
  */
-static inline int nfb_xctrl_rexmit_xsk(struct xctrl *ctrl, struct xdp_buff *xdp)
+static inline int nfb_xctrl_tx_submit_xsk_needs_lock(struct xctrl *ctrl, struct xsk_buff_pool *pool, struct xdp_buff *xdp)
 {
-	int ret = 0;
-	struct xdp_frame *frame;
-	// xdp_convert_buff_to_frame frees the xsk on success and doesn't free on failure
-	// this is af_xdp slow fallback
-	if (unlikely(!(frame = xdp_convert_buff_to_frame(xdp)))) {
-		xdp_return_frame(frame);
-		ret = -ENOMEM;
-		goto exit;
+	u32 len = xdp->data_end - xdp->data;
+	dma_addr_t dma;
+	u32 idx;
+
+	// type0 + data descriptor
+	if (unlikely(((ctrl->c.hdp - ctrl->c.sdp - 1) & ctrl->c.mdp) < 2))
+		return -EBUSY;
+
+	if (len < ETH_ZLEN) {
+		memset(xdp->data_end, 0, ETH_ZLEN - len);
+		len = ETH_ZLEN;
 	}
+	// pool dma points behind the default headroom, program might have moved the data start
+	dma = xsk_buff_xdp_get_dma(xdp) + (xdp->data - xdp->data_hard_start) - XDP_PACKET_HEADROOM;
+	if (unlikely(!nfb_xctrl_xsk_dma_ok(dma, len)))
+		return -EINVAL;
+	xsk_buff_raw_dma_sync_for_device(pool, dma, len);
+
+	idx = nfb_xctrl_tx_write_desc_needs_lock(ctrl, dma, len, 0);
+	ctrl->tx.buffers[idx].type = NFB_XCTRL_BUFF_XSK_TX;
+	ctrl->tx.buffers[idx].xdp = xdp;
+	return 0;
+}
+
+/**
+ * @brief Sends all staged XDP_TX buffers with one lock and one doorbell.
+ * 	Buffers which don't fit onto tx ring or which the card can't read are returned to the pool.
+ * 	Also returns the completed XDP_TX buffers to the pool.
+ * 
+ * @param channel 
+ * @param bulk 
+ * @param budget napi budget, used for tx reclaim
+ */
+static inline void nfb_xctrl_tx_bulk_flush_xsk(struct nfb_xdp_channel *channel, struct nfb_xctrl_xsk_tx_bulk *bulk, int budget)
+{
+	struct xctrl *ctrl = channel->txq.ctrl;
+	u64 bytes = 0;
+	u32 i = 0, invalid = 0;
+	int ret;
+
+	if (!bulk->count && !READ_ONCE(ctrl->tx.xsk_done_cnt))
+		return;
+
 	spin_lock(&ctrl->tx.tx_lock);
 	{
 		// reclaim tx buffers
 		nc_ndp_ctrl_hdp_update(&ctrl->c);
-		nfb_xctrl_tx_free_buffers(ctrl);
-		// process tx
-		ret = nfb_xctrl_tx_submit_frame_needs_lock(ctrl, frame);
-		if (unlikely(ret)) {
-			xdp_return_frame(frame);
+		nfb_xctrl_tx_free_buffers(ctrl, budget);
+		nfb_xctrl_tx_xsk_recycle_needs_lock(ctrl);
+
+		if (bulk->count) {
+			for (i = 0; i < bulk->count; i++) {
+				ret = nfb_xctrl_tx_submit_xsk_needs_lock(ctrl, channel->pool, bulk->buffs[i]);
+				// chunk the card can't read in one piece, the rest of the bulk can still go
+				if (unlikely(ret == -EINVAL)) {
+					xsk_buff_free(bulk->buffs[i]);
+					invalid++;
+					continue;
+				}
+				if (unlikely(ret))
+					break;
+				bytes += bulk->buffs[i]->data_end - bulk->buffs[i]->data;
+			}
+			nc_ndp_ctrl_sdp_flush(&ctrl->c);
+			nfb_xdp_tx_stats_add(&channel->tx_stats, &channel->tx_syncp, i - invalid, bytes, bulk->count - i + invalid);
 		}
-		// flush
-		nc_ndp_ctrl_sdp_flush(&ctrl->c);
 	}
 	spin_unlock(&ctrl->tx.tx_lock);
-exit:
-	return ret;
+
+	// buffers which didn't fit are counted as ring_full together with the invalid ones
+	for (; i < bulk->count; i++)
+		xsk_buff_free(bulk->buffs[i]);
+	bulk->count = 0;
 }
 
 #ifndef CONFIG_HAVE_XSK_BUFF_ALLOC_BATCH
@@ -64,10 +147,10 @@ static inline u32 xsk_buff_alloc_batch(struct xsk_buff_pool *pool, struct xdp_bu
  * @brief XSK pool operation to fill card with rx descriptors.
  * 
  * @param ctrl 
- * @param pool struct xsk_buff_pool
+ * @param stats counts buffer allocation failures
  * @return int number of descriptors fileld
  */
-static inline int nfb_xctrl_rx_fill_xsk(struct xctrl *ctrl)
+static inline int nfb_xctrl_rx_fill_xsk(struct xctrl *ctrl, struct nfb_xdp_rx_stats *stats)
 {
 	const u32 batch_size = NFB_XDP_CTRL_PACKET_BURST;
 
@@ -85,21 +168,30 @@ static inline int nfb_xctrl_rx_fill_xsk(struct xctrl *ctrl)
 	dma_addr_t dma;
 	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
 	u32 free_desc, free_hdrs;
-	u32 real_count, i;
+	u32 real_count, i, filled = 0;
 
 	// Check if refill needed
 	nc_ndp_ctrl_hdp_update(&ctrl->c);
-	free_hdrs = (ctrl->c.shp - php - 1) & mhp;
+	free_hdrs = (ctrl->rx.cbp - php - 1) & mhp;
 	free_desc = (ctrl->c.hdp - sdp - 1) & mdp;
 	if (free_hdrs < batch_size || free_desc < batch_size)
 		return 0;
 
 	// Alloc xsk buffers
-	frame_len = xsk_pool_get_rx_frame_size(pool); // internaly calculates with XDP_PACKET_HEADROOM
+	frame_len = ctrl->rx.buf_len; // xsk_pool_get_rx_frame_size(), internaly calculates with XDP_PACKET_HEADROOM
 	real_count = xsk_buff_alloc_batch(pool, buffs, batch_size);
+	if (unlikely(!real_count))
+		stats->alloc_fail++;
 	for (i = 0; i < real_count; i++) {
 		dma = xsk_buff_xdp_get_dma(buffs[i]); // Takes XDP_PACKET_HEADROOM into account
 
+		// unaligned chunk the card can't write in one piece
+		if (unlikely(!nfb_xctrl_xsk_dma_ok(dma, frame_len))) {
+			xsk_buff_free(buffs[i]);
+			stats->alloc_fail++;
+			continue;
+		}
+
 		if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
 			if (unlikely(free_desc == 0)) {
 				break;
@@ -118,6 +210,7 @@ static inline int nfb_xctrl_rx_fill_xsk(struct xctrl *ctrl)
 		sdp = (sdp + 1) & mdp;
 		php = (php + 1) & mhp;
 		free_desc--;
+		filled++;
 	}
 
 	// if the loop quits because there was too little free descriptors
@@ -129,29 +222,59 @@ static inline int nfb_xctrl_rx_fill_xsk(struct xctrl *ctrl)
 	// update ctrl state
 	ctrl->rx.php = php;
 	ctrl->c.sdp = sdp;
-	return i;
+	return filled;
+}
+
+/**
+ * @brief Copies XDP_PASS frame from xsk buffer into napi allocated skb.
+ * 	The xsk buffer is returned to the pool on success.
+ * 
+ * @param napi 
+ * @param xdp 
+ * @return skb or NULL, the buffer is left untouched on fail
+ */
+static inline struct sk_buff *nfb_xctrl_build_skb_xsk(struct napi_struct *napi, struct xdp_buff *xdp)
+{
+	u32 metasize = xdp->data - xdp->data_meta;
+	u32 len = xdp->data_end - xdp->data_meta;
+	struct sk_buff *skb;
+
+	skb = napi_alloc_skb(napi, len);
+	if (unlikely(!skb))
+		return NULL;
+
+	memcpy(__skb_put(skb, len), xdp->data_meta, len);
+	if (metasize) {
+		__skb_pull(skb, metasize);
+		skb_metadata_set(skb, metasize);
+	}
+	// metadata live in the xsk buffer
+	nfb_xctrl_skb_set_meta(skb, xdp);
+	xsk_buff_free(xdp);
+	skb->protocol = eth_type_trans(skb, napi->dev);
+	return skb;
 }
 
 /**
  * @brief XDP handler
  * 
- * @param prog 
+ * @param xdp_prog program of the queue, dereferenced by the napi
  * @param xdp 
  * @param rxq 
+ * @param tx_bulk XDP_TX buffers are staged here
+ * @param stats rx stats of the napi poll
  * @return result
  */
-static inline void nfb_xctrl_handle_xsk(struct bpf_prog *prog, struct xdp_buff *xdp, struct nfb_xdp_queue *rxq)
+static inline void nfb_xctrl_handle_xsk(struct bpf_prog *xdp_prog, struct xdp_buff *xdp, struct nfb_xdp_queue *rxq,
+		struct nfb_xctrl_xsk_tx_bulk *tx_bulk, struct nfb_xdp_rx_stats *stats)
 {
 	unsigned act;
 	int ret;
-	struct xdp_frame *frame;
 	struct sk_buff *skb;
-	struct bpf_prog *xdp_prog;
 	struct nfb_xdp_channel *channel = container_of(rxq, struct nfb_xdp_channel, rxq);
 	struct nfb_ethdev *ethdev = channel->ethdev;
 
 	rcu_read_lock();
-	xdp_prog = rcu_dereference(prog);
 	if (xdp_prog) {
 		act = bpf_prog_run_xdp(xdp_prog, xdp);
 	} else {
@@ -159,52 +282,40 @@ static inline void nfb_xctrl_handle_xsk(struct bpf_prog *prog, struct xdp_buff *
 	}
 	switch (act) {
 	case XDP_PASS:
-		// This allocates memory => AF_XDP slow fallback for normal operation
-		frame = xdp_convert_buff_to_frame(xdp);
-		if (unlikely(!frame)) {
-			printk(KERN_DEBUG "SKB build failed\n");
+		// umem chunk must go back to the pool, AF_XDP slow fallback for normal operation
+		skb = nfb_xctrl_build_skb_xsk(&rxq->napi_xsk, xdp);
+		if (unlikely(!skb)) {
 			goto aborted;
 		}
-		// NOTE: This function does a lot of things internally, check it's implementation
-		// if you ever want to add support for fragmented packets
-		skb = xdp_build_skb_from_frame(frame, ethdev->netdev);
-		if (unlikely(IS_ERR_OR_NULL(skb))) {
-			printk(KERN_DEBUG "SKB build failed\n");
-			goto aborted;
-		}
-		// receive packet onto queue it arriverd on
+		// receive packet onto queue it arrived on
 		skb_record_rx_queue(skb, channel->index);
-		// TODO gro_receive is supposed to be a free
-		// 		performance boost but it is quite bad for
-		//		debugging because you cannot check if all packet
-		//		received are the same as sent
-		// napi_gro_receive(napi, skb);
-		netif_receive_skb(skb);
-		// TODO: future extension
-		// if (netif_receive_skb(skb) != NET_RX_DROP) {
-		// 	ctrl.stats = ...
-		// } else {
-		// 	ctrl.stats = ...
-		// }
+		// use ethtool -K <if> gro off to see every packet as received
+		napi_gro_receive(&rxq->napi_xsk, skb);
+		stats->xdp_pass++;
 		break;
 	case XDP_TX:
-		// returned on tx reclaim;
-		nfb_xctrl_rexmit_xsk(channel->txq.ctrl, xdp);
+		stats->xdp_tx++;
+		// sent without copy at the end of napi poll, returned to the pool after tx completion
+		tx_bulk->buffs[tx_bulk->count++] = xdp;
 		break;
 	case XDP_REDIRECT:
 		// either redirected to userspace or returned internally
 		ret = xdp_do_redirect(ethdev->netdev, xdp, xdp_prog);
 		if (unlikely(ret)) {
-			printk(KERN_INFO "nfb: xdp_do_redirect error ret: %d, maybe RX cannot keep up.\n", ret);
+			stats->redirect_err++;
+			goto drop;
 		}
+		stats->xdp_redirect++;
 		break;
 	default:
 		fallthrough;
 	case XDP_ABORTED:
 aborted:
-		printk(KERN_ERR "nfb: %s packet aborted\n", __func__);
-		fallthrough;
+		stats->xdp_aborted++;
+		goto drop;
 	case XDP_DROP:
+		stats->xdp_drop++;
+drop:
 		xsk_buff_free(xdp);
 		break;
 	}
@@ -220,18 +331,38 @@ static inline void xsk_buff_set_size(struct xdp_buff *xdp, u32 size)
 }
 #endif
 
-static inline u16 nfb_xctrl_rx_xsk(struct xctrl *ctrl, struct xdp_buff **buffs, u16 nb_pkts)
+/**
+ * @brief Returns the buffers of a frame which AF_XDP can't take to the xsk pool.
+ * 	The card continues with the next buffer when frame doesn't fit into one,
+ * 	all of them have to be consumed to keep xdp_ring in sync with the card.
+ *
+ * @param ctrl
+ * @param frame_len
+ * @param cbp consumed buffer pointer, moved past the frame
+ */
+static inline void nfb_xctrl_rx_put_frame_xsk(struct xctrl *ctrl, u32 frame_len, u32 *cbp)
+{
+	u32 nr_bufs = max(1u, DIV_ROUND_UP(frame_len, ctrl->rx.buf_len));
+
+	while (nr_bufs--) {
+		xsk_buff_free(ctrl->rx.xsk.xdp_ring[*cbp]);
+		*cbp = (*cbp + 1) & ctrl->c.mhp;
+	}
+}
+
+static inline u16 nfb_xctrl_rx_xsk(struct xctrl *ctrl, struct xdp_buff **buffs, u16 nb_pkts, struct nfb_xdp_rx_stats *stats)
 {
 	struct xdp_buff *buff;
 	struct nc_ndp_hdr *hdrs = ctrl->rx.hdr_buffer_cpu;
 	struct nc_ndp_hdr *hdr;
 	u32 i;
-	u16 nb_rx;
+	u16 nb_rx, cnt = 0;
 	u32 shp = ctrl->c.shp;
 	u32 mhp = ctrl->c.mhp;
+	u32 cbp = ctrl->rx.cbp;
 
 	// fill the card with empty buffers
-	while (nfb_xctrl_rx_fill_xsk(ctrl))
+	while (nfb_xctrl_rx_fill_xsk(ctrl, stats))
 		;
 	nc_ndp_ctrl_sdp_flush(&ctrl->c);
 
@@ -243,44 +374,59 @@ static inline u16 nfb_xctrl_rx_xsk(struct xctrl *ctrl, struct xdp_buff **buffs,
 
 	// ready packets for receive
 	for (i = 0; i < nb_rx; ++i) {
-		buff = ctrl->rx.xsk.xdp_ring[shp];
 		hdr = &hdrs[shp];
+		shp = (shp + 1) & mhp;
+		stats->packets++;
+		stats->bytes += hdr->frame_len;
+		// frame didn't fit into the umem chunk, MAC limit was higher when it arrived
+		if (unlikely(hdr->frame_len > ctrl->rx.buf_len)) {
+			nfb_xctrl_rx_put_frame_xsk(ctrl, hdr->frame_len, &cbp);
+			stats->dropped++;
+			continue;
+		}
+		buff = ctrl->rx.xsk.xdp_ring[cbp];
+		cbp = (cbp + 1) & mhp;
 		xsk_buff_set_size(buff, hdr->frame_len); // sets the actual data size after receive
 		xsk_buff_dma_sync_for_cpu(buff, ctrl->rx.xsk.pool);
-		buffs[i] = buff;
-		shp = (shp + 1) & mhp;
+		nfb_xctrl_rx_meta(ctrl, buff, hdr->hdr_len);
+		buffs[cnt++] = buff;
 	}
 
 	// update ctrl state
 	ctrl->c.shp = shp;
-	return nb_rx;
+	ctrl->rx.cbp = cbp;
+	return cnt;
 }
 
 int nfb_xctrl_napi_poll_rx_xsk(struct napi_struct *napi, int budget)
 {
 	struct nfb_xdp_queue *rxq = container_of(napi, struct nfb_xdp_queue, napi_xsk);
+	struct nfb_xdp_channel *channel = container_of(rxq, struct nfb_xdp_channel, rxq);
 	struct xctrl *ctrl = rxq->ctrl;
-	struct net_device *netdev = napi->dev;
-	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	struct bpf_prog *prog;
 	unsigned received, i = 0;
 	struct xdp_buff *xdp[NAPI_POLL_WEIGHT];
+	struct nfb_xctrl_xsk_tx_bulk tx_bulk;
+	struct nfb_xdp_rx_stats stats = {};
 
-	if (unlikely(budget > NAPI_POLL_WEIGHT)) {
-		printk(KERN_ERR "nfb: NAPI budget is bigger than weight. This is a driver bug.\n");
-		BUG();
-	}
+	// busy polling sockets pass sk_busy_poll_budget, which can exceed the weight
+	// the on-stack arrays are sized for; the caller polls again for the rest
+	budget = min(budget, NAPI_POLL_WEIGHT);
 
-	received = nfb_xctrl_rx_xsk(ctrl, xdp, budget);
-	for (i = 0; i < received; i++) {
-		if (unlikely(PAGE_SIZE < xdp[i]->data_end - xdp[i]->data_hard_start)) {
-			printk(KERN_ERR "nfb: XSK got packet too large, current max size: %lu\n", PAGE_SIZE - (xdp[i]->data - xdp[i]->data_hard_start));
-			xsk_buff_free(xdp[i]);
-			continue;
-		}
-		nfb_xctrl_handle_xsk(ethdev->prog, xdp[i], rxq);
-	}
+	tx_bulk.count = 0;
+	received = nfb_xctrl_rx_xsk(ctrl, xdp, budget, &stats);
+	rcu_read_lock();
+	prog = rcu_dereference(rxq->prog);
+	for (i = 0; i < received; i++)
+		nfb_xctrl_handle_xsk(prog, xdp[i], rxq, &tx_bulk, &stats);
+	rcu_read_unlock();
+	// send XDP_TX buffers with single doorbell
+	nfb_xctrl_tx_bulk_flush_xsk(channel, &tx_bulk, budget);
+	nfb_xdp_rx_stats_add(channel, &stats);
 	// flush sdp and shp after software processing is done
 	nc_ndp_ctrl_sp_flush(&ctrl->c);
+	// let the queue thread know there is traffic
+	WRITE_ONCE(rxq->poll_work, rxq->poll_work + received);
 
 	// Flushes redirect maps
 	xdp_do_flush();
@@ -290,7 +436,7 @@ int nfb_xctrl_napi_poll_rx_xsk(struct napi_struct *napi, int budget)
 		return budget;
 
 	// Work done -> finish
-	napi_complete_done(napi, received);
+	channel_napi_complete(channel, rxq, napi, received);
 	return received;
 }
 
@@ -303,23 +449,36 @@ int nfb_xctrl_napi_poll_tx_xsk(struct napi_struct *napi, int budget)
 	struct xdp_desc *buffs;
 	u32 free_desc;
 	u32 ready, i = 0;
+	u32 completed, reclaimed, work;
+	u32 invalid = 0;
 	dma_addr_t dma;
 	void *data;
 	u32 len;
+	u64 bytes = 0;
 	u32 min_len = ETH_ZLEN;
 
-	u64 last_upper_addr = ctrl->c.last_upper_addr;
-	u32 sdp = ctrl->c.sdp;
+	u64 last_upper_addr;
+	u32 sdp;
 	u32 mdp = ctrl->c.mdp;
 	struct nc_ndp_desc *descs = ctrl->desc_buffer_virt;
 
 	spin_lock(&ctrl->tx.tx_lock);
 	{
+		// rx napi submits XDP_TX buffers onto the same ring, read the state under lock
+		last_upper_addr = ctrl->c.last_upper_addr;
+		sdp = ctrl->c.sdp;
+
 		// free the completed buffers
+		reclaimed = ctrl->tx.fdp;
 		nc_ndp_ctrl_hdp_update(&ctrl->c);
-		nfb_xctrl_tx_free_buffers(ctrl);
-		xsk_tx_completed(pool, ctrl->tx.completed_xsk_tx);
-		ctrl->tx.completed_xsk_tx = 0;
+		nfb_xctrl_tx_free_buffers(ctrl, budget);
+		reclaimed = (ctrl->tx.fdp - reclaimed) & mdp;
+		// report completions before submitting, request/response waits on them
+		completed = ctrl->tx.completed_xsk_tx;
+		if (completed) {
+			xsk_tx_completed(pool, completed);
+			ctrl->tx.completed_xsk_tx = 0;
+		}
 
 		free_desc = (ctrl->tx.fdp - sdp - 1) & mdp;
 
@@ -334,16 +493,22 @@ int nfb_xctrl_napi_poll_tx_xsk(struct napi_struct *napi, int budget)
 			dma = xsk_buff_raw_get_dma(pool, buffs[i].addr);
 			len = buffs[i].len;
 
-			// TODO: There should be a len check. using pool.frame_len somewhere when setting up the xsk queue
+			// descriptor length is validated by the xsk core against the chunk size
 			if (len < min_len) { // Usable frame space is smaller than min_len.
 				// printk(KERN_DEBUG "TX: %s memsetting len: %d to %d\n", __func__, len, min_len);
 				memset(data + len, 0, min_len - len);
 				len = min_len;
 			}
 
+			// unaligned chunk the card can't read in one piece, completed with the next frame
+			if (unlikely(!nfb_xctrl_xsk_dma_ok(dma, len))) {
+				ctrl->tx.last_napi_xsk_drops++;
+				invalid++;
+				continue;
+			}
+
 			if (unlikely(NDP_CTRL_DESC_UPPER_ADDR(dma) != last_upper_addr)) {
 				if (unlikely(free_desc < 2)) {
-					printk(KERN_ERR "nfb: %s busy warning\n", __func__);
 					goto out;
 				}
 
@@ -356,7 +521,6 @@ int nfb_xctrl_napi_poll_tx_xsk(struct napi_struct *napi, int budget)
 			}
 
 			if (unlikely(free_desc == 0)) {
-				printk(KERN_ERR "nfb: nfb_xctrl_xmit busy warning\n");
 				goto out;
 			}
 			ctrl->tx.buffers[sdp].type = NFB_XCTRL_BUFF_XSK;
@@ -368,57 +532,65 @@ int nfb_xctrl_napi_poll_tx_xsk(struct napi_struct *napi, int budget)
 			xsk_buff_raw_dma_sync_for_device(pool, dma, len);
 			free_desc--;
 			sdp = (sdp + 1) & mdp;
+			bytes += len;
 		}
 out:
 		// update ctrl
 		ctrl->tx.last_napi_xsk_drops += ready - i;
 		ctrl->c.sdp = sdp;
+		nfb_xdp_tx_stats_add(&channel->tx_stats, &channel->tx_syncp, i - invalid, bytes, ready - i + invalid);
 
 		// flush counters when done
 		nc_ndp_ctrl_sdp_flush(&ctrl->c);
 	}
 	spin_unlock(&ctrl->tx.tx_lock);
+	// let the queue thread know there is traffic
+	// reclaimed completions count too, tx in flight doesn't, the card may never complete it
+	work = i + !!reclaimed;
+	WRITE_ONCE(txq->poll_work, txq->poll_work + work);
 
 	// Work not done -> reschedule if budget remains
 	if (i == budget)
 		return budget;
 
-	// Work done -> finish
-	napi_complete_done(napi, i);
+	// Work done -> finish, native timer stays short while completions come in
+	channel_napi_complete(channel, txq, napi, work);
 	return i;
 }
 
-static void nfb_xctrl_stop_xsk(struct xctrl *ctrl)
+/**
+ * @brief One attempt to stop the controller, run from the stop work.
+ * 	Frames the card still delivers on rx are returned to the xsk pool so the controller can drain.
+ *
+ * @param ctrl
+ * @return 0 when stopped, -EAGAIN or -EINPROGRESS to try again
+ */
+static int nfb_xctrl_stop_step_xsk(struct xctrl *ctrl)
 {
-	int cnt, i = 0;
+	struct nc_ndp_hdr *hdrs = ctrl->rx.hdr_buffer_cpu;
 	int err;
-	u32 count;
+	u32 i, count;
 	u32 shp = ctrl->c.shp;
 	u32 mhp = ctrl->c.mhp;
-	struct xdp_buff *xdp;
+	u32 cbp = ctrl->rx.cbp;
 
-	do {
-		err = nc_ndp_ctrl_stop(&ctrl->c);
-		if (err != -EAGAIN && err != -EINPROGRESS)
-			break;
+	err = nc_ndp_ctrl_stop(&ctrl->c);
+	if (err != -EAGAIN && err != -EINPROGRESS)
+		return err;
 
+	if (ctrl->type == NFB_XCTRL_RX) {
 		// receive packets from card and try again
 		nc_ndp_ctrl_hhp_update(&ctrl->c);
 		count = (ctrl->c.hhp - shp) & mhp;
 		for (i = 0; i < count; ++i) {
-			xdp = ctrl->rx.xsk.xdp_ring[shp];
-			xsk_buff_free(xdp);
+			nfb_xctrl_rx_put_frame_xsk(ctrl, hdrs[shp].frame_len, &cbp);
 			shp = (shp + 1) & mhp;
 		}
 		ctrl->c.shp = shp;
+		ctrl->rx.cbp = cbp;
 		nc_ndp_ctrl_sp_flush(&ctrl->c);
-		mdelay(1);
-	} while (cnt++ < 100);
-
-	if (err) {
-		err = nc_ndp_ctrl_stop_force(&ctrl->c);
-		printk(KERN_WARNING "nfb: queue id %u didn't stop in 100 msecs; Force stopping dma ctrl; This might damage firmware.\n", ctrl->nfb_queue_id);
 	}
+	return err;
 }
 
 struct xctrl *nfb_xctrl_alloc_xsk(struct net_device *netdev, u32 queue_id, struct xsk_buff_pool *pool, enum xdp_ctrl_type type)
@@ -439,7 +611,7 @@ struct xctrl *nfb_xctrl_alloc_xsk(struct net_device *netdev, u32 queue_id, struc
 		break;
 	case NFB_XCTRL_TX:
 		queue = &channel->txq;
-		fdt_offset = nfb_comp_find(nfb, "netcope,dma_ctrl_ndp_tx", channel->nfb_index);
+		fdt_offset = nfb_comp_find(nfb, "netcope,dma_ctrl_ndp_tx", channel->nfb_tx_index);
 		break;
 	default:
 		err = -EINVAL;
@@ -460,12 +632,17 @@ struct xctrl *nfb_xctrl_alloc_xsk(struct net_device *netdev, u32 queue_id, struc
 	ctrl->type = type;
 	ctrl->nfb_queue_id = channel->nfb_index;
 	ctrl->netdev_queue_id = channel->index;
-	ctrl->dma_dev = &nfb->pci->dev;
+	ctrl->dma_dev = nfb->dma_dev;
 	ctrl->nb_desc = pool->heads_cnt * 2;
+	nfb_xctrl_init_stop(ctrl, nfb_xctrl_stop_step_xsk);
 
 	// Allocating control buffers
 	switch (type) {
 	case NFB_XCTRL_RX:
+		// frame is received into single chunk, 2K chunks are enough for standard MTU
+		ctrl->rx.buf_len = xsk_pool_get_rx_frame_size(pool);
+		ctrl->rx.frag_size = XDP_PACKET_HEADROOM + ctrl->rx.buf_len;
+		nfb_xctrl_rx_meta_init(ctrl);
 		if (!(ctrl->rx.xsk.xdp_ring = kzalloc_node(sizeof(struct xdp_buff *) * ctrl->nb_desc, GFP_KERNEL, channel->numa))) {
 			err = -ENOMEM;
 			goto buff_alloc_fail;
@@ -477,6 +654,12 @@ struct xctrl *nfb_xctrl_alloc_xsk(struct net_device *netdev, u32 queue_id, struc
 			err = -ENOMEM;
 			goto buff_alloc_fail;
 		}
+		if (!(ctrl->tx.xsk_done = kzalloc_node(sizeof(struct xdp_buff *) * ctrl->nb_desc, GFP_KERNEL, channel->numa))) {
+			kfree(ctrl->tx.buffers);
+			err = -ENOMEM;
+			goto buff_alloc_fail;
+		}
+		ctrl->tx.ndq = netdev_get_tx_queue(netdev, channel->index);
 		break;
 	default:
 		err = -EINVAL;
@@ -546,6 +729,7 @@ dma_data_fail:
 		kfree(ctrl->rx.xsk.xdp_ring);
 		break;
 	case NFB_XCTRL_TX:
+		kfree(ctrl->tx.xsk_done);
 		kfree(ctrl->tx.buffers);
 		break;
 	default:
@@ -561,23 +745,32 @@ fdt_offset_fail:
 
 void nfb_xctrl_destroy_xsk(struct xctrl *ctrl)
 {
-	if (test_bit(XCTRL_STATUS_IS_RUNNING, &ctrl->status)) {
-		nfb_xctrl_stop_xsk(ctrl);
-	}
+	// no-op when the caller already started the stop
+	nfb_xctrl_stop_async(ctrl);
+	nfb_xctrl_stop_wait(ctrl);
 	nc_ndp_ctrl_close(&ctrl->c);
 	dma_free_coherent(ctrl->dma_dev, ctrl->nb_desc * sizeof(struct nc_ndp_desc), ctrl->desc_buffer_virt, ctrl->desc_buffer_dma);
 	dma_free_coherent(ctrl->dma_dev, sizeof(u32) * 2, ctrl->update_buffer_virt, ctrl->update_buffer_dma);
 	switch (ctrl->type) {
 	case NFB_XCTRL_RX:
 		dma_free_coherent(ctrl->dma_dev, ctrl->rx.nb_hdr * sizeof(struct nc_ndp_hdr), ctrl->rx.hdr_buffer_cpu, ctrl->rx.hdr_buffer_dma);
+		// return buffers the card didn't fill
+		while (ctrl->rx.cbp != ctrl->rx.php) {
+			xsk_buff_free(ctrl->rx.xsk.xdp_ring[ctrl->rx.cbp]);
+			ctrl->rx.cbp = (ctrl->rx.cbp + 1) & ctrl->c.mhp;
+		}
 		xdp_rxq_info_unreg_mem_model(&ctrl->rx.rxq_info);
 		xdp_rxq_info_unreg(&ctrl->rx.rxq_info);
 		kfree(ctrl->rx.xsk.xdp_ring);
 		break;
 	case NFB_XCTRL_TX:
-		// free all enqueued tx buffers
+		// free all enqueued tx buffers, BQL is reset when the queue starts again
+		ctrl->tx.ndq = NULL;
 		ctrl->c.hdp = ctrl->c.sdp;
-		nfb_xctrl_tx_free_buffers(ctrl);
+		nfb_xctrl_tx_free_buffers(ctrl, 0);
+		// napis are disabled, the pool can be touched here
+		nfb_xctrl_tx_xsk_recycle_needs_lock(ctrl);
+		kfree(ctrl->tx.xsk_done);
 		kfree(ctrl->tx.buffers);
 		break;
 	default:
@@ -18,12 +18,35 @@
 
 #include "driver.h"
 #include "ethdev.h"
+#include "channel.h"
 #include "sysfs.h"
 
 #define COMP_NETCOPE_RX "netcope,dma_ctrl_ndp_rx"
 #define COMP_NETCOPE_TX "netcope,dma_ctrl_ndp_tx"
 
 static bool xdp_enable = 0;
+bool nfb_xdp_rx_frag = 1;
+int nfb_xdp_rx_ts_offset = -1;
+int nfb_xdp_rx_hash_offset = -1;
+
+static int nfb_xdp_irq_notify(struct notifier_block *nb, unsigned long irq, void *data)
+{
+	struct nfb_xdp *module = container_of(nb, struct nfb_xdp, irq_nb);
+	struct nfb_irq_event *ev = data;
+	struct nfb_ethdev *ethdev;
+	int ret = NOTIFY_DONE;
+	u16 i;
+
+	list_for_each_entry(ethdev, &module->list_devices, list) {
+		for (i = 0; i < ethdev->channel_count; i++) {
+			if (channel_irq_wakeup(&ethdev->channels[i]))
+				ret = NOTIFY_OK;
+		}
+	}
+	if (ret == NOTIFY_OK)
+		ev->handled = true;
+	return ret;
+}
 
 int nfb_xdp_attach(struct nfb_device *nfb, void **priv)
 {
@@ -41,35 +64,36 @@ int nfb_xdp_attach(struct nfb_device *nfb, void **priv)
 	// count the ports and queues
 	ethc = nfb_comp_count(nfb, COMP_NETCOPE_ETH);
 	if (ethc <= 0) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: No eth interfaces available\n");
+		dev_warn(nfb->dma_dev, "nfb_xdp: No eth interfaces available\n");
 		return -EINVAL;
 	}
 
 	rxqc = nfb_comp_count(nfb, COMP_NETCOPE_RX);
 	if (rxqc <= 0) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: No RX queues available\n");
+		dev_warn(nfb->dma_dev, "nfb_xdp: No RX queues available\n");
 		return -EINVAL;
 	}
 
 	txqc = nfb_comp_count(nfb, COMP_NETCOPE_TX);
 	if (txqc <= 0) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: No TX queues available\n");
+		dev_warn(nfb->dma_dev, "nfb_xdp: No TX queues available\n");
 		return -EINVAL;
 	}
 
 	// sanity checks; we expect there will be the same amount of queue pairs for each eth port
-	if (rxqc != txqc) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: TX and RX queue count differs, xdp operates with queue pairs TXc: %u, RXc: %u\n", txqc, rxqc);
+	// spare TX queues are used for ndo_xdp_xmit
+	if (rxqc > txqc) {
+		dev_warn(nfb->dma_dev, "nfb_xdp: Less TX than RX queues, xdp operates with queue pairs TXc: %u, RXc: %u\n", txqc, rxqc);
 		return -EINVAL;
 	}
-	if (rxqc % ethc != 0) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: Queue pairs are not divisible by ports, don't know how to initilize TXc: %u, RXc: %u, ETHc: %u\n", txqc, rxqc, ethc);
+	if (rxqc % ethc != 0 || txqc % ethc != 0) {
+		dev_warn(nfb->dma_dev, "nfb_xdp: Queues are not divisible by ports, don't know how to initilize TXc: %u, RXc: %u, ETHc: %u\n", txqc, rxqc, ethc);
 		return -EINVAL;
 	}
 
 	module = kzalloc(sizeof(*module), GFP_KERNEL);
 	if (!module) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: Failed to alloc module\n");
+		dev_warn(nfb->dma_dev, "nfb_xdp: Failed to alloc module\n");
 		return -ENOMEM;
 	}
 	*priv = module;
@@ -96,7 +120,7 @@ int nfb_xdp_attach(struct nfb_device *nfb, void **priv)
 	fdt_for_each_compatible_node(nfb->fdt, fdt_offset, COMP_NETCOPE_ETH) {
 		ethdev = create_ethdev(module, fdt_offset, i);
 		if (!ethdev) {
-			dev_warn(&nfb->pci->dev, "nfb_xdp: failed to create eth port\n");
+			dev_warn(nfb->dma_dev, "nfb_xdp: failed to create eth port\n");
 			goto err_ethdev;
 		}
 		list_add_tail(&ethdev->list, &module->list_devices);
@@ -104,11 +128,17 @@ int nfb_xdp_attach(struct nfb_device *nfb, void **priv)
 	}
 
 	if (i != ethc) {
-		dev_warn(&nfb->pci->dev, "nfb_xdp: failed to create eth port\n");
+		dev_warn(nfb->dma_dev, "nfb_xdp: failed to create eth port\n");
 		goto err_ethdev;
 	}
 
-	dev_info(&nfb->pci->dev, "nfb_xdp: attached\n");
+	// interrupt wakeups are optional, the queue threads always wake up on timeout
+	module->irq_nb.notifier_call = nfb_xdp_irq_notify;
+	module->irq_available = !nfb_irq_register_notifier(nfb, &module->irq_nb);
+	if (!module->irq_available)
+		dev_info(nfb->dma_dev, "nfb_xdp: MSI not available, queue threads will not use interrupt wakeups\n");
+
+	dev_info(nfb->dma_dev, "nfb_xdp: attached\n");
 	return 0;
 
 err_ethdev:
@@ -130,14 +160,23 @@ void nfb_xdp_detach(struct nfb_device *nfb, void *priv)
 		return;
 	}
 
+	if (module->irq_available)
+		nfb_irq_unregister_notifier(nfb, &module->irq_nb);
+
 	list_for_each_entry_safe(ethdev, tmp, &module->list_devices, list) {
 		destroy_ethdev(ethdev);
 	}
 
 	device_del(&module->dev);
 	kfree(module);
-	dev_info(&nfb->pci->dev, "nfb_xdp: detached\n");
+	dev_info(nfb->dma_dev, "nfb_xdp: detached\n");
 }
 
 module_param(xdp_enable, bool, S_IRUGO);
 MODULE_PARM_DESC(xdp_enable, "Creates XDP capable netdevice for each Ethernet interface [no]");
+module_param_named(xdp_rx_frag, nfb_xdp_rx_frag, bool, S_IRUGO);
+MODULE_PARM_DESC(xdp_rx_frag, "Splits pages into MTU sized rx buffers in page pool mode [yes]");
+module_param_named(xdp_rx_ts_offset, nfb_xdp_rx_ts_offset, int, S_IRUGO);
+MODULE_PARM_DESC(xdp_rx_ts_offset, "Byte offset of 64b TSU timestamp in the NDP rx header, -1 when firmware doesn't provide it [-1]");
+module_param_named(xdp_rx_hash_offset, nfb_xdp_rx_hash_offset, int, S_IRUGO);
+MODULE_PARM_DESC(xdp_rx_hash_offset, "Byte offset of 32b flow hash in the NDP rx header, -1 when firmware doesn't provide it [-1]");
@@ -12,6 +12,10 @@
 
 #include "../nfb.h"
 
+extern bool nfb_xdp_rx_frag;
+extern int nfb_xdp_rx_ts_offset;
+extern int nfb_xdp_rx_hash_offset;
+
 int nfb_xdp_attach(struct nfb_device *nfb, void **priv);
 void nfb_xdp_detach(struct nfb_device *nfb, void *priv);
 
@@ -24,6 +28,10 @@ struct nfb_xdp {
 	u16 ethc; // Number of ETH ports
 	u16 rxqc; // Absolute number of rx queues
 	u16 txqc; // Absolute number of tx queues
+
+	// card interrupt used to wake up idle queue threads
+	struct notifier_block irq_nb;
+	bool irq_available;
 };
 
 #endif // NFB_XDP_DRIVER_H
@@ -23,38 +23,64 @@
 #include "channel.h"
 #include "ctrl_xdp.h"
 #include "sysfs.h"
+#include "xmitq.h"
 
+// napis exist only while the channel is enabled, in threaded mode each one owns a kernel thread
+static void nfb_xdp_channel_add_napi(struct net_device *netdev, struct nfb_xdp_channel *channel)
+{
+#ifdef CONFIG_HAVE_NETIF_NAPI_ADD_WITH_WEIGHT
+	netif_napi_add(netdev, &channel->rxq.napi_pp, nfb_xctrl_napi_poll_pp, NAPI_POLL_WEIGHT);
+	netif_napi_add(netdev, &channel->rxq.napi_xsk, nfb_xctrl_napi_poll_rx_xsk, NAPI_POLL_WEIGHT);
+#else
+	netif_napi_add_weight(netdev, &channel->rxq.napi_pp, nfb_xctrl_napi_poll_pp, NAPI_POLL_WEIGHT);
+	netif_napi_add_weight(netdev, &channel->rxq.napi_xsk, nfb_xctrl_napi_poll_rx_xsk, NAPI_POLL_WEIGHT);
+#endif
+#ifdef CONFIG_HAVE_NETIF_NAPI_ADD_TX_WEIGHT
+	netif_napi_add_tx_weight(netdev, &channel->txq.napi_xsk, nfb_xctrl_napi_poll_tx_xsk, NAPI_POLL_WEIGHT);
+#else
+	netif_tx_napi_add(netdev, &channel->txq.napi_xsk, nfb_xctrl_napi_poll_tx_xsk, NAPI_POLL_WEIGHT);
+#endif
+}
+
+static void nfb_xdp_channel_del_napi(struct nfb_xdp_channel *channel)
+{
+	netif_napi_del(&channel->rxq.napi_pp);
+	netif_napi_del(&channel->rxq.napi_xsk);
+	netif_napi_del(&channel->txq.napi_xsk);
+}
+
+/**
+ * @brief Allocates all channels the port can use, only first channel_count of them get napis.
+ * 	Queue indexes of the card are fixed by the channel_max, they don't move with ethtool -L.
+ *
+ * @param netdev
+ * @return int
+ */
 static int nfb_xdp_channels_init(struct net_device *netdev)
 {
 	int i, ret = 0;
 	struct nfb_ethdev *ethdev = netdev_priv(netdev);
 
-	ethdev->channels = kzalloc(sizeof(*ethdev->channels) * ethdev->channel_count, GFP_KERNEL);
+	ethdev->channels = kzalloc(sizeof(*ethdev->channels) * ethdev->channel_max, GFP_KERNEL);
 	if (!ethdev->channels) {
 		ret = -ENOMEM;
 		goto err_channel_alloc;
 	}
 
-	for (i = 0; i < ethdev->channel_count; i++) {
+	for (i = 0; i < ethdev->channel_max; i++) {
 		mutex_init(&ethdev->channels[i].state_mutex);
 		ethdev->channels[i].ethdev = ethdev;
 		ethdev->channels[i].index = i;
-		ethdev->channels[i].nfb_index = i + ethdev->channel_count * ethdev->index;
-		ethdev->channels[i].numa = dev_to_node(&ethdev->nfb->pci->dev);
-#ifdef CONFIG_HAVE_NETIF_NAPI_ADD_WITH_WEIGHT
-		netif_napi_add(netdev, &ethdev->channels[i].rxq.napi_pp, nfb_xctrl_napi_poll_pp, NAPI_POLL_WEIGHT);
-		netif_napi_add(netdev, &ethdev->channels[i].rxq.napi_xsk, nfb_xctrl_napi_poll_rx_xsk, NAPI_POLL_WEIGHT);
-#else
-		netif_napi_add_weight(netdev, &ethdev->channels[i].rxq.napi_pp, nfb_xctrl_napi_poll_pp, NAPI_POLL_WEIGHT);
-		netif_napi_add_weight(netdev, &ethdev->channels[i].rxq.napi_xsk, nfb_xctrl_napi_poll_rx_xsk, NAPI_POLL_WEIGHT);
-#endif
-#ifdef CONFIG_HAVE_NETIF_NAPI_ADD_TX_WEIGHT
-		netif_napi_add_tx_weight(netdev, &ethdev->channels[i].txq.napi_xsk, nfb_xctrl_napi_poll_tx_xsk, NAPI_POLL_WEIGHT);
-#else
-		netif_tx_napi_add(netdev, &ethdev->channels[i].txq.napi_xsk, nfb_xctrl_napi_poll_tx_xsk, NAPI_POLL_WEIGHT);
-#endif
+		ethdev->channels[i].nfb_index = i + ethdev->channel_max * ethdev->index;
+		ethdev->channels[i].nfb_tx_index = i + (ethdev->channel_max + ethdev->xmitq_count) * ethdev->index;
+		ethdev->channels[i].numa = dev_to_node(ethdev->nfb->dma_dev);
+		channel_init_poll(&ethdev->channels[i]);
+		channel_init_stats(&ethdev->channels[i]);
 	}
 
+	for (i = 0; i < ethdev->channel_count; i++)
+		nfb_xdp_channel_add_napi(netdev, &ethdev->channels[i]);
+
 err_channel_alloc:
 	return ret;
 }
@@ -64,12 +90,35 @@ static void nfb_xdp_channels_deinit(struct net_device *netdev)
 	u32 i;
 	struct nfb_ethdev *ethdev = netdev_priv(netdev);
 
+	for (i = 0; i < ethdev->channel_count; i++)
+		nfb_xdp_channel_del_napi(&ethdev->channels[i]);
+
+	for (i = 0; i < ethdev->channel_max; i++)
+		channel_deinit_stats(&ethdev->channels[i]);
+	kfree(ethdev->channels);
+}
+
+/**
+ * @brief Programs the longest frame the rx MAC accepts.
+ * 	Rx buffers are sized from the MTU, the MAC must not pass longer frames.
+ * 	AF_XDP channels receive each frame into one umem chunk, the smallest bound pool limits the port.
+ * 	Must be called under rtnl lock.
+ *
+ * @param ethdev
+ */
+void nfb_xdp_set_rx_frame_len(struct nfb_ethdev *ethdev)
+{
+	u32 len = ethdev->netdev->mtu + ETH_HLEN + VLAN_HLEN + ETH_FCS_LEN;
+	u16 i;
+
+	if (!ethdev->nc_rxmac)
+		return;
+
 	for (i = 0; i < ethdev->channel_count; i++) {
-		netif_napi_del(&ethdev->channels[i].rxq.napi_pp);
-		netif_napi_del(&ethdev->channels[i].rxq.napi_xsk);
-		netif_napi_del(&ethdev->channels[i].txq.napi_xsk);
+		if (ethdev->channels[i].pool)
+			len = min(len, xsk_pool_get_rx_frame_size(ethdev->channels[i].pool));
 	}
-	kfree(ethdev->channels);
+	nc_rxmac_set_frame_length(ethdev->nc_rxmac, len, RXMAC_FRAME_LENGTH_MAX);
 }
 
 static void nfb_stop_channels(struct net_device *netdev)
@@ -79,13 +128,14 @@ static void nfb_stop_channels(struct net_device *netdev)
 	unsigned i;
 	struct bpf_prog *old_prog;
 
-	spin_lock(&ethdev->prog_lock);
-	old_prog = rcu_replace_pointer(ethdev->prog, NULL, lockdep_is_held(&ethdev->prog_lock));
+	old_prog = nfb_xdp_xchg_prog(ethdev, NULL);
+	synchronize_rcu();
 	if (old_prog) {
 		bpf_prog_put(old_prog);
 	}
-	spin_unlock(&ethdev->prog_lock);
-	synchronize_rcu();
+
+	// redirected traffic falls back to the channels until they are stopped
+	nfb_xdp_xmitqs_stop(ethdev);
 
 	// Stop all TX queues
 	netif_tx_stop_all_queues(netdev);
@@ -96,10 +146,19 @@ static void nfb_stop_channels(struct net_device *netdev)
 	if (ethdev->nc_txmac)
 		nc_txmac_disable(ethdev->nc_txmac);
 
-	// Stop all threads
+	// ndo_xdp_xmit can still hold a channel tx controller, one grace period for all of them
+	for (i = 0; i < ethdev->channel_count; i++)
+		channel_hide_xmit(&ethdev->channels[i]);
+	synchronize_net();
+
+	// Stop all threads, the dma controllers of all channels drain in parallel
+	for (i = 0; i < ethdev->channel_count; i++) {
+		channel = &ethdev->channels[i];
+		channel_stop_async(channel);
+	}
 	for (i = 0; i < ethdev->channel_count; i++) {
 		channel = &ethdev->channels[i];
-		channel_stop(channel);
+		channel_stop_wait(channel);
 	}
 }
 
@@ -110,17 +169,19 @@ static int nfb_start_channels(struct net_device *netdev)
 	int i, ret;
 
 #ifdef CONFIG_HAVE_XDP_FEATURES_T
-	// TODO:
-	// Support segmented packets
 	// set XDP capabilities for netdevice
 	// Only works on newer kernels
 	xdp_features_t val;
 	val = NETDEV_XDP_ACT_BASIC
 		| NETDEV_XDP_ACT_REDIRECT
 		| NETDEV_XDP_ACT_XSK_ZEROCOPY
-		// | NETDEV_XDP_ACT_RX_SG
 		| NETDEV_XDP_ACT_NDO_XMIT
-		// | NETDEV_XDP_ACT_NDO_XMIT_SG
+#ifdef CONFIG_HAVE_XDP_FRAGS
+		// RX_SG covers the page pool channels only, AF_XDP zero-copy channels
+		// never receive multi-buffer frames: MTU and MAC limit fit one umem chunk
+		| NETDEV_XDP_ACT_RX_SG
+		| NETDEV_XDP_ACT_NDO_XMIT_SG
+#endif
 		;
 	xdp_set_features_flag(netdev, val);
 #endif
@@ -128,12 +189,20 @@ static int nfb_start_channels(struct net_device *netdev)
 	// Threads take care of setting up and tearing down the queues as XDP demands the abillity to do that on the fly
 	for (i = 0; i < ethdev->channel_count; i++) {
 		channel = &ethdev->channels[i];
-		if ((ret = channel_start_pp(channel))) {
+		// xsk pool can be bound while the port is down
+		ret = channel->pool ? channel_start_xsk(channel) : channel_start_pp(channel);
+		if (ret)
 			goto err_channel_start;
-		}
 	}
 
+	nfb_xdp_xmitqs_start(ethdev);
+
+	// spread flows over the channels, table set by the user is kept
+	if (nfb_rss_reset(&ethdev->rss, netdev, ethdev->channels[0].nfb_index, ethdev->channel_count))
+		printk(KERN_WARNING "nfb: %s - failed to set RSS indirection table\n", netdev->name);
+
 	// enable mac
+	nfb_xdp_set_rx_frame_len(ethdev);
 	if (ethdev->nc_rxmac)
 		nc_rxmac_enable(ethdev->nc_rxmac);
 	if (ethdev->nc_txmac)
@@ -146,6 +215,156 @@ err_channel_start:
 	return ret;
 }
 
+/**
+ * @brief Restarts channels in page pool mode so they pick up new ring and rx buffer sizes.
+ * 	AF_XDP channels take their ring sizes from the xsk pool and are left running.
+ * 	Must be called under rtnl lock.
+ * 
+ * @param ethdev 
+ * @return int 
+ */
+int nfb_xdp_restart_channels(struct nfb_ethdev *ethdev)
+{
+	struct nfb_xdp_channel *channel;
+	int i, err, ret = 0;
+
+	if (!netif_running(ethdev->netdev))
+		return 0;
+
+	nfb_xdp_xmitqs_stop(ethdev);
+	// redirected frames fall back to the channels now, hide the restarted ones before stopping them
+	for (i = 0; i < ethdev->channel_count; i++) {
+		channel = &ethdev->channels[i];
+		if (!test_bit(NFB_STATUS_IS_XSK, &channel->status))
+			channel_hide_xmit(channel);
+	}
+	synchronize_net();
+
+	for (i = 0; i < ethdev->channel_count; i++) {
+		channel = &ethdev->channels[i];
+		if (!test_bit(NFB_STATUS_IS_XSK, &channel->status))
+			channel_stop_async(channel);
+	}
+	// every stopped channel is collected and restarted even after a failure,
+	// the failed ones stay stopped and hidden from ndo_xdp_xmit
+	for (i = 0; i < ethdev->channel_count; i++) {
+		channel = &ethdev->channels[i];
+		if (test_bit(NFB_STATUS_IS_XSK, &channel->status))
+			continue;
+
+		channel_stop_wait(channel);
+		if ((err = channel_start_pp(channel))) {
+			printk(KERN_WARNING "nfb: Failed to restart channel %d, channel unusable\n", channel->nfb_index);
+			if (!ret)
+				ret = err;
+		}
+	}
+	nfb_xdp_xmitqs_start(ethdev);
+	return ret;
+}
+
+static int nfb_xdp_channels_add(struct nfb_ethdev *ethdev, u16 count)
+{
+	struct net_device *netdev = ethdev->netdev;
+	u16 i, old = ethdev->channel_count;
+	int ret;
+
+	for (i = old; i < count; i++)
+		nfb_xdp_channel_add_napi(netdev, &ethdev->channels[i]);
+
+	if ((ret = netif_set_real_num_tx_queues(netdev, count)))
+		goto err_real_num;
+	if ((ret = netif_set_real_num_rx_queues(netdev, count)))
+		goto err_real_num_rx;
+
+	if (netif_running(netdev)) {
+		for (i = old; i < count; i++) {
+			if ((ret = channel_start_pp(&ethdev->channels[i])))
+				goto err_channel_start;
+		}
+	}
+
+	// new channels are running, let ndo_xdp_xmit pick them
+	WRITE_ONCE(ethdev->channel_count, count);
+	return 0;
+
+err_channel_start:
+	while (i-- > old)
+		channel_stop(&ethdev->channels[i]);
+	netif_set_real_num_rx_queues(netdev, old);
+err_real_num_rx:
+	netif_set_real_num_tx_queues(netdev, old);
+err_real_num:
+	for (i = old; i < count; i++)
+		nfb_xdp_channel_del_napi(&ethdev->channels[i]);
+	return ret;
+}
+
+static void nfb_xdp_channels_del(struct nfb_ethdev *ethdev, u16 count)
+{
+	struct net_device *netdev = ethdev->netdev;
+	u16 i, old = ethdev->channel_count;
+
+	WRITE_ONCE(ethdev->channel_count, count);
+	// the stack doesn't select removed tx queues after this
+	netif_set_real_num_tx_queues(netdev, count);
+	netif_set_real_num_rx_queues(netdev, count);
+	for (i = count; i < old; i++)
+		channel_hide_xmit(&ethdev->channels[i]);
+	// ndo_xdp_xmit can still hold one of the removed channels
+	synchronize_net();
+
+	for (i = count; i < old; i++)
+		channel_stop_async(&ethdev->channels[i]);
+	for (i = count; i < old; i++) {
+		channel_stop_wait(&ethdev->channels[i]);
+		nfb_xdp_channel_del_napi(&ethdev->channels[i]);
+	}
+}
+
+/**
+ * @brief Changes the number of channels of the port.
+ * 	Running port keeps its other channels running, only the added ones are started
+ * 	and the removed ones stopped. RSS is spread over the new channel range unless
+ * 	the user configured the indirection table. Must be called under rtnl lock.
+ *
+ * @param ethdev
+ * @param count
+ * @return int
+ */
+int nfb_xdp_set_channel_count(struct nfb_ethdev *ethdev, u16 count)
+{
+	struct net_device *netdev = ethdev->netdev;
+	u16 i;
+	int ret;
+
+	if (count == 0 || count > ethdev->channel_max)
+		return -EINVAL;
+
+	if (count == ethdev->channel_count)
+		return 0;
+
+	if (count > ethdev->channel_count) {
+		if ((ret = nfb_xdp_channels_add(ethdev, count)))
+			return ret;
+		if (netif_running(netdev) && nfb_rss_reset(&ethdev->rss, netdev, ethdev->channels[0].nfb_index, count))
+			printk(KERN_WARNING "nfb: %s - failed to set RSS indirection table\n", netdev->name);
+		return 0;
+	}
+
+	// queues bound to AF_XDP sockets must be released first
+	for (i = count; i < ethdev->channel_count; i++) {
+		if (ethdev->channels[i].pool)
+			return -EBUSY;
+	}
+
+	// steer the traffic away from the channels before they stop
+	if (netif_running(netdev) && nfb_rss_reset(&ethdev->rss, netdev, ethdev->channels[0].nfb_index, count))
+		printk(KERN_WARNING "nfb: %s - failed to set RSS indirection table\n", netdev->name);
+	nfb_xdp_channels_del(ethdev, count);
+	return 0;
+}
+
 static int nfb_xdp_open(struct net_device *netdev)
 {
 	int ret;
@@ -164,11 +383,96 @@ static int nfb_xdp_stop(struct net_device *netdev)
 	return 0;
 }
 
+static int nfb_xdp_change_mtu(struct net_device *netdev, int new_mtu)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	struct bpf_prog *prog;
+	int old_mtu = netdev->mtu;
+	int ret;
+	bool ok;
+	u16 i;
+
+	// bound xsk pools receive each frame into single chunk
+	for (i = 0; i < ethdev->channel_count; i++) {
+		if (ethdev->channels[i].pool && !nfb_xdp_xsk_mtu_ok(ethdev->channels[i].pool, new_mtu)) {
+			netdev_warn(netdev, "MTU %d too large for the xsk pool bound to channel %u\n", new_mtu, i);
+			return -EINVAL;
+		}
+	}
+
+	// frames bigger than single page need program with frags support
+	rcu_read_lock();
+	prog = rcu_dereference(ethdev->prog);
+	ok = nfb_xdp_prog_mtu_ok(prog, new_mtu);
+	rcu_read_unlock();
+	if (!ok) {
+		netdev_warn(netdev, "MTU %d too large for the attached XDP program without frags support (max %d)\n", new_mtu, (int)NFB_XDP_SB_MTU);
+		return -EINVAL;
+	}
+
+	netdev->mtu = new_mtu;
+	// rx buffers of the page pool frag mode are sized to the MTU
+	if ((ret = nfb_xdp_restart_channels(ethdev))) {
+		netdev_warn(netdev, "failed to restart channels with MTU %d, restoring MTU %d\n", new_mtu, old_mtu);
+		netdev->mtu = old_mtu;
+		nfb_xdp_restart_channels(ethdev);
+		return ret;
+	}
+
+	nfb_xdp_set_rx_frame_len(ethdev);
+	return 0;
+}
+
+/**
+ * @brief Sums the counters of all channels and xmit queues.
+ * 	Frames consumed by XDP_DROP are the program's decision and are not counted as dropped.
+ *
+ * @param netdev
+ * @param stats
+ */
+static void nfb_xdp_get_stats64(struct net_device *netdev, struct rtnl_link_stats64 *stats)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	struct nfb_xdp_channel *channel;
+	struct nfb_xdp_rx_stats rx;
+	struct nfb_xdp_tx_stats tx;
+	u64 hw_received, hw_discarded;
+	u16 i;
+
+	// removed channels keep their counters, totals don't go back with ethtool -L
+	for (i = 0; i < ethdev->channel_max; i++) {
+		channel = &ethdev->channels[i];
+
+		nfb_xdp_rx_stats_read(channel, &rx);
+		stats->rx_packets += rx.packets;
+		stats->rx_bytes += rx.bytes;
+		stats->rx_dropped += rx.xdp_aborted + rx.redirect_err + rx.dropped;
+
+		nfb_xdp_tx_stats_read(&channel->tx_stats, &channel->tx_syncp, &tx);
+		stats->tx_packets += tx.packets;
+		stats->tx_bytes += tx.bytes;
+		stats->tx_dropped += tx.ring_full;
+
+		if (i >= ethdev->channel_count)
+			continue;
+		channel_read_hw_stats(channel, &hw_received, &hw_discarded);
+		stats->rx_missed_errors += hw_discarded;
+	}
+
+	for (i = 0; i < ethdev->xmitq_count; i++) {
+		nfb_xdp_tx_stats_read(&ethdev->xmitqs[i].stats, &ethdev->xmitqs[i].syncp, &tx);
+		stats->tx_packets += tx.packets;
+		stats->tx_bytes += tx.bytes;
+		stats->tx_dropped += tx.ring_full;
+	}
+}
+
 static const struct net_device_ops netdev_ops = {
 	.ndo_open = nfb_xdp_open,
 	.ndo_stop = nfb_xdp_stop,
+	.ndo_change_mtu = nfb_xdp_change_mtu,
 	.ndo_start_xmit = nfb_xctrl_start_xmit,
-	// .ndo_get_stats64 = nfb_xdp_get_stats,
+	.ndo_get_stats64 = nfb_xdp_get_stats64,
 	.ndo_bpf = nfb_xdp,
 	.ndo_xdp_xmit = nfb_xctrl_xdp_xmit,
 	.ndo_xsk_wakeup = nfb_xsk_wakeup,
@@ -187,8 +491,10 @@ void destroy_ethdev(struct nfb_ethdev *ethdev)
 		nc_rxmac_close(ethdev->nc_rxmac);
 	if (ethdev->nc_txmac)
 		nc_txmac_close(ethdev->nc_txmac);
+	nfb_rss_deinit(&ethdev->rss);
 
 	nfb_xdp_sysfs_deinit_ethdev(ethdev);
+	nfb_xdp_xmitqs_deinit(ethdev);
 	nfb_xdp_channels_deinit(netdev);
 	free_netdev(netdev);
 }
@@ -227,7 +533,8 @@ struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 ind
 	int ret;
 
 	// allocate net_device
-	netdev = alloc_etherdev_mqs(sizeof(*ethdev), module->txqc / module->ethc, module->rxqc / module->ethc);
+	// spare tx queues are not exposed to the stack, they serve ndo_xdp_xmit only
+	netdev = alloc_etherdev_mqs(sizeof(*ethdev), module->rxqc / module->ethc, module->rxqc / module->ethc);
 	if (!netdev) {
 		printk(KERN_ERR "nfb: Failed to allocate netdevice.\n");
 		goto err_alloc_etherdev;
@@ -246,10 +553,15 @@ struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 ind
 	// Initialize nfb_ethdev struct
 	ethdev = netdev_priv(netdev);
 	ethdev->index = index;
-	ethdev->channel_count = module->rxqc / module->ethc;
-	ethdev->channel_offset = ethdev->channel_count * index;
+	ethdev->channel_max = module->rxqc / module->ethc;
+	ethdev->channel_count = ethdev->channel_max;
+	ethdev->channel_offset = ethdev->channel_max * index;
+	ethdev->xmitq_count = (module->txqc - module->rxqc) / module->ethc;
+	ethdev->rx_desc_cnt = NFB_XDP_DESC_CNT;
+	ethdev->tx_desc_cnt = NFB_XDP_DESC_CNT;
 	ethdev->module = module;
 	ethdev->nfb = nfb;
+	spin_lock_init(&ethdev->prog_lock);
 	ethdev->netdev = netdev;
 
 	// Initialize channels
@@ -257,6 +569,10 @@ struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 ind
 	if (ret)
 		goto err_channels_init;
 
+	// without xmit queues ndo_xdp_xmit uses the locked channels
+	if (nfb_xdp_xmitqs_init(ethdev))
+		printk(KERN_WARNING "nfb: Failed to init xdp xmit queues.\n");
+
 	// NOTE: nc_mac_enable ~ nfb-eth -e1
 	// open mac component
 	fdt_comp = nc_eth_get_rxmac_node(nfb->fdt, fdt_offset);
@@ -269,12 +585,28 @@ struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 ind
 	if (IS_ERR(ethdev->nc_txmac))
 		ethdev->nc_txmac = NULL;
 
+	nfb_rss_init(&ethdev->rss, nfb, index, module->rxqc);
+
+	// frames longer than a page are received into multiple buffers
+#ifdef CONFIG_HAVE_XDP_FRAGS
+	if (ethdev->nc_rxmac && ethdev->nc_rxmac->mtu > ETH_HLEN + VLAN_HLEN + ETH_FCS_LEN)
+		netdev->max_mtu = ethdev->nc_rxmac->mtu - ETH_HLEN - VLAN_HLEN - ETH_FCS_LEN;
+	else
+		netdev->max_mtu = NFB_XDP_SB_MTU;
+#else
+	netdev->max_mtu = NFB_XDP_SB_MTU;
+#endif
+
 	// init periodical checking of link status
 	INIT_WORK(&ethdev->link_work, link_work_handler);
 	timer_setup(&ethdev->link_timer, link_timer_callback, 0);
 	netdev->netdev_ops = &netdev_ops;
+#ifdef CONFIG_HAVE_XDP_METADATA_OPS
+	netdev->xdp_metadata_ops = &nfb_xdp_metadata_ops;
+#endif
+	nfb_xdp_set_ethtool_ops(netdev);
 
-	SET_NETDEV_DEV(netdev, &nfb->pci->dev);
+	SET_NETDEV_DEV(netdev, nfb->dma_dev);
 
 	// set mac address
 	nfb_net_set_dev_addr(nfb, netdev, index);
@@ -299,6 +631,8 @@ struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 ind
 
 err_register_netdev:
 err_sysfs_init:
+	nfb_rss_deinit(&ethdev->rss);
+	nfb_xdp_xmitqs_deinit(ethdev);
 	nfb_xdp_channels_deinit(netdev);
 	if (ethdev->nc_rxmac)
 		nc_rxmac_close(ethdev->nc_rxmac);
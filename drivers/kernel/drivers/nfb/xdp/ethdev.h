@@ -12,6 +12,7 @@
 
 #include <linux/netdevice.h>
 #include "../nfb.h"
+#include "../rss.h"
 
 // structure describing one ETH port
 struct nfb_ethdev {
@@ -23,12 +24,22 @@ struct nfb_ethdev {
 
 	int index; // index of ETH port
 
-	u16 channel_count;
+	u16 channel_count; // enabled channels, changed with ethtool -L
+	u16 channel_max; // allocated channels, queues of the card dedicated to the port
 	struct nfb_xdp_channel *channels;
 	// offset to nfb queue id
 	// used by ndptool for mapping nfb queue id to netdev queue id
 	u16 channel_offset;
 
+	// ring sizes of the page pool mode, rx ring size is also the page pool size
+	u32 rx_desc_cnt;
+	u32 tx_desc_cnt;
+
+	// spare tx queues used by ndo_xdp_xmit, each is owned by single CPU
+	u16 xmitq_count;
+	struct nfb_xdp_xmitq *xmitqs;
+	struct nfb_xdp_xmitq __rcu * __percpu *cpu_xmitq;
+
 	// work setting interface up or down based on the state of the mac
 	struct timer_list link_timer;
 	struct work_struct link_work;
@@ -36,12 +47,18 @@ struct nfb_ethdev {
 	// nfb components
 	struct nc_rxmac *nc_rxmac;
 	struct nc_txmac *nc_txmac;
+	struct nfb_rss rss;
 
 	// prog is rcu protected pointer
-	struct bpf_prog *prog; // xdp prog
+	struct bpf_prog __rcu *prog; // xdp prog
 	spinlock_t prog_lock;
 };
 
 struct nfb_ethdev *create_ethdev(struct nfb_xdp *module, int fdt_offset, u16 index);
 void destroy_ethdev(struct nfb_ethdev *ethdev);
+int nfb_xdp_restart_channels(struct nfb_ethdev *ethdev);
+void nfb_xdp_set_rx_frame_len(struct nfb_ethdev *ethdev);
+int nfb_xdp_set_channel_count(struct nfb_ethdev *ethdev, u16 count);
+
+void nfb_xdp_set_ethtool_ops(struct net_device *netdev);
 #endif // NFB_XDP_ETHDEV
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * XDP driver of the NFB platform - ethtool support
+ *
+ * Copyright (C) 2025 CESNET
+ * Author(s):
+ *   Richard Hyros <hyros@cesnet.cz>
+ */
+
+#include <linux/netdevice.h>
+#include <linux/ethtool.h>
+#include <linux/log2.h>
+
+#include "../nfb.h"
+
+#include "ethdev.h"
+#include "channel.h"
+#include "xmitq.h"
+
+#ifdef CONFIG_HAVE_ETHTOOL_KERNEL_RINGPARAM
+static void nfb_xdp_get_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack)
+#else
+static void nfb_xdp_get_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	ring->rx_max_pending = NFB_XDP_DESC_CNT_MAX;
+	ring->tx_max_pending = NFB_XDP_DESC_CNT_MAX;
+	ring->rx_pending = ethdev->rx_desc_cnt;
+	ring->tx_pending = ethdev->tx_desc_cnt;
+}
+
+#ifdef CONFIG_HAVE_ETHTOOL_KERNEL_RINGPARAM
+static int nfb_xdp_set_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kernel_ring, struct netlink_ext_ack *extack)
+#else
+static int nfb_xdp_set_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	u32 old_rx = ethdev->rx_desc_cnt, old_tx = ethdev->tx_desc_cnt;
+	u32 rx, tx;
+	int ret;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+
+	if (ring->rx_pending < NFB_XDP_DESC_CNT_MIN || ring->rx_pending > NFB_XDP_DESC_CNT_MAX ||
+			ring->tx_pending < NFB_XDP_DESC_CNT_MIN || ring->tx_pending > NFB_XDP_DESC_CNT_MAX)
+		return -EINVAL;
+
+	// controller pointers are masked, ring sizes must be power of 2
+	rx = roundup_pow_of_two(ring->rx_pending);
+	tx = roundup_pow_of_two(ring->tx_pending);
+	if (rx == ethdev->rx_desc_cnt && tx == ethdev->tx_desc_cnt)
+		return 0;
+
+	WRITE_ONCE(ethdev->rx_desc_cnt, rx);
+	WRITE_ONCE(ethdev->tx_desc_cnt, tx);
+	if ((ret = nfb_xdp_restart_channels(ethdev))) {
+		// larger rings may not fit, the previous sizes did
+		netdev_warn(netdev, "failed to restart channels with %u/%u descriptors, restoring %u/%u\n", rx, tx, old_rx, old_tx);
+		WRITE_ONCE(ethdev->rx_desc_cnt, old_rx);
+		WRITE_ONCE(ethdev->tx_desc_cnt, old_tx);
+		nfb_xdp_restart_channels(ethdev);
+	}
+	return ret;
+}
+
+// per channel counters, prefixed with ch<index>_
+static const char nfb_xdp_channel_stat_names[][ETH_GSTRING_LEN] = {
+	"rx_packets",
+	"rx_bytes",
+	"xdp_pass",
+	"xdp_drop",
+	"xdp_tx",
+	"xdp_redirect",
+	"xdp_aborted",
+	"redirect_err",
+	"alloc_fail",
+	"rx_dropped",
+	"tx_packets",
+	"tx_bytes",
+	"tx_ring_full",
+	"hw_rx_packets",
+	"hw_rx_discarded",
+};
+
+// counters of the xmit queues summed together
+static const char nfb_xdp_xmit_stat_names[][ETH_GSTRING_LEN] = {
+	"xmit_tx_packets",
+	"xmit_tx_bytes",
+	"xmit_tx_ring_full",
+};
+
+#define NFB_XDP_CHANNEL_STATS ARRAY_SIZE(nfb_xdp_channel_stat_names)
+#define NFB_XDP_XMIT_STATS ARRAY_SIZE(nfb_xdp_xmit_stat_names)
+
+static int nfb_xdp_get_sset_count(struct net_device *netdev, int sset)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ethdev->channel_count * NFB_XDP_CHANNEL_STATS + NFB_XDP_XMIT_STATS;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void nfb_xdp_get_strings(struct net_device *netdev, u32 sset, u8 *data)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	unsigned i, j;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < ethdev->channel_count; i++) {
+		for (j = 0; j < NFB_XDP_CHANNEL_STATS; j++) {
+			snprintf(data, ETH_GSTRING_LEN, "ch%u_%s", i, nfb_xdp_channel_stat_names[j]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+	memcpy(data, nfb_xdp_xmit_stat_names, sizeof(nfb_xdp_xmit_stat_names));
+}
+
+static void nfb_xdp_get_ethtool_stats(struct net_device *netdev, struct ethtool_stats *estats, u64 *data)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+	struct nfb_xdp_channel *channel;
+	struct nfb_xdp_rx_stats rx;
+	struct nfb_xdp_tx_stats tx, xmit = {};
+	u64 hw_received, hw_discarded;
+	unsigned i;
+
+	for (i = 0; i < ethdev->channel_count; i++) {
+		channel = &ethdev->channels[i];
+		nfb_xdp_rx_stats_read(channel, &rx);
+		nfb_xdp_tx_stats_read(&channel->tx_stats, &channel->tx_syncp, &tx);
+		channel_read_hw_stats(channel, &hw_received, &hw_discarded);
+
+		// keep in order with nfb_xdp_channel_stat_names
+		*data++ = rx.packets;
+		*data++ = rx.bytes;
+		*data++ = rx.xdp_pass;
+		*data++ = rx.xdp_drop;
+		*data++ = rx.xdp_tx;
+		*data++ = rx.xdp_redirect;
+		*data++ = rx.xdp_aborted;
+		*data++ = rx.redirect_err;
+		*data++ = rx.alloc_fail;
+		*data++ = rx.dropped;
+		*data++ = tx.packets;
+		*data++ = tx.bytes;
+		*data++ = tx.ring_full;
+		*data++ = hw_received;
+		*data++ = hw_discarded;
+	}
+
+	for (i = 0; i < ethdev->xmitq_count; i++) {
+		nfb_xdp_tx_stats_read(&ethdev->xmitqs[i].stats, &ethdev->xmitqs[i].syncp, &tx);
+		xmit.packets += tx.packets;
+		xmit.bytes += tx.bytes;
+		xmit.ring_full += tx.ring_full;
+	}
+	*data++ = xmit.packets;
+	*data++ = xmit.bytes;
+	*data++ = xmit.ring_full;
+}
+
+static void nfb_xdp_get_channels(struct net_device *netdev, struct ethtool_channels *channels)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	// channels are rx/tx queue pairs
+	channels->max_combined = ethdev->channel_max;
+	channels->combined_count = ethdev->channel_count;
+}
+
+static int nfb_xdp_set_channels(struct net_device *netdev, struct ethtool_channels *channels)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	if (channels->rx_count || channels->tx_count || channels->other_count)
+		return -EINVAL;
+
+	return nfb_xdp_set_channel_count(ethdev, channels->combined_count);
+}
+
+static int nfb_xdp_get_rxnfc(struct net_device *netdev, struct ethtool_rxnfc *cmd, u32 *rule_locs)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	switch (cmd->cmd) {
+	case ETHTOOL_GRXRINGS:
+		cmd->data = ethdev->channel_count;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static u32 nfb_xdp_get_rxfh_indir_size(struct net_device *netdev)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	return nfb_rss_get_indir_size(&ethdev->rss);
+}
+
+static u32 nfb_xdp_get_rxfh_key_size(struct net_device *netdev)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	return nfb_rss_get_key_size(&ethdev->rss);
+}
+
+// firmware hashes with Toeplitz function only
+#ifdef CONFIG_HAVE_ETHTOOL_RXFH_PARAM
+static int nfb_xdp_get_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	rxfh->hfunc = ETH_RSS_HASH_TOP;
+	return nfb_rss_get(&ethdev->rss, rxfh->indir, rxfh->key);
+}
+
+static int nfb_xdp_set_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh, struct netlink_ext_ack *extack)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	if (rxfh->hfunc != ETH_RSS_HASH_NO_CHANGE && rxfh->hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	return nfb_rss_set(&ethdev->rss, rxfh->indir, rxfh->key);
+}
+#else
+static int nfb_xdp_get_rxfh(struct net_device *netdev, u32 *indir, u8 *key, u8 *hfunc)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	if (hfunc)
+		*hfunc = ETH_RSS_HASH_TOP;
+	return nfb_rss_get(&ethdev->rss, indir, key);
+}
+
+static int nfb_xdp_set_rxfh(struct net_device *netdev, const u32 *indir, const u8 *key, const u8 hfunc)
+{
+	struct nfb_ethdev *ethdev = netdev_priv(netdev);
+
+	if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	return nfb_rss_set(&ethdev->rss, indir, key);
+}
+#endif
+
+static const struct ethtool_ops nfb_xdp_ethtool_ops = {
+	.get_link = ethtool_op_get_link,
+	.get_ringparam = nfb_xdp_get_ringparam,
+	.set_ringparam = nfb_xdp_set_ringparam,
+	.get_sset_count = nfb_xdp_get_sset_count,
+	.get_strings = nfb_xdp_get_strings,
+	.get_ethtool_stats = nfb_xdp_get_ethtool_stats,
+	.get_channels = nfb_xdp_get_channels,
+	.set_channels = nfb_xdp_set_channels,
+	.get_rxnfc = nfb_xdp_get_rxnfc,
+	.get_rxfh_indir_size = nfb_xdp_get_rxfh_indir_size,
+	.get_rxfh_key_size = nfb_xdp_get_rxfh_key_size,
+	.get_rxfh = nfb_xdp_get_rxfh,
+	.set_rxfh = nfb_xdp_set_rxfh,
+};
+
+void nfb_xdp_set_ethtool_ops(struct net_device *netdev)
+{
+	netdev->ethtool_ops = &nfb_xdp_ethtool_ops;
+}
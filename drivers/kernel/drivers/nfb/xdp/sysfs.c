@@ -9,6 +9,8 @@
 
 #include "sysfs.h"
 #include "driver.h"
+#include "channel.h"
+#include "xmitq.h"
 
 #include <linux/pci.h>
 #include <linux/netdevice.h>
@@ -18,9 +20,7 @@
 static ssize_t channel_total_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct nfb_xdp *module = dev_get_drvdata(dev);
-	if (module->rxqc != module->txqc)
-		return -EINVAL;
-
+	// spare tx queues are not channels
 	return sysfs_emit(buf, "%d\n", module->rxqc);
 }
 static DEVICE_ATTR_RO(channel_total);
@@ -59,6 +59,13 @@ static ssize_t channel_count_show(struct device *dev, struct device_attribute *a
 }
 static DEVICE_ATTR_RO(channel_count);
 
+static ssize_t channel_max_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_ethdev *ethdev = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", ethdev->channel_max);
+}
+static DEVICE_ATTR_RO(channel_max);
+
 static ssize_t channel_offset_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct nfb_ethdev *ethdev = dev_get_drvdata(dev);
@@ -73,26 +80,213 @@ static ssize_t ifname_show(struct device *dev, struct device_attribute *attr, ch
 }
 static DEVICE_ATTR_RO(ifname);
 
+// one line per CPU owning a queue: "<cpu> <tx queue>", CPUs not listed use the locked channels
+static ssize_t xmit_queue_map_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_ethdev *ethdev = dev_get_drvdata(dev);
+	struct nfb_xdp_xmitq *xmitq;
+	unsigned int cpu;
+	int len = 0;
+
+	if (!ethdev->cpu_xmitq)
+		return 0;
+
+	// bounded by the number of spare tx queues, not by the number of possible CPUs
+	rcu_read_lock();
+	for_each_possible_cpu(cpu) {
+		xmitq = rcu_dereference(*per_cpu_ptr(ethdev->cpu_xmitq, cpu));
+		if (xmitq)
+			len += sysfs_emit_at(buf, len, "%u %u\n", cpu, xmitq->nfb_index);
+	}
+	rcu_read_unlock();
+	return len;
+}
+static DEVICE_ATTR_RO(xmit_queue_map);
+
+static ssize_t xmit_queue_count_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_ethdev *ethdev = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", ethdev->xmitq_count);
+}
+static DEVICE_ATTR_RO(xmit_queue_count);
+
 struct attribute *nfb_ethdev_attrs[] = {
 	&dev_attr_channel_count.attr,
+	&dev_attr_channel_max.attr,
 	&dev_attr_channel_offset.attr,
 	&dev_attr_ifname.attr,
+	&dev_attr_xmit_queue_map.attr,
+	&dev_attr_xmit_queue_count.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(nfb_ethdev);
 
+// --------------------------- SYSFS files for each channel -------------------------------
+
+static ssize_t busy_poll_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(channel->poll.busy_poll_us));
+}
+
+static ssize_t busy_poll_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll.busy_poll_us, val);
+	return size;
+}
+static DEVICE_ATTR_RW(busy_poll_us);
+
+static ssize_t sleep_min_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(channel->poll.sleep_min_us));
+}
+
+static ssize_t sleep_min_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	// zero would turn the idle sleep into a spin
+	if (val == 0 || val > READ_ONCE(channel->poll.sleep_max_us))
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll.sleep_min_us, val);
+	return size;
+}
+static DEVICE_ATTR_RW(sleep_min_us);
+
+static ssize_t sleep_max_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(channel->poll.sleep_max_us));
+}
+
+static ssize_t sleep_max_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	if (val < READ_ONCE(channel->poll.sleep_min_us))
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll.sleep_max_us, val);
+	return size;
+}
+static DEVICE_ATTR_RW(sleep_max_us);
+
+static ssize_t irq_wakeup_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(channel->poll.irq_wakeup));
+}
+
+static ssize_t irq_wakeup_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	if (val && !channel->ethdev->module->irq_available)
+		return -ENODEV;
+
+	WRITE_ONCE(channel->poll.irq_wakeup, val);
+	return size;
+}
+static DEVICE_ATTR_RW(irq_wakeup);
+
+static ssize_t native_napi_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(channel->poll.native_napi));
+}
+
+// takes effect on the next start of the channel
+static ssize_t native_napi_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct nfb_xdp_channel *channel = dev_get_drvdata(dev);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(channel->poll.native_napi, val);
+	return size;
+}
+static DEVICE_ATTR_RW(native_napi);
+
+struct attribute *nfb_channel_attrs[] = {
+	&dev_attr_busy_poll_us.attr,
+	&dev_attr_sleep_min_us.attr,
+	&dev_attr_sleep_max_us.attr,
+	&dev_attr_irq_wakeup.attr,
+	&dev_attr_native_napi.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(nfb_channel);
+
+static int nfb_xdp_sysfs_init_channel(struct nfb_xdp_channel *channel)
+{
+	struct device *dev = &channel->sysfsdev;
+	device_initialize(dev);
+	dev->parent = &channel->ethdev->sysfsdev;
+	dev->groups = nfb_channel_groups;
+	dev_set_name(dev, "channel%d", channel->index);
+	dev_set_drvdata(dev, channel);
+	return device_add(dev);
+}
+
+static void nfb_xdp_sysfs_deinit_channel(struct nfb_xdp_channel *channel)
+{
+	device_del(&channel->sysfsdev);
+}
+
 int nfb_xdp_sysfs_init_ethdev(struct nfb_ethdev *ethdev)
 {
 	struct device *dev = &ethdev->sysfsdev;
+	int i, ret;
+
 	device_initialize(dev); 
 	dev->parent = &ethdev->module->dev;
 	dev->groups = nfb_ethdev_groups;
 	dev_set_name(dev, "ethdev%d", ethdev->index);
 	dev_set_drvdata(dev, ethdev);
-	return device_add(dev);
+	if ((ret = device_add(dev)))
+		return ret;
+
+	// disabled channels can be tuned before ethtool -L enables them
+	for (i = 0; i < ethdev->channel_max; i++) {
+		if ((ret = nfb_xdp_sysfs_init_channel(&ethdev->channels[i])))
+			goto err_channel;
+	}
+	return 0;
+
+err_channel:
+	while (--i >= 0)
+		nfb_xdp_sysfs_deinit_channel(&ethdev->channels[i]);
+	device_del(dev);
+	return ret;
 }
 
 void nfb_xdp_sysfs_deinit_ethdev(struct nfb_ethdev *ethdev)
 {
+	int i;
+
+	for (i = 0; i < ethdev->channel_max; i++)
+		nfb_xdp_sysfs_deinit_channel(&ethdev->channels[i]);
 	device_del(&ethdev->sysfsdev);
 }
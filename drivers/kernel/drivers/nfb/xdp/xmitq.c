@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * XDP driver of the NFB platform - xdp xmit queues
+ *	spare tx queues of the card are dedicated to single CPU each,
+ *	so the tx lock of the queue is practically never contended
+ *
+ * Copyright (C) 2025 CESNET
+ * Author(s):
+ *   Richard Hyros <hyros@cesnet.cz>
+ */
+
+#include <linux/pci.h>
+#include <linux/cpumask.h>
+
+#include "../nfb.h"
+
+#include "driver.h"
+#include "channel.h"
+#include "ctrl_xdp.h"
+#include "ctrl_xdp_common.h"
+#include "xmitq.h"
+
+/**
+ * @brief Returns the frames the card already sent.
+ * 	Without it the frames wait for the next ndo_xdp_xmit of the owning CPU,
+ * 	which may not come, and page pools of other devices can't be released meanwhile.
+ *
+ * @param timer
+ * @return enum hrtimer_restart
+ */
+static enum hrtimer_restart nfb_xdp_xmitq_timer(struct hrtimer *timer)
+{
+	struct nfb_xdp_xmitq *xmitq = container_of(timer, struct nfb_xdp_xmitq, timer);
+	struct xctrl *ctrl = xmitq->ctrl;
+	u32 pending;
+
+	// the timer is migrated to another CPU when the owner goes offline,
+	// the lock keeps it apart from the owner coming back
+	spin_lock(&ctrl->tx.tx_lock);
+	{
+		nc_ndp_ctrl_hdp_update(&ctrl->c);
+		nfb_xctrl_tx_free_buffers(ctrl, 0);
+		pending = (ctrl->c.sdp - ctrl->tx.fdp) & ctrl->c.mdp;
+	}
+	spin_unlock(&ctrl->tx.tx_lock);
+	if (!pending)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime((u64)NFB_XDP_XMITQ_RECLAIM_US * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+static void nfb_xdp_xmitq_init_timer(struct nfb_xdp_xmitq *xmitq)
+{
+#ifdef CONFIG_HAVE_HRTIMER_SETUP
+	hrtimer_setup(&xmitq->timer, nfb_xdp_xmitq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
+#else
+	hrtimer_init(&xmitq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
+	xmitq->timer.function = nfb_xdp_xmitq_timer;
+#endif
+}
+
+int nfb_xdp_xmitqs_init(struct nfb_ethdev *ethdev)
+{
+	u16 i;
+
+	if (!ethdev->xmitq_count)
+		return 0;
+
+	ethdev->xmitqs = kcalloc(ethdev->xmitq_count, sizeof(*ethdev->xmitqs), GFP_KERNEL);
+	if (!ethdev->xmitqs)
+		goto err_xmitqs_alloc;
+
+	ethdev->cpu_xmitq = alloc_percpu(struct nfb_xdp_xmitq __rcu *);
+	if (!ethdev->cpu_xmitq)
+		goto err_percpu_alloc;
+
+	// spare tx queues of the port follow right after the queues paired with rx
+	for (i = 0; i < ethdev->xmitq_count; i++) {
+		ethdev->xmitqs[i].nfb_index = ethdev->channel_max + i + (ethdev->channel_max + ethdev->xmitq_count) * ethdev->index;
+		ethdev->xmitqs[i].cpu = -1;
+		nfb_xdp_xmitq_init_timer(&ethdev->xmitqs[i]);
+		u64_stats_init(&ethdev->xmitqs[i].syncp);
+	}
+	return 0;
+
+err_percpu_alloc:
+	kfree(ethdev->xmitqs);
+	ethdev->xmitqs = NULL;
+err_xmitqs_alloc:
+	ethdev->xmitq_count = 0;
+	return -ENOMEM;
+}
+
+void nfb_xdp_xmitqs_deinit(struct nfb_ethdev *ethdev)
+{
+	free_percpu(ethdev->cpu_xmitq);
+	ethdev->cpu_xmitq = NULL;
+	kfree(ethdev->xmitqs);
+	ethdev->xmitqs = NULL;
+}
+
+/**
+ * @brief Starts the xmit queues and assigns them to online CPUs.
+ * 	CPUs left without a queue keep using the shared locked channels.
+ * 	Failing queue is left unused, it is not fatal for the netdevice.
+ *
+ * @param ethdev
+ */
+void nfb_xdp_xmitqs_start(struct nfb_ethdev *ethdev)
+{
+	struct nfb_xdp_xmitq *xmitq;
+	unsigned int cpu;
+	u16 i = 0;
+
+	if (!ethdev->xmitq_count)
+		return;
+
+	for_each_online_cpu(cpu) {
+		for (; i < ethdev->xmitq_count; i++) {
+			xmitq = &ethdev->xmitqs[i];
+			if (!(xmitq->ctrl = nfb_xctrl_alloc_xmit(ethdev->netdev, xmitq->nfb_index, ethdev->tx_desc_cnt)))
+				continue;
+			if (nfb_xctrl_start(xmitq->ctrl)) {
+				printk(KERN_ERR "nfb: %s - failed to start xdp xmit queue %u\n", ethdev->netdev->name, xmitq->nfb_index);
+				nfb_xctrl_destroy_pp(xmitq->ctrl);
+				xmitq->ctrl = NULL;
+				continue;
+			}
+			xmitq->cpu = cpu;
+			rcu_assign_pointer(*per_cpu_ptr(ethdev->cpu_xmitq, cpu), xmitq);
+			i++;
+			break;
+		}
+	}
+}
+
+void nfb_xdp_xmitqs_stop(struct nfb_ethdev *ethdev)
+{
+	struct nfb_xdp_xmitq *xmitq;
+	unsigned int cpu;
+	u16 i;
+
+	if (!ethdev->xmitq_count)
+		return;
+
+	for_each_possible_cpu(cpu)
+		RCU_INIT_POINTER(*per_cpu_ptr(ethdev->cpu_xmitq, cpu), NULL);
+	// wait for ndo_xdp_xmit calls still using the queues
+	synchronize_rcu();
+
+	// let the queues drain in parallel, destroy waits for each of them
+	for (i = 0; i < ethdev->xmitq_count; i++) {
+		// nothing arms the timer anymore
+		hrtimer_cancel(&ethdev->xmitqs[i].timer);
+		if (ethdev->xmitqs[i].ctrl)
+			nfb_xctrl_stop_async(ethdev->xmitqs[i].ctrl);
+	}
+
+	for (i = 0; i < ethdev->xmitq_count; i++) {
+		xmitq = &ethdev->xmitqs[i];
+		if (xmitq->ctrl) {
+			nfb_xctrl_destroy_pp(xmitq->ctrl);
+			xmitq->ctrl = NULL;
+		}
+		xmitq->cpu = -1;
+	}
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+/*
+ * XDP driver of the NFB platform - header file for xdp xmit queues
+ *
+ * Copyright (C) 2025 CESNET
+ * Author(s):
+ *   Richard Hyros <hyros@cesnet.cz>
+ */
+
+#ifndef NFB_XDP_XMITQ_H
+#define NFB_XDP_XMITQ_H
+
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include "ethdev.h"
+#include "channel.h"
+
+// delay of the tx reclaim after the last ndo_xdp_xmit of the CPU
+#define NFB_XDP_XMITQ_RECLAIM_US 100
+
+// spare tx queue dedicated to ndo_xdp_xmit of one CPU
+struct nfb_xdp_xmitq {
+	struct xctrl *ctrl;
+	u16 nfb_index; // tx queue in the context of the card
+	int cpu; // the only CPU submitting onto this queue, -1 when unused
+
+	// softirq timer pinned to the owner, returns the frames when the CPU stops transmitting
+	struct hrtimer timer;
+
+	struct nfb_xdp_tx_stats stats;
+	struct u64_stats_sync syncp;
+};
+
+int nfb_xdp_xmitqs_init(struct nfb_ethdev *ethdev);
+void nfb_xdp_xmitqs_deinit(struct nfb_ethdev *ethdev);
+void nfb_xdp_xmitqs_start(struct nfb_ethdev *ethdev);
+void nfb_xdp_xmitqs_stop(struct nfb_ethdev *ethdev);
+
+/**
+ * @brief Returns the xmit queue owned by the current CPU.
+ * 	Must be called with BH disabled inside rcu read section (ndo_xdp_xmit context).
+ *
+ * @param ethdev
+ * @return queue or NULL when the CPU has to use the shared locked channels
+ */
+static inline struct nfb_xdp_xmitq *nfb_xdp_xmitq_get(struct nfb_ethdev *ethdev)
+{
+	if (!ethdev->cpu_xmitq)
+		return NULL;
+	return rcu_dereference_check(*this_cpu_ptr(ethdev->cpu_xmitq), rcu_read_lock_bh_held());
+}
+
+/**
+ * @brief Schedules the tx reclaim of the xmit queue on the current CPU.
+ * 	The timer runs in softirq of the owning CPU unless CPU hotplug migrated it.
+ *
+ * @param xmitq
+ */
+static inline void nfb_xdp_xmitq_arm(struct nfb_xdp_xmitq *xmitq)
+{
+	if (!hrtimer_is_queued(&xmitq->timer))
+		hrtimer_start(&xmitq->timer, ns_to_ktime((u64)NFB_XDP_XMITQ_RECLAIM_US * NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED_SOFT);
+}
+
+#endif // NFB_XDP_XMITQ_H
@@ -62,6 +62,24 @@ struct ndp_subscription_sync {
 	__u64 swptr;
 };
 
+/**
+ * struct ndp_subscriber_wake
+ *
+ * @eventfd: eventfd signalled together with poll wakeup, -1 to detach
+ * @thresh:  wake as soon as any subscribed RX channel has at least @thresh
+ *           items pending (packets for NDP controllers, bytes for SZE);
+ *           0 for the module default
+ * @period:  period of the timer, which checks for any pending data, in us;
+ *           at least 10, 0 for the module default
+ * @flags:   reserved for future use, must be 0
+ */
+struct ndp_subscriber_wake {
+	__s32 eventfd;
+	__u32 thresh;
+	__u32 period;
+	__u32 flags;
+};
+
 /*
  * NDP_IOC_SUBSCRIBE: Subscripe channel selected by index and type
  * 	- reads: index, type, flags
@@ -72,5 +90,6 @@ struct ndp_subscription_sync {
 #define NDP_IOC_START		_IOWR(NDP_IOC, 17, struct ndp_subscription_sync)
 #define NDP_IOC_STOP 		_IOWR(NDP_IOC, 18, struct ndp_subscription_sync)
 #define NDP_IOC_SYNC		_IOWR(NDP_IOC, 19, struct ndp_subscription_sync)
+#define NDP_IOC_WAKE		_IOW(NDP_IOC, 20, struct ndp_subscriber_wake)
 
 #endif /* _LINUX_NDP_H_FILE_*/